@@ -32,18 +32,25 @@
 
 #include "xdg-app-builtins.h"
 #include "xdg-app-utils.h"
+#include "xdg-app-bundle.h"
 #include "xdg-app-chain-input-stream.h"
 
 static char *opt_arch;
 static char *opt_repo_url;
 static gboolean opt_runtime = FALSE;
 static char **opt_gpg_file;
+static gboolean opt_indexed = FALSE;
+static char *opt_compression;
+static char *opt_from;
 
 static GOptionEntry options[] = {
   { "runtime", 0, 0, G_OPTION_ARG_NONE, &opt_runtime, "Export runtime instead of app"},
   { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, "Arch to bundle for", "ARCH" },
   { "repo-url", 0, 0, G_OPTION_ARG_STRING, &opt_repo_url, "Url for repo", "URL" },
   { "gpg-keys", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_gpg_file, "Add GPG key from FILE (- for stdin)", "FILE" },
+  { "indexed", 0, 0, G_OPTION_ARG_NONE, &opt_indexed, "Create an indexed bundle that installs in parallel"},
+  { "from", 0, 0, G_OPTION_ARG_STRING, &opt_from, "Only include changes since COMMIT, to update an installed bundle", "COMMIT" },
+  { "compression", 0, 0, G_OPTION_ARG_STRING, &opt_compression, "Compression for indexed bundles (zlib or none)", "TYPE" },
 
   { NULL }
 };
@@ -109,6 +116,8 @@ xdg_app_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
   const char *branch;
   g_autofree char *full_branch = NULL;
   g_autofree char *commit_checksum = NULL;
+  g_autofree char *from_checksum = NULL;
+  XdgAppBundleCompression compression = XDG_APP_BUNDLE_COMPRESSION_ZLIB;
   GVariantBuilder metadata_builder;
   GVariantBuilder param_builder;
 
@@ -129,10 +138,23 @@ xdg_app_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
   else
     branch = "master";
 
+  if (opt_compression != NULL)
+    {
+      if (!opt_indexed)
+        return usage_error (context, "--compression requires --indexed", error);
+
+      if (strcmp (opt_compression, "zlib") == 0)
+        compression = XDG_APP_BUNDLE_COMPRESSION_ZLIB;
+      else if (strcmp (opt_compression, "none") == 0)
+        compression = XDG_APP_BUNDLE_COMPRESSION_NONE;
+      else
+        return usage_error (context, "Unknown compression type, use zlib or none", error);
+    }
+
   repofile = g_file_new_for_commandline_arg (location);
   repo = ostree_repo_new (repofile);
 
-  if (!xdg_app_supports_bundles (repo))
+  if (!opt_indexed && !xdg_app_supports_bundles (repo))
     return xdg_app_fail (error, "Your version of ostree is too old to support single-file bundles");
 
   if (!g_file_query_exists (repofile, cancellable))
@@ -157,6 +179,10 @@ xdg_app_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
   if (!ostree_repo_resolve_rev (repo, full_branch, FALSE, &commit_checksum, error))
     return FALSE;
 
+  if (opt_from != NULL &&
+      !ostree_repo_resolve_rev (repo, opt_from, FALSE, &from_checksum, error))
+    return FALSE;
+
   g_variant_builder_init (&metadata_builder, G_VARIANT_TYPE ("a{sv}"));
   g_variant_builder_add (&metadata_builder, "{sv}", "ref", g_variant_new_string (full_branch));
   if (opt_repo_url)
@@ -176,6 +202,16 @@ xdg_app_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
                                                       g_bytes_get_size (gpg_data),
                                                       1));
 
+  if (opt_indexed)
+    {
+      if (from_checksum)
+        g_variant_builder_add (&metadata_builder, "{sv}", "from-commit", g_variant_new_string (from_checksum));
+
+      return xdg_app_bundle_write (repo, from_checksum, commit_checksum,
+                                   g_variant_builder_end (&metadata_builder),
+                                   compression, file, cancellable, error);
+    }
+
   g_variant_builder_init (&param_builder, G_VARIANT_TYPE ("a{sv}"));
   g_variant_builder_add (&param_builder, "{sv}", "min-fallback-size", g_variant_new_uint32 (0));
   g_variant_builder_add (&param_builder, "{sv}", "compression", g_variant_new_byte ('x'));
@@ -186,7 +222,7 @@ xdg_app_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
 
   if (!ostree_repo_static_delta_generate (repo,
                                           OSTREE_STATIC_DELTA_GENERATE_OPT_LOWLATENCY,
-                                          /* from */ NULL,
+                                          from_checksum,
                                           commit_checksum,
                                           g_variant_builder_end (&metadata_builder),
                                           g_variant_builder_end (&param_builder),
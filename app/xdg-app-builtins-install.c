@@ -32,6 +32,7 @@
 
 #include "xdg-app-builtins.h"
 #include "xdg-app-utils.h"
+#include "xdg-app-bundle.h"
 #include "xdg-app-chain-input-stream.h"
 
 static char *opt_arch;
@@ -161,7 +162,7 @@ xdg_app_builtin_install_runtime (int argc, char **argv, GCancellable *cancellabl
   if (!xdg_app_dir_deploy (dir, ref, NULL, cancellable, error))
     goto out;
 
-  xdg_app_dir_cleanup_removed (dir, cancellable, NULL);
+  xdg_app_dir_cleanup_removed_in_background (dir);
 
   ret = TRUE;
 
@@ -245,7 +246,7 @@ xdg_app_builtin_install_app (int argc, char **argv, GCancellable *cancellable, G
   if (!xdg_app_dir_update_exports (dir, app, cancellable, error))
     goto out;
 
-  xdg_app_dir_cleanup_removed (dir, cancellable, NULL);
+  xdg_app_dir_cleanup_removed_in_background (dir);
 
   ret = TRUE;
 
@@ -260,6 +261,114 @@ xdg_app_builtin_install_app (int argc, char **argv, GCancellable *cancellable, G
 #define OSTREE_STATIC_DELTA_FALLBACK_FORMAT "(yaytt)"
 #define OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT "(a{sv}tayay" OSTREE_COMMIT_GVARIANT_STRING "aya" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT "a" OSTREE_STATIC_DELTA_FALLBACK_FORMAT ")"
 
+static gboolean
+read_bundle_metadata (GVariant  *metadata,
+                      char     **out_ref,
+                      char     **out_origin,
+                      GBytes   **out_gpg_data,
+                      GError   **error)
+{
+  g_autoptr(GVariant) gpg_value = NULL;
+
+  if (!g_variant_lookup (metadata, "ref", "s", out_ref))
+    return xdg_app_fail (error, "Invalid bundle, no ref in metadata");
+
+  if (!g_variant_lookup (metadata, "origin", "s", out_origin))
+    *out_origin = NULL;
+
+  gpg_value = g_variant_lookup_value (metadata, "gpg-keys", G_VARIANT_TYPE("ay"));
+  if (gpg_value)
+    {
+      gsize n_elements;
+      const char *data = g_variant_get_fixed_array (gpg_value, &n_elements, 1);
+
+      *out_gpg_data = g_bytes_new (data, n_elements);
+    }
+
+  return TRUE;
+}
+
+/* Update bundles must be signed by a key of the remote the ref was
+ * installed from, if that remote verifies signatures. If it was
+ * installed from a bundle without an origin, there is nothing to
+ * verify against, just like for that bundle. */
+static gboolean
+verify_update_commit (OstreeRepo    *repo,
+                      const char    *remote,
+                      const char    *checksum,
+                      GCancellable  *cancellable,
+                      GError       **error)
+{
+  g_autoptr(OstreeGpgVerifyResult) gpg_result = NULL;
+  g_autoptr(GFile) keyring = NULL;
+  g_autofree char *keyring_name = NULL;
+  gboolean gpg_verify = FALSE;
+
+  if (remote == NULL)
+    return TRUE;
+
+  if (!ostree_repo_remote_get_gpg_verify (repo, remote, &gpg_verify, error))
+    return FALSE;
+
+  if (!gpg_verify)
+    return TRUE;
+
+  /* This is where ostree_repo_remote_gpg_import() puts the keys */
+  keyring_name = g_strdup_printf ("%s.trustedkeys.gpg", remote);
+  keyring = g_file_get_child (ostree_repo_get_path (repo), keyring_name);
+  if (!g_file_query_exists (keyring, cancellable))
+    g_clear_object (&keyring);
+
+  gpg_result = ostree_repo_verify_commit_ext (repo, checksum, NULL, keyring,
+                                              cancellable, error);
+  if (gpg_result == NULL)
+    return FALSE;
+
+  if (ostree_gpg_verify_result_count_valid (gpg_result) == 0)
+    return xdg_app_fail (error, "Bundle is not signed by a key trusted by remote %s", remote);
+
+  return TRUE;
+}
+
+/* Bundles built with --from update an installed ref, rather than
+ * installing a new one */
+static gboolean
+update_from_bundle (XdgAppDir     *dir,
+                    const char    *ref,
+                    const char    *checksum,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  g_autofree char *previous_deployment = NULL;
+  g_auto(GStrv) parts = NULL;
+
+  parts = g_strsplit (ref, "/", 0);
+  previous_deployment = xdg_app_dir_read_active (dir, ref, cancellable);
+
+  if (!xdg_app_dir_deploy (dir, ref, checksum, cancellable, error))
+    return FALSE;
+
+  if (previous_deployment != NULL)
+    {
+      if (!xdg_app_dir_undeploy (dir, ref, previous_deployment, FALSE,
+                                 cancellable, error))
+        return FALSE;
+
+      if (!xdg_app_dir_prune (dir, cancellable, error))
+        return FALSE;
+
+      xdg_app_dir_cleanup_removed_in_background (dir);
+    }
+
+  if (strcmp (parts[0], "app") == 0)
+    {
+      if (!xdg_app_dir_update_exports (dir, parts[1], cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 gboolean
 xdg_app_builtin_install_bundle (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -276,13 +385,20 @@ xdg_app_builtin_install_bundle (int argc, char **argv, GCancellable *cancellable
   g_autofree char *checksum = NULL;
   gboolean created_deploy_base = FALSE;
   gboolean added_remote = FALSE;
+  gboolean in_transaction = FALSE;
   g_autofree char *to_checksum = NULL;
+  g_autofree char *from_checksum = NULL;
   g_auto(GStrv) parts = NULL;
   g_autoptr(GBytes) gpg_data = NULL;
   g_autofree char *remote = NULL;
+  g_autofree char *update_remote = NULL;
   OstreeRepo *repo;
   g_autoptr(OstreeGpgVerifyResult) gpg_result = NULL;
   g_autoptr(GError) my_error = NULL;
+  g_autoptr(GInputStream) bundle_stream = NULL;
+  g_autoptr(GVariant) detached_metadata = NULL;
+  XdgAppBundleCompression compression = XDG_APP_BUNDLE_COMPRESSION_NONE;
+  guint64 bundle_remaining = 0;
 
   context = g_option_context_new ("BUNDLE - Install a application or runtime from a bundle");
 
@@ -301,54 +417,89 @@ xdg_app_builtin_install_bundle (int argc, char **argv, GCancellable *cancellable
 
   file = g_file_new_for_commandline_arg (filename);
 
-  {
-    g_autoptr(GVariant) delta = NULL;
-    g_autoptr(GVariant) metadata = NULL;
-    g_autoptr(GBytes) bytes = NULL;
-    g_autoptr(GVariant) to_csum_v = NULL;
-    g_autoptr(GVariant) gpg_value = NULL;
+  if (xdg_app_bundle_is_indexed (file, cancellable))
+    {
+      g_autoptr(GVariant) metadata = NULL;
 
-    GMappedFile *mfile = g_mapped_file_new (gs_file_get_path_cached (file), FALSE, error);
+      bundle_stream = xdg_app_bundle_open (file, &metadata, &to_checksum, &detached_metadata,
+                                           &compression, &bundle_remaining, cancellable, error);
+      if (bundle_stream == NULL)
+        return FALSE;
 
-    if (mfile == NULL)
-      return FALSE;
+      if (!read_bundle_metadata (metadata, &ref, &origin, &gpg_data, error))
+        return FALSE;
 
-    bytes = g_mapped_file_get_bytes (mfile);
-    g_mapped_file_unref (mfile);
+      if (!g_variant_lookup (metadata, "from-commit", "s", &from_checksum))
+        from_checksum = NULL;
+    }
+  else
+    {
+      g_autoptr(GVariant) delta = NULL;
+      g_autoptr(GVariant) metadata = NULL;
+      g_autoptr(GBytes) bytes = NULL;
+      g_autoptr(GVariant) to_csum_v = NULL;
+      g_autoptr(GVariant) from_csum_v = NULL;
 
-    delta = g_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT), bytes, FALSE);
-    g_variant_ref_sink (delta);
+      GMappedFile *mfile = g_mapped_file_new (gs_file_get_path_cached (file), FALSE, error);
 
-    to_csum_v = g_variant_get_child_value (delta, 3);
-    if (!ostree_validate_structureof_csum_v (to_csum_v, error))
-      return FALSE;
+      if (mfile == NULL)
+        return FALSE;
 
-    to_checksum = ostree_checksum_from_bytes_v (to_csum_v);
+      bytes = g_mapped_file_get_bytes (mfile);
+      g_mapped_file_unref (mfile);
 
-    metadata = g_variant_get_child_value (delta, 0);
+      delta = g_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT), bytes, FALSE);
+      g_variant_ref_sink (delta);
 
-    if (!g_variant_lookup (metadata, "ref", "s", &ref))
-      return xdg_app_fail (error, "Invalid bundle, no ref in metadata");
+      to_csum_v = g_variant_get_child_value (delta, 3);
+      if (!ostree_validate_structureof_csum_v (to_csum_v, error))
+        return FALSE;
 
-    if (!g_variant_lookup (metadata, "origin", "s", &origin))
-      origin = NULL;
+      to_checksum = ostree_checksum_from_bytes_v (to_csum_v);
 
-    gpg_value = g_variant_lookup_value (metadata, "gpg-keys", G_VARIANT_TYPE("ay"));
-    if (gpg_value)
-      {
-        gsize n_elements;
-        const char *data = g_variant_get_fixed_array (gpg_value, &n_elements, 1);
+      from_csum_v = g_variant_get_child_value (delta, 2);
+      if (g_variant_n_children (from_csum_v) > 0)
+        {
+          if (!ostree_validate_structureof_csum_v (from_csum_v, error))
+            return FALSE;
 
-        gpg_data = g_bytes_new (data, n_elements);
-      }
-  }
+          from_checksum = ostree_checksum_from_bytes_v (from_csum_v);
+        }
+
+      metadata = g_variant_get_child_value (delta, 0);
+
+      if (!read_bundle_metadata (metadata, &ref, &origin, &gpg_data, error))
+        return FALSE;
+    }
 
   parts = xdg_app_decompose_ref (ref, error);
   if (parts == NULL)
     return FALSE;
 
   deploy_base = xdg_app_dir_get_deploy_dir (dir, ref);
-  if (g_file_query_exists (deploy_base, cancellable))
+  if (from_checksum != NULL)
+    {
+      g_autoptr(GVariant) from_commit = NULL;
+
+      if (!g_file_query_exists (deploy_base, cancellable))
+        return xdg_app_fail (error, "%s branch %s not installed, and the bundle only contains an update", parts[1], parts[3]);
+
+      if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_COMMIT, from_checksum,
+                                               &from_commit, error))
+        return FALSE;
+
+      if (from_commit == NULL)
+        return xdg_app_fail (error, "Bundle updates from commit %s, which is not installed", from_checksum);
+
+      /* Updates are verified against the remote the ref was installed
+         from, the keys the bundle carries can't vouch for it */
+      update_remote = xdg_app_dir_get_origin (dir, ref, cancellable, NULL);
+      g_clear_pointer (&gpg_data, g_bytes_unref);
+
+      if (opt_gpg_file != NULL)
+        return xdg_app_fail (error, "--gpg-file can't be used with a bundle that updates an installed ref");
+    }
+  else if (g_file_query_exists (deploy_base, cancellable))
     return xdg_app_fail (error, "%s branch %s already installed", parts[1], parts[3]);
 
   if (opt_gpg_file != NULL)
@@ -360,7 +511,7 @@ xdg_app_builtin_install_bundle (int argc, char **argv, GCancellable *cancellable
     }
 
   /* Add a remote for later updates */
-  if (origin != NULL)
+  if (origin != NULL && from_checksum == NULL)
     {
       g_auto(GStrv) remotes = ostree_repo_remote_list (repo, NULL);
       int version = 0;
@@ -384,14 +535,30 @@ xdg_app_builtin_install_bundle (int argc, char **argv, GCancellable *cancellable
   if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
     return FALSE;
 
+  /* From here we need to goto out on error, to abort the transaction */
+  in_transaction = TRUE;
+
+  /* For update bundles remote is NULL, so this only sets a local ref
+     and the tracking ref of the origin still says what it has */
   ostree_repo_transaction_set_ref (repo, remote, ref, to_checksum);
 
-  if (!ostree_repo_static_delta_execute_offline (repo,
-                                                 file,
-                                                 FALSE,
-                                                 cancellable,
-                                                 error))
-    return FALSE;
+  if (bundle_stream != NULL)
+    {
+      if (!xdg_app_bundle_apply (repo, bundle_stream, compression, bundle_remaining,
+                                 cancellable, error))
+        goto out;
+
+      if (detached_metadata != NULL &&
+          !ostree_repo_write_commit_detached_metadata (repo, to_checksum, detached_metadata,
+                                                       cancellable, error))
+        goto out;
+    }
+  else if (!ostree_repo_static_delta_execute_offline (repo,
+                                                      file,
+                                                      FALSE,
+                                                      cancellable,
+                                                      error))
+    goto out;
 
   if (gpg_data)
     {
@@ -400,49 +567,63 @@ xdg_app_builtin_install_bundle (int argc, char **argv, GCancellable *cancellable
 
       gpg_tmp_file = g_file_new_tmp (".xdg-app-XXXXXX", &stream, error);
       if (gpg_tmp_file == NULL)
-        return FALSE;
+        goto out;
       o = g_io_stream_get_output_stream (G_IO_STREAM (stream));
       if (!g_output_stream_write_all (o, g_bytes_get_data (gpg_data, NULL), g_bytes_get_size (gpg_data), NULL, cancellable, error))
-        return FALSE;
+        goto out;
     }
 
-  gpg_result = ostree_repo_verify_commit_ext (repo,
-                                              to_checksum,
-                                              NULL, gpg_tmp_file, cancellable, &my_error);
+  if (from_checksum != NULL)
+    {
+      if (!verify_update_commit (repo, update_remote, to_checksum, cancellable, error))
+        goto out;
+    }
+  else
+    {
+      gpg_result = ostree_repo_verify_commit_ext (repo,
+                                                  to_checksum,
+                                                  NULL, gpg_tmp_file, cancellable, &my_error);
 
-  if (gpg_tmp_file)
-    g_file_delete (gpg_tmp_file, cancellable, NULL);
+      if (gpg_tmp_file)
+        g_file_delete (gpg_tmp_file, cancellable, NULL);
 
-  if (gpg_result == NULL)
-    {
-      /* NOT_FOUND means no gpg signature, we ignore this *if* there
-       * is no gpg key specified in the bundle or by the user */
-      if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) &&
-          gpg_data == NULL)
-        g_clear_error (&my_error);
+      if (gpg_result == NULL)
+        {
+          /* NOT_FOUND means no gpg signature, we ignore this *if* there
+           * is no gpg key specified in the bundle or by the user */
+          if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) &&
+              gpg_data == NULL)
+            g_clear_error (&my_error);
+          else
+            {
+              g_propagate_error (error, g_steal_pointer (&my_error));
+              goto out;
+            }
+        }
       else
         {
-          g_propagate_error (error, g_steal_pointer (&my_error));
-          return FALSE;
+          /* If there is no valid gpg signature we fail, unless there is no gpg
+             key specified (on the command line or in the file) because then we
+             trust the source bundle. */
+          if (ostree_gpg_verify_result_count_valid (gpg_result) == 0  &&
+              gpg_data != NULL)
+            {
+              xdg_app_fail (error, "GPG signatures found, but none are in trusted keyring");
+              goto out;
+            }
         }
     }
-  else
-    {
-      /* If there is no valid gpg signature we fail, unless there is no gpg
-         key specified (on the command line or in the file) because then we
-         trust the source bundle. */
-      if (ostree_gpg_verify_result_count_valid (gpg_result) == 0  &&
-          gpg_data != NULL)
-        return xdg_app_fail (error, "GPG signatures found, but none are in trusted keyring");
-    }
 
   if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
-    return FALSE;
+    goto out;
+  in_transaction = FALSE;
+
+  if (from_checksum != NULL)
+    return update_from_bundle (dir, ref, to_checksum, cancellable, error);
 
   if (!g_file_make_directory_with_parents (deploy_base, cancellable, error))
-    return FALSE;
+    goto out;
 
-  /* From here we need to goto out on error, to clean up */
   created_deploy_base = TRUE;
 
   if (remote)
@@ -480,11 +661,14 @@ xdg_app_builtin_install_bundle (int argc, char **argv, GCancellable *cancellable
         goto out;
     }
 
-  xdg_app_dir_cleanup_removed (dir, cancellable, NULL);
+  xdg_app_dir_cleanup_removed_in_background (dir);
 
   ret = TRUE;
 
  out:
+  if (in_transaction)
+    ostree_repo_abort_transaction (repo, cancellable, NULL);
+
   if (created_deploy_base && !ret)
     gs_shutil_rm_rf (deploy_base, cancellable, NULL);
 
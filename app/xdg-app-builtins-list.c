@@ -48,6 +48,8 @@ print_installed_refs (const char *kind, gboolean print_system, gboolean print_us
   g_autofree char *last = NULL;
   g_auto(GStrv) system = NULL;
   g_auto(GStrv) user = NULL;
+  g_autoptr(GVariant) system_index = NULL;
+  g_autoptr(GVariant) user_index = NULL;
   int s, u;
 
   if (print_user)
@@ -57,6 +59,7 @@ print_installed_refs (const char *kind, gboolean print_system, gboolean print_us
       dir = xdg_app_dir_get (TRUE);
       if (!xdg_app_dir_list_refs (dir, kind, &user, cancellable, error))
         return FALSE;
+      user_index = xdg_app_dir_load_deployed_index (dir);
     }
   else
     user = g_new0 (char *, 1);
@@ -68,6 +71,7 @@ print_installed_refs (const char *kind, gboolean print_system, gboolean print_us
       dir = xdg_app_dir_get (FALSE);
       if (!xdg_app_dir_list_refs (dir, kind, &system, cancellable, error))
         return FALSE;
+      system_index = xdg_app_dir_load_deployed_index (dir);
     }
   else
     system = g_new0 (char *, 1);
@@ -81,6 +85,8 @@ print_installed_refs (const char *kind, gboolean print_system, gboolean print_us
       g_autofree char *repo = NULL;
       gboolean is_user;
       g_autoptr(XdgAppDir) dir = NULL;
+      g_autoptr(GVariant) info = NULL;
+      GVariant *index;
 
       if (system[s] == NULL)
         is_user = TRUE;
@@ -100,7 +106,14 @@ print_installed_refs (const char *kind, gboolean print_system, gboolean print_us
       partial_ref = strchr(ref, '/') + 1;
 
       dir = xdg_app_dir_get (is_user);
-      repo = xdg_app_dir_get_origin (dir, ref, NULL, NULL);
+      index = is_user ? user_index : system_index;
+
+      /* Use the deployed index if there is one, rather than reading
+         the origin file of every ref */
+      if (index != NULL)
+        info = xdg_app_deployed_index_lookup (index, ref);
+      if (info == NULL || !g_variant_lookup (info, "origin", "s", &repo))
+        repo = xdg_app_dir_get_origin (dir, ref, NULL, NULL);
 
       if (opt_show_details)
         {
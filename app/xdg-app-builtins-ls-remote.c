@@ -49,16 +49,11 @@ xdg_app_builtin_ls_remote (int argc, char **argv, GCancellable *cancellable, GEr
 {
   g_autoptr(GOptionContext) context = NULL;
   g_autoptr(XdgAppDir) dir = NULL;
-  OstreeRepo *repo = NULL;
-  g_autoptr(GHashTable) refs = NULL;
-  g_autofree char *title = NULL;
-  GHashTableIter iter;
-  gpointer key;
-  gpointer value;
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GVariant) ref_list = NULL;
   g_autoptr(GPtrArray) names = NULL;
-  int i;
+  int i, n;
   const char *repository;
-  g_autofree char *url = NULL;
 
   context = g_option_context_new (" REMOTE - Show available runtimes and applications");
 
@@ -70,25 +65,27 @@ xdg_app_builtin_ls_remote (int argc, char **argv, GCancellable *cancellable, GEr
 
   repository = argv[1];
 
-  repo = xdg_app_dir_get_repo (dir);
-  if (!ostree_repo_remote_get_url (repo, repository, &url, error))
-    return FALSE;
-
-  if (!ostree_repo_load_summary (url, &refs, &title, cancellable, error))
+  if (!xdg_app_dir_load_remote_summary (dir, repository, &summary, cancellable, error))
     return FALSE;
 
   names = g_ptr_array_new_with_free_func (g_free);
 
-  g_hash_table_iter_init (&iter, refs);
-  while (g_hash_table_iter_next (&iter, &key, &value))
+  if (summary)
+    ref_list = g_variant_get_child_value (summary, 0);
+  n = ref_list ? g_variant_n_children (ref_list) : 0;
+
+  for (i = 0; i < n; i++)
     {
-      const char *refspec = key;
-      const char *checksum = value;
+      g_autoptr(GVariant) child = NULL;
+      const char *refspec;
       g_autofree char *remote = NULL;
       g_autofree char *ref = NULL;
       char *name = NULL;
       char *p;
 
+      child = g_variant_get_child_value (ref_list, i);
+      g_variant_get_child (child, 0, "&s", &refspec);
+
       if (!ostree_parse_refspec (refspec, &remote, &ref, error))
         return FALSE;
 
@@ -98,11 +95,16 @@ xdg_app_builtin_ls_remote (int argc, char **argv, GCancellable *cancellable, GEr
       if (opt_only_updates)
         {
           g_autofree char *deployed = NULL;
+          g_autoptr(GVariant) csum_v = NULL;
+          g_autofree char *checksum = NULL;
 
           deployed = xdg_app_dir_read_active (dir, ref, cancellable);
           if (deployed == NULL)
             continue;
 
+          g_variant_get_child (child, 1, "(t@aya{sv})", NULL, &csum_v, NULL);
+          checksum = ostree_checksum_from_bytes_v (csum_v);
+
           if (g_strcmp0 (deployed, checksum) == 0)
             continue;
         }
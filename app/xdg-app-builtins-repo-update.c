@@ -32,12 +32,76 @@
 #include "xdg-app-utils.h"
 
 static char *opt_title;
+static gboolean opt_generate_deltas;
 
 static GOptionEntry options[] = {
   { "title", 0, 0, G_OPTION_ARG_STRING, &opt_title, "A nice name to use for this repository", "TITLE" },
+  { "generate-static-deltas", 0, 0, G_OPTION_ARG_NONE, &opt_generate_deltas, "Generate delta files from the previous commit of each ref", NULL },
   { NULL }
 };
 
+/* Generates a delta from the parent of each ref's commit, which is what
+ * clients that update regularly will ask for. */
+static gboolean
+generate_deltas (OstreeRepo   *repo,
+                 GCancellable *cancellable,
+                 GError      **error)
+{
+  g_autoptr(GHashTable) all_refs = NULL;
+  g_autoptr(GPtrArray) deltas = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (!ostree_repo_list_refs (repo, NULL, &all_refs, cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_list_static_delta_names (repo, &deltas, cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, all_refs);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *ref = key;
+      const char *commit = value;
+      g_autoptr(GVariant) commit_v = NULL;
+      g_autofree char *parent = NULL;
+      g_autofree char *delta_name = NULL;
+      gboolean have_parent;
+      int i;
+
+      if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit, &commit_v, error))
+        return FALSE;
+
+      parent = ostree_commit_get_parent (commit_v);
+      if (parent == NULL)
+        continue;
+
+      if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, parent, &have_parent,
+                                   cancellable, error))
+        return FALSE;
+
+      if (!have_parent)
+        continue;
+
+      delta_name = g_strconcat (parent, "-", commit, NULL);
+      for (i = 0; i < deltas->len; i++)
+        if (strcmp (g_ptr_array_index (deltas, i), delta_name) == 0)
+          break;
+      if (i < deltas->len)
+        continue;
+
+      g_print ("Generating delta: %s (%.10s-%.10s)\n", ref, parent, commit);
+      if (!ostree_repo_static_delta_generate (repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                              parent, commit,
+                                              g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0),
+                                              g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0),
+                                              cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 
 gboolean
 xdg_app_builtin_repo_update (int argc, char **argv, GCancellable *cancellable, GError **error)
@@ -73,6 +137,10 @@ xdg_app_builtin_repo_update (int argc, char **argv, GCancellable *cancellable, G
       extra = g_variant_builder_end (&builder);
     }
 
+  if (opt_generate_deltas &&
+      !generate_deltas (repo, cancellable, error))
+    return FALSE;
+
   if (!ostree_repo_regenerate_summary (repo, extra, cancellable, error))
     return FALSE;
 
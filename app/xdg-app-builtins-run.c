@@ -26,6 +26,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
 
 #include "libgsystem.h"
 #include "libglnx/libglnx.h"
@@ -39,7 +41,9 @@ static char *opt_arch;
 static char *opt_branch;
 static char *opt_command;
 static gboolean opt_devel;
+static gboolean opt_no_init;
 static char *opt_runtime;
+static gboolean opt_timing;
 
 static GOptionEntry options[] = {
   { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, "Arch to use", "ARCH" },
@@ -47,9 +51,158 @@ static GOptionEntry options[] = {
   { "branch", 0, 0, G_OPTION_ARG_STRING, &opt_branch, "Branch to use", "BRANCH" },
   { "devel", 'd', 0, G_OPTION_ARG_NONE, &opt_devel, "Use development runtime", NULL },
   { "runtime", 0, 0, G_OPTION_ARG_STRING, &opt_runtime, "Runtime to use", "RUNTIME" },
+  { "no-init", 0, 0, G_OPTION_ARG_NONE, &opt_no_init, "Run the command as pid 1, without an init process", NULL },
+  { "timing", 0, 0, G_OPTION_ARG_NONE, &opt_timing, "Print the time spent in each launch stage", NULL },
   { NULL }
 };
 
+static gint64 timing_start = -1;
+static gint64 timing_last;
+
+/* Times are CLOCK_MONOTONIC, same as in xdg-app-helper, which gets
+   timing_start passed in XDG_APP_TIMING so the two logs line up */
+static void
+timing_mark (const char *stage)
+{
+  gint64 now;
+
+  if (timing_start < 0)
+    return;
+
+  now = g_get_monotonic_time ();
+  g_printerr ("xdg-app-timing: run    %-18s %9.3f ms (+%.3f ms)\n", stage,
+              (now - timing_start) / 1000.0, (now - timing_last) / 1000.0);
+  timing_last = now;
+}
+
+/* Upper bound on how long we wait for the session helper and the
+   document portal before launching without them */
+#define LAUNCH_DBUS_TIMEOUT_MSEC 5000
+
+typedef struct {
+  int pending;
+  GCancellable *cancellable;
+  char *monitor_path;
+  char *doc_mount_path;
+} LaunchData;
+
+static gpointer
+transient_unit_thread (gpointer data)
+{
+  const char *app = data;
+
+  xdg_app_run_in_transient_unit (app);
+  return NULL;
+}
+
+static gboolean
+launch_timeout_cb (gpointer user_data)
+{
+  GCancellable *cancellable = user_data;
+
+  g_cancellable_cancel (cancellable);
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+request_monitor_cb (GObject *source_object,
+                    GAsyncResult *res,
+                    gpointer user_data)
+{
+  LaunchData *data = user_data;
+
+  xdg_app_session_helper_call_request_monitor_finish (XDG_APP_SESSION_HELPER (source_object),
+                                                      &data->monitor_path,
+                                                      res, NULL);
+  data->pending--;
+}
+
+static void
+session_helper_proxy_cb (GObject *source_object,
+                         GAsyncResult *res,
+                         gpointer user_data)
+{
+  LaunchData *data = user_data;
+  g_autoptr(XdgAppSessionHelper) session_helper = NULL;
+
+  session_helper = xdg_app_session_helper_proxy_new_finish (res, NULL);
+  if (session_helper == NULL)
+    {
+      data->pending--;
+      return;
+    }
+
+  xdg_app_session_helper_call_request_monitor (session_helper,
+                                               data->cancellable,
+                                               request_monitor_cb,
+                                               data);
+}
+
+static void
+get_mount_point_cb (GObject *source_object,
+                    GAsyncResult *res,
+                    gpointer user_data)
+{
+  LaunchData *data = user_data;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) reply = NULL;
+
+  reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &error);
+  if (reply)
+    g_variant_get (reply, "(^ay)", &data->doc_mount_path);
+  else if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+           !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT))
+    g_warning ("Can't get document portal: %s\n", error->message);
+
+  data->pending--;
+}
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+
+/* Returns a sealed memfd with the given contents, or -1 if memfds
+   are not supported. The fd is close-on-exec, so that the dbus proxy
+   does not inherit it; it is only handed to the helper right before
+   exec. */
+static int
+create_sealed_memfd (const char *name,
+                     const char *data,
+                     gsize len)
+{
+#ifdef __NR_memfd_create
+  int fd;
+
+  fd = syscall (__NR_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    return -1;
+
+  if (write (fd, data, len) != (ssize_t) len ||
+      fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0 ||
+      lseek (fd, 0, SEEK_SET) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+#else
+  return -1;
+#endif
+}
+
 static void
 dbus_spawn_child_setup (gpointer user_data)
 {
@@ -72,7 +225,6 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
   g_autoptr(GFile) home = NULL;
   g_autoptr(GFile) user_font1 = NULL;
   g_autoptr(GFile) user_font2 = NULL;
-  g_autoptr(XdgAppSessionHelper) session_helper = NULL;
   g_autofree char *runtime = NULL;
   g_autofree char *default_command = NULL;
   g_autofree char *runtime_ref = NULL;
@@ -83,17 +235,21 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
   g_autoptr(GPtrArray) argv_array = NULL;
   g_auto(GStrv) envp = NULL;
   g_autoptr(GPtrArray) dbus_proxy_argv = NULL;
-  g_autofree char *monitor_path = NULL;
+  LaunchData launch_data = { 0 };
+  GThread *unit_thread;
+  guint timeout_id;
   const char *app;
   const char *branch = "master";
   const char *command = "/bin/sh";
   int i;
   int rest_argv_start, rest_argc;
   int sync_proxy_pipes[2];
+  int info_fd = -1;
   g_autoptr(XdgAppContext) arg_context = NULL;
   g_autoptr(XdgAppContext) app_context = NULL;
   g_autoptr(XdgAppContext) overrides = NULL;
   g_autoptr(GDBusConnection) session_bus = NULL;
+  gint64 start_time = g_get_monotonic_time ();
 
   context = g_option_context_new ("APP [args...] - Run an app");
 
@@ -116,6 +272,12 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
   if (!xdg_app_option_context_parse (context, options, &argc, &argv, XDG_APP_BUILTIN_FLAG_NO_DIR, NULL, cancellable, error))
     return FALSE;
 
+  if (opt_timing || g_getenv ("XDG_APP_TIMING") != NULL)
+    {
+      timing_start = timing_last = start_time;
+      timing_mark ("parse-options");
+    }
+
   if (rest_argc == 0)
     return usage_error (context, "APP must be specified", error);
 
@@ -137,11 +299,14 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
     return FALSE;
 
   metakey = xdg_app_deploy_get_metadata (app_deploy);
+  timing_mark ("app-deploy");
 
   argv_array = g_ptr_array_new_with_free_func (g_free);
   dbus_proxy_argv = g_ptr_array_new_with_free_func (g_free);
   g_ptr_array_add (argv_array, g_strdup (HELPER));
   g_ptr_array_add (argv_array, g_strdup ("-l"));
+  if (opt_no_init)
+    g_ptr_array_add (argv_array, g_strdup ("-N"));
 
   if (!xdg_app_run_add_extension_args (argv_array, metakey, app_ref, cancellable, error))
     return FALSE;
@@ -162,6 +327,7 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
     return FALSE;
 
   runtime_metakey = xdg_app_deploy_get_metadata (runtime_deploy);
+  timing_mark ("runtime-deploy");
 
   app_context = xdg_app_context_new ();
   xdg_app_context_set_session_bus_policy (app_context, "org.freedesktop.portal.Documents", XDG_APP_POLICY_TALK);
@@ -177,35 +343,53 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
   xdg_app_context_merge (app_context, arg_context);
 
     {
-      g_autofree char *tmp_path = NULL;
-      g_autofree char *path = NULL;
+      g_autoptr(GKeyFile) keyfile = NULL;
+      g_autofree char *keyfile_data = NULL;
+      gsize keyfile_len;
       int fd;
 
-      fd = g_file_open_tmp ("xdg-app-context-XXXXXX", &tmp_path, NULL);
-      if (fd >= 0)
-        {
-          g_autoptr(GKeyFile) keyfile = NULL;
+      keyfile = g_key_file_new ();
 
-          close (fd);
+      g_key_file_set_string (keyfile, "Application", "name", app);
+      g_key_file_set_string (keyfile, "Application", "runtime", runtime_ref);
 
-          keyfile = g_key_file_new ();
+      xdg_app_context_save_metadata (app_context, keyfile);
 
-          g_key_file_set_string (keyfile, "Application", "name", app);
-          g_key_file_set_string (keyfile, "Application", "runtime", runtime_ref);
+      keyfile_data = g_key_file_to_data (keyfile, &keyfile_len, NULL);
+
+      /* Pass the info file in memory if we can, so we don't have to write
+         it to disk only for the helper to copy it and remove it */
+      info_fd = create_sealed_memfd ("xdg-app-context", keyfile_data, keyfile_len);
+      if (info_fd >= 0)
+        {
+          g_ptr_array_add (argv_array, g_strdup ("-C"));
+          g_ptr_array_add (argv_array, g_strdup_printf ("/run/user/%d/xdg-app-info=%d", getuid(), info_fd));
+        }
+      else
+        {
+          g_autofree char *tmp_path = NULL;
 
-          xdg_app_context_save_metadata (app_context, keyfile);
+          fd = g_file_open_tmp ("xdg-app-context-XXXXXX", &tmp_path, NULL);
+          if (fd >= 0)
+            {
+              close (fd);
 
-          if (!g_key_file_save_to_file (keyfile, tmp_path, error))
-            return FALSE;
+              if (!g_file_set_contents (tmp_path, keyfile_data, keyfile_len, error))
+                return FALSE;
 
-          g_ptr_array_add (argv_array, g_strdup ("-M"));
-          g_ptr_array_add (argv_array, g_strdup_printf ("/run/user/%d/xdg-app-info=%s", getuid(), tmp_path));
+              g_ptr_array_add (argv_array, g_strdup ("-M"));
+              g_ptr_array_add (argv_array, g_strdup_printf ("/run/user/%d/xdg-app-info=%s", getuid(), tmp_path));
+            }
         }
     }
 
+  timing_mark ("context");
+
   if (!xdg_app_run_add_extension_args (argv_array, runtime_metakey, runtime_ref, cancellable, error))
     return FALSE;
 
+  timing_mark ("extensions");
+
   if ((app_id_dir = xdg_app_ensure_data_dir (app, cancellable, error)) == NULL)
       return FALSE;
 
@@ -232,49 +416,57 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
   else
     command = default_command;
 
-  session_helper = xdg_app_session_helper_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-								  G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
-								  "org.freedesktop.XdgApp",
-								  "/org/freedesktop/XdgApp/SessionHelper",
-								  NULL, NULL);
-  if (session_helper &&
-      xdg_app_session_helper_call_request_monitor_sync (session_helper,
-                                                        &monitor_path,
-                                                        NULL, NULL))
+  /* The transient unit and the session helper and document portal calls
+     are independent, so run them in parallel. The unit is created in a
+     thread, as it waits synchronously for systemd */
+  unit_thread = g_thread_new ("transient-unit", transient_unit_thread, (gpointer) app);
+
+  launch_data.cancellable = g_cancellable_new ();
+  session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
+  if (session_bus)
+    {
+      launch_data.pending++;
+      xdg_app_session_helper_proxy_new (session_bus,
+                                        G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                        "org.freedesktop.XdgApp",
+                                        "/org/freedesktop/XdgApp/SessionHelper",
+                                        launch_data.cancellable,
+                                        session_helper_proxy_cb,
+                                        &launch_data);
+
+      launch_data.pending++;
+      g_dbus_connection_call (session_bus,
+                              "org.freedesktop.portal.Documents",
+                              "/org/freedesktop/portal/documents",
+                              "org.freedesktop.portal.Documents",
+                              "GetMountPoint",
+                              g_variant_new ("()"),
+                              G_VARIANT_TYPE ("(ay)"),
+                              G_DBUS_CALL_FLAGS_NONE,
+                              LAUNCH_DBUS_TIMEOUT_MSEC,
+                              launch_data.cancellable,
+                              get_mount_point_cb,
+                              &launch_data);
+
+      /* Don't let a slow service hold up the launch, just run without it */
+      timeout_id = g_timeout_add (LAUNCH_DBUS_TIMEOUT_MSEC, launch_timeout_cb, launch_data.cancellable);
+      while (launch_data.pending > 0)
+        g_main_context_iteration (NULL, TRUE);
+      g_source_remove (timeout_id);
+    }
+  g_object_unref (launch_data.cancellable);
+
+  if (launch_data.monitor_path)
     {
       g_ptr_array_add (argv_array, g_strdup ("-m"));
-      g_ptr_array_add (argv_array, monitor_path);
+      g_ptr_array_add (argv_array, g_steal_pointer (&launch_data.monitor_path));
     }
   else
     g_ptr_array_add (argv_array, g_strdup ("-r"));
 
-  session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
-  if (session_bus)
-    {
-      g_autoptr (GError) local_error = NULL;
-      g_autoptr (GDBusMessage) reply = NULL;
-      g_autoptr (GDBusMessage) msg = g_dbus_message_new_method_call ("org.freedesktop.portal.Documents",
-                                                                     "/org/freedesktop/portal/documents",
-                                                                     "org.freedesktop.portal.Documents",
-                                                                     "GetMountPoint");
-      g_dbus_message_set_body (msg, g_variant_new ("()"));
-      reply = g_dbus_connection_send_message_with_reply_sync (session_bus, msg,
-                                                              G_DBUS_SEND_MESSAGE_FLAGS_NONE,
-                                                              30000,
-                                                              NULL,
-                                                              NULL,
-                                                              NULL);
-      if (reply)
-        {
-          if (g_dbus_message_to_gerror (reply, &local_error))
-            {
-              g_warning ("Can't get document portal: %s\n", local_error->message);
-            }
-          else
-            g_variant_get (g_dbus_message_get_body (reply),
-                           "(^ay)", &doc_mount_path);
-        }
-    }
+  doc_mount_path = launch_data.doc_mount_path;
+
+  timing_mark ("session-dbus");
 
   xdg_app_run_add_environment_args (argv_array, dbus_proxy_argv, doc_mount_path,
                                     app, app_context, app_id_dir);
@@ -302,9 +494,10 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
       g_ptr_array_add (argv_array, g_strdup_printf ("/run/host/user-fonts=%s", path));
     }
 
-  /* Must run this before spawning the dbus proxy, to ensure it
+  /* Must wait for this before spawning the dbus proxy, to ensure it
      ends up in the app cgroup */
-  xdg_app_run_in_transient_unit (app);
+  g_thread_join (unit_thread);
+  timing_mark ("transient-unit");
 
   if (dbus_proxy_argv->len > 0)
     {
@@ -341,6 +534,8 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
 
       g_ptr_array_add (argv_array, g_strdup ("-S"));
       g_ptr_array_add (argv_array, g_strdup_printf ("%d", sync_proxy_pipes[0]));
+
+      timing_mark ("dbus-proxy");
     }
 
   g_ptr_array_add (argv_array, g_strdup ("-a"));
@@ -362,6 +557,20 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
 
   envp = xdg_app_run_apply_env_appid (envp, app_id_dir);
 
+  if (timing_start >= 0)
+    {
+      g_autofree char *start = g_strdup_printf ("%" G_GINT64_FORMAT, timing_start);
+      envp = g_environ_setenv (envp, "XDG_APP_TIMING", start, TRUE);
+      timing_mark ("exec-helper");
+    }
+
+  /* The info fd is only for the helper, which gets it via -C */
+  if (info_fd >= 0 && fcntl (info_fd, F_SETFD, 0) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "Unable to pass app info to helper");
+      return FALSE;
+    }
+
   if (execvpe (HELPER, (char **)argv_array->pdata, envp) == -1)
     {
       g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "Unable to start app");
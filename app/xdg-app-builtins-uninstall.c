@@ -139,6 +139,11 @@ xdg_app_builtin_uninstall_runtime (int argc, char **argv, GCancellable *cancella
       g_clear_error (&temp_error);
     }
 
+  /* Removing the dirs makes the deployed index look stale, so rewrite
+     it. If that fails the stale index is ignored, so it's not fatal. */
+  if (!xdg_app_dir_update_deployed_index (dir, cancellable, NULL))
+    g_debug ("Unable to update deployed index");
+
   if (!opt_keep_ref)
     {
       repo = xdg_app_dir_get_repo (dir);
@@ -146,11 +151,16 @@ xdg_app_builtin_uninstall_runtime (int argc, char **argv, GCancellable *cancella
       if (!ostree_repo_set_ref_immediate (repo, repository, ref, NULL, cancellable, error))
         return FALSE;
 
+      /* Bundles that update a ref installed from a remote set a local ref */
+      if (repository != NULL &&
+          !ostree_repo_set_ref_immediate (repo, NULL, ref, NULL, cancellable, error))
+        return FALSE;
+
       if (!xdg_app_dir_prune (dir, cancellable, error))
         return FALSE;
     }
 
-  xdg_app_dir_cleanup_removed (dir, cancellable, NULL);
+  xdg_app_dir_cleanup_removed_in_background (dir);
 
   if (!was_deployed)
     return xdg_app_fail (error, "Nothing to uninstall");
@@ -265,6 +275,11 @@ xdg_app_builtin_uninstall_app (int argc, char **argv, GCancellable *cancellable,
       g_clear_error (&temp_error);
     }
 
+  /* Removing the dirs makes the deployed index look stale, so rewrite
+     it. If that fails the stale index is ignored, so it's not fatal. */
+  if (!xdg_app_dir_update_deployed_index (dir, cancellable, NULL))
+    g_debug ("Unable to update deployed index");
+
   if (!opt_keep_ref)
     {
       repo = xdg_app_dir_get_repo (dir);
@@ -272,11 +287,16 @@ xdg_app_builtin_uninstall_app (int argc, char **argv, GCancellable *cancellable,
       if (!ostree_repo_set_ref_immediate (repo, repository, ref, NULL, cancellable, error))
         return FALSE;
 
+      /* Bundles that update a ref installed from a remote set a local ref */
+      if (repository != NULL &&
+          !ostree_repo_set_ref_immediate (repo, NULL, ref, NULL, cancellable, error))
+        return FALSE;
+
       if (!xdg_app_dir_prune (dir, cancellable, error))
         return FALSE;
     }
 
-  xdg_app_dir_cleanup_removed (dir, cancellable, NULL);
+  xdg_app_dir_cleanup_removed_in_background (dir);
 
   if (!was_deployed)
     return xdg_app_fail (error, "Nothing to uninstall");
@@ -42,6 +42,52 @@ static GOptionEntry options[] = {
   { NULL }
 };
 
+static gboolean
+pull_refs (XdgAppDir     *dir,
+           const char    *repository,
+           const char   **refs,
+           GCancellable  *cancellable,
+           GError       **error)
+{
+  XdgAppPullStats stats = { 0 };
+  g_autofree char *transferred = NULL;
+
+  if (!xdg_app_dir_pull_refs (dir, repository, refs, &stats, cancellable, error))
+    return FALSE;
+
+  if (stats.fetched_objects == 0 && stats.fetched_delta_parts == 0)
+    return TRUE;
+
+  transferred = g_format_size (stats.bytes_transferred);
+  if (stats.total_delta_parts > 0)
+    g_print ("%s: %u of %u static delta parts and %u objects fetched, %s transferred\n",
+             repository, stats.fetched_delta_parts, stats.total_delta_parts,
+             stats.fetched_objects, transferred);
+  else
+    g_print ("%s: %u objects fetched without static deltas, %s transferred\n",
+             repository, stats.fetched_objects, transferred);
+
+  return TRUE;
+}
+
+static gboolean
+pull_ref (XdgAppDir     *dir,
+          const char    *repository,
+          const char    *ref,
+          GCancellable  *cancellable,
+          GError       **error)
+{
+  const char *refs[] = { ref, NULL };
+
+  if (!pull_refs (dir, repository, refs, cancellable, error))
+    {
+      g_prefix_error (error, "While pulling %s from remote %s: ", ref, repository);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 gboolean
 xdg_app_builtin_update_runtime (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -78,8 +124,7 @@ xdg_app_builtin_update_runtime (int argc, char **argv, GCancellable *cancellable
   if (repository == NULL)
     return FALSE;
 
-  if (!xdg_app_dir_pull (dir, repository, ref,
-                         cancellable, error))
+  if (!pull_ref (dir, repository, ref, cancellable, error))
     return FALSE;
 
   previous_deployment = xdg_app_dir_read_active (dir, ref, cancellable);
@@ -106,6 +151,8 @@ xdg_app_builtin_update_runtime (int argc, char **argv, GCancellable *cancellable
 
           if (!xdg_app_dir_prune (dir, cancellable, error))
             return FALSE;
+
+          xdg_app_dir_cleanup_removed_in_background (dir);
         }
     }
 
@@ -148,8 +195,7 @@ xdg_app_builtin_update_app (int argc, char **argv, GCancellable *cancellable, GE
   if (repository == NULL)
     return FALSE;
 
-  if (!xdg_app_dir_pull (dir, repository, ref,
-                         cancellable, error))
+  if (!pull_ref (dir, repository, ref, cancellable, error))
     return FALSE;
 
   previous_deployment = xdg_app_dir_read_active (dir, ref, cancellable);
@@ -176,6 +222,8 @@ xdg_app_builtin_update_app (int argc, char **argv, GCancellable *cancellable, GE
 
           if (!xdg_app_dir_prune (dir, cancellable, error))
             return FALSE;
+
+          xdg_app_dir_cleanup_removed_in_background (dir);
         }
 
       if (!xdg_app_dir_update_exports (dir, app, cancellable, error))
@@ -184,3 +232,262 @@ xdg_app_builtin_update_app (int argc, char **argv, GCancellable *cancellable, GE
 
   return  TRUE;
 }
+
+static gboolean opt_all;
+
+static GOptionEntry update_options[] = {
+  { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, "Only update refs for this arch", "ARCH" },
+  { "all", 0, 0, G_OPTION_ARG_NONE, &opt_all, "Update all installed applications and runtimes", NULL },
+  { "force-remove", 0, 0, G_OPTION_ARG_NONE, &opt_force_remove, "Remove old files even if running", NULL },
+  { NULL }
+};
+
+typedef struct {
+  char *ref;
+  char *previous_deployment;
+  gboolean deployed;
+  GError *error;
+  GCancellable *cancellable;
+} UpdateOp;
+
+static void
+update_op_free (UpdateOp *op)
+{
+  g_free (op->ref);
+  g_free (op->previous_deployment);
+  g_clear_error (&op->error);
+  g_free (op);
+}
+
+static void
+variant_unref0 (gpointer data)
+{
+  if (data)
+    g_variant_unref (data);
+}
+
+static void
+deploy_thread (gpointer data,
+               gpointer user_data)
+{
+  UpdateOp *op = data;
+  XdgAppDir *dir = user_data;
+  g_autoptr(XdgAppDir) thread_dir = NULL;
+  GError *my_error = NULL;
+
+  /* OstreeRepo is not safe to share between threads doing checkouts */
+  thread_dir = xdg_app_dir_new (xdg_app_dir_get_path (dir), xdg_app_dir_is_user (dir));
+
+  if (xdg_app_dir_deploy (thread_dir, op->ref, NULL, op->cancellable, &my_error))
+    op->deployed = TRUE;
+  else if (g_error_matches (my_error, XDG_APP_DIR_ERROR, XDG_APP_DIR_ERROR_ALREADY_DEPLOYED))
+    g_error_free (my_error);
+  else
+    op->error = my_error;
+}
+
+/* Updates several refs as one transaction: a single pull per remote,
+ * all checkouts in parallel, and then one prune and one export and
+ * trigger run for everything that changed. */
+gboolean
+xdg_app_builtin_update (int argc, char **argv, GCancellable *cancellable, GError **error)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(XdgAppDir) dir = NULL;
+  g_autoptr(GPtrArray) refs = NULL;
+  g_autoptr(GHashTable) refs_by_remote = NULL;
+  g_autoptr(GHashTable) summaries = NULL;
+  g_autoptr(GPtrArray) ops = NULL;
+  g_autoptr(GPtrArray) changed_apps = NULL;
+  GThreadPool *pool;
+  GHashTableIter iter;
+  gpointer key, value;
+  gboolean undeployed = FALSE;
+  UpdateOp *failed_op = NULL;
+  int i;
+
+  context = g_option_context_new ("[REF...] - Update applications and runtimes");
+
+  if (!xdg_app_option_context_parse (context, update_options, &argc, &argv, 0, &dir, cancellable, error))
+    return FALSE;
+
+  if (!opt_all && argc < 2)
+    return usage_error (context, "REF or --all must be specified", error);
+
+  if (opt_all && argc >= 2)
+    return usage_error (context, "Can't specify both REF and --all", error);
+
+  refs = g_ptr_array_new_with_free_func (g_free);
+  if (opt_all)
+    {
+      const char *kinds[] = { "runtime", "app" };
+      int j;
+
+      for (i = 0; i < G_N_ELEMENTS (kinds); i++)
+        {
+          g_auto(GStrv) kind_refs = NULL;
+
+          if (!xdg_app_dir_list_refs (dir, kinds[i], &kind_refs, cancellable, error))
+            return FALSE;
+
+          for (j = 0; kind_refs[j] != NULL; j++)
+            g_ptr_array_add (refs, g_steal_pointer (&kind_refs[j]));
+        }
+    }
+  else
+    {
+      for (i = 1; i < argc; i++)
+        {
+          g_auto(GStrv) parts = xdg_app_decompose_ref (argv[i], error);
+          if (parts == NULL)
+            return FALSE;
+          g_ptr_array_add (refs, g_strdup (argv[i]));
+        }
+    }
+
+  refs_by_remote = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+  summaries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, variant_unref0);
+  ops = g_ptr_array_new_with_free_func ((GDestroyNotify)update_op_free);
+  for (i = 0; i < refs->len; i++)
+    {
+      const char *ref = g_ptr_array_index (refs, i);
+      g_auto(GStrv) parts = g_strsplit (ref, "/", 0);
+      g_autofree char *repository = NULL;
+      g_autofree char *remote_checksum = NULL;
+      GVariant *summary;
+      GPtrArray *remote_refs;
+      UpdateOp *op;
+
+      if (opt_arch != NULL && strcmp (parts[2], opt_arch) != 0)
+        continue;
+
+      repository = xdg_app_dir_get_origin (dir, ref, cancellable, error);
+      if (repository == NULL)
+        return FALSE;
+
+      /* Skip refs that the (cached) remote summary says are current,
+         without pulling anything for them */
+      if (!g_hash_table_lookup_extended (summaries, repository, NULL, (gpointer *)&summary))
+        {
+          summary = NULL;
+          if (!xdg_app_dir_load_remote_summary (dir, repository, &summary, cancellable, error))
+            return FALSE;
+          g_hash_table_insert (summaries, g_strdup (repository), summary);
+        }
+
+      if (summary != NULL &&
+          xdg_app_summary_lookup_ref (summary, ref, &remote_checksum))
+        {
+          g_autofree char *active = xdg_app_dir_read_active (dir, ref, cancellable);
+
+          if (g_strcmp0 (active, remote_checksum) == 0)
+            {
+              g_debug ("%s is up to date", ref);
+              continue;
+            }
+        }
+
+      remote_refs = g_hash_table_lookup (refs_by_remote, repository);
+      if (remote_refs == NULL)
+        {
+          remote_refs = g_ptr_array_new ();
+          g_hash_table_insert (refs_by_remote, g_steal_pointer (&repository), remote_refs);
+        }
+      g_ptr_array_add (remote_refs, (char *)ref);
+
+      op = g_new0 (UpdateOp, 1);
+      op->ref = g_strdup (ref);
+      op->cancellable = cancellable;
+      g_ptr_array_add (ops, op);
+    }
+
+  g_hash_table_iter_init (&iter, refs_by_remote);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *repository = key;
+      GPtrArray *remote_refs = value;
+
+      g_ptr_array_add (remote_refs, NULL);
+      if (!pull_refs (dir, repository, (const char **)remote_refs->pdata,
+                      cancellable, error))
+        {
+          g_prefix_error (error, "While pulling from remote %s: ", repository);
+          return FALSE;
+        }
+    }
+
+  pool = g_thread_pool_new (deploy_thread, dir, g_get_num_processors (), FALSE, error);
+  if (pool == NULL)
+    return FALSE;
+
+  for (i = 0; i < ops->len; i++)
+    {
+      UpdateOp *op = g_ptr_array_index (ops, i);
+
+      op->previous_deployment = xdg_app_dir_read_active (dir, op->ref, cancellable);
+      g_thread_pool_push (pool, op, NULL);
+    }
+
+  /* Waits for all the deploys to finish */
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  /* Finish the transaction for the refs that did deploy even if some
+     failed, so they don't keep their old checkouts around */
+  changed_apps = g_ptr_array_new_with_free_func (g_free);
+  for (i = 0; i < ops->len; i++)
+    {
+      UpdateOp *op = g_ptr_array_index (ops, i);
+      g_auto(GStrv) parts = NULL;
+      int j;
+
+      if (op->error != NULL && failed_op == NULL)
+        failed_op = op;
+
+      if (!op->deployed)
+        continue;
+
+      if (op->previous_deployment != NULL)
+        {
+          if (!xdg_app_dir_undeploy (dir, op->ref, op->previous_deployment,
+                                     opt_force_remove,
+                                     cancellable, error))
+            return FALSE;
+          undeployed = TRUE;
+        }
+
+      parts = g_strsplit (op->ref, "/", 0);
+      if (strcmp (parts[0], "app") != 0)
+        continue;
+
+      for (j = 0; j < changed_apps->len; j++)
+        if (strcmp (g_ptr_array_index (changed_apps, j), parts[1]) == 0)
+          break;
+      if (j == changed_apps->len)
+        g_ptr_array_add (changed_apps, g_strdup (parts[1]));
+    }
+
+  if (undeployed)
+    {
+      if (!xdg_app_dir_prune (dir, cancellable, error))
+        return FALSE;
+
+      xdg_app_dir_cleanup_removed_in_background (dir);
+    }
+
+  if (changed_apps->len > 0)
+    {
+      g_ptr_array_add (changed_apps, NULL);
+      if (!xdg_app_dir_update_exports_for_apps (dir, (const char **)changed_apps->pdata,
+                                                cancellable, error))
+        return FALSE;
+    }
+
+  if (failed_op != NULL)
+    {
+      g_propagate_prefixed_error (error, g_steal_pointer (&failed_op->error),
+                                  "While deploying %s: ", failed_op->ref);
+      return FALSE;
+    }
+
+  return TRUE;
+}
@@ -60,6 +60,8 @@ BUILTINPROTO(list_runtimes);
 BUILTINPROTO(install_app);
 BUILTINPROTO(make_current_app);
 BUILTINPROTO(update_app);
+BUILTINPROTO(update);
+BUILTINPROTO(cleanup);
 BUILTINPROTO(uninstall_app);
 BUILTINPROTO(install_bundle);
 BUILTINPROTO(list_apps);
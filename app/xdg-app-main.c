@@ -30,6 +30,7 @@
 #include "libgsystem.h"
 
 #include "xdg-app-builtins.h"
+#include "xdg-app-utils.h"
 
 static gboolean opt_verbose;
 static gboolean opt_version;
@@ -55,6 +56,8 @@ static XdgAppCommand commands[] = {
   { "make-app-current", xdg_app_builtin_make_current_app },
   { "uninstall-app", xdg_app_builtin_uninstall_app },
   { "list-apps", xdg_app_builtin_list_apps },
+  { "update", xdg_app_builtin_update },
+  { "cleanup", xdg_app_builtin_cleanup },
   { "install-bundle", xdg_app_builtin_install_bundle },
   { "run", xdg_app_builtin_run },
   { "enter", xdg_app_builtin_enter },
@@ -182,7 +185,10 @@ xdg_app_option_context_parse (GOptionContext *context,
     }
 
   if (opt_verbose)
-    g_log_set_handler (NULL, G_LOG_LEVEL_DEBUG, message_handler, NULL);
+    {
+      g_log_set_handler (NULL, G_LOG_LEVEL_DEBUG, message_handler, NULL);
+      xdg_app_set_debug_enabled (TRUE);
+    }
 
   if (out_dir)
     *out_dir = g_steal_pointer (&dir);
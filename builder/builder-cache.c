@@ -28,6 +28,7 @@
 #include <sys/statfs.h>
 
 #include <gio/gio.h>
+#include <gio/gunixinputstream.h>
 #include <ostree.h>
 #include "libglnx/libglnx.h"
 #include "libgsystem.h"
@@ -44,7 +45,10 @@ struct BuilderCache {
   char *branch;
   char *last_parent;
   OstreeRepo *repo;
+  GHashTable *file_checksums;
+  BuilderProfile *profile;
   gboolean disabled;
+  gboolean used;
 };
 
 typedef struct {
@@ -61,9 +65,6 @@ enum {
   LAST_PROP
 };
 
-#define OSTREE_GIO_FAST_QUERYINFO ("standard::name,standard::type,standard::size,standard::is-symlink,standard::symlink-target," \
-                                   "unix::device,unix::inode,unix::mode,unix::uid,unix::gid,unix::rdev")
-
 static void
 builder_cache_finalize (GObject *object)
 {
@@ -74,6 +75,8 @@ builder_cache_finalize (GObject *object)
   g_checksum_free (self->checksum);
   g_free (self->branch);
   g_free (self->last_parent);
+  g_clear_object (&self->profile);
+  g_hash_table_destroy (self->file_checksums);
 
   G_OBJECT_CLASS (builder_cache_parent_class)->finalize (object);
 }
@@ -165,10 +168,42 @@ builder_cache_class_init (BuilderCacheClass *klass)
                                                         G_PARAM_READWRITE));
 }
 
+/* The checksum of a file in the app dir, as of its last commit or
+ * checkout. The ctime changes whenever the content or metadata of
+ * the file does, so a file with the same inode and ctime need not be
+ * hashed again. */
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  struct timespec ctime;
+  char checksum[65];
+} BuilderCacheFile;
+
+static guint
+builder_cache_file_hash (gconstpointer key)
+{
+  const BuilderCacheFile *file = key;
+
+  return (guint) file->dev ^ (guint) file->ino;
+}
+
+static gboolean
+builder_cache_file_equal (gconstpointer a,
+                          gconstpointer b)
+{
+  const BuilderCacheFile *file_a = a;
+  const BuilderCacheFile *file_b = b;
+
+  return file_a->dev == file_b->dev && file_a->ino == file_b->ino;
+}
+
 static void
 builder_cache_init (BuilderCache *self)
 {
   self->checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  self->file_checksums = g_hash_table_new_full (builder_cache_file_hash,
+                                                builder_cache_file_equal,
+                                                g_free, NULL);
 }
 
 BuilderCache *
@@ -215,32 +250,124 @@ builder_cache_get_current (BuilderCache *self)
   return g_strdup (g_checksum_get_string (copy));
 }
 
+static const char *
+builder_cache_lookup_file (BuilderCache *self,
+                           struct stat  *stbuf)
+{
+  BuilderCacheFile key = { stbuf->st_dev, stbuf->st_ino };
+  BuilderCacheFile *file;
+
+  file = g_hash_table_lookup (self->file_checksums, &key);
+  if (file == NULL ||
+      file->ctime.tv_sec != stbuf->st_ctim.tv_sec ||
+      file->ctime.tv_nsec != stbuf->st_ctim.tv_nsec)
+    return NULL;
+
+  return file->checksum;
+}
+
+static void
+builder_cache_record_file (BuilderCache *self,
+                           struct stat  *stbuf,
+                           const char   *checksum)
+{
+  BuilderCacheFile *file = g_new0 (BuilderCacheFile, 1);
+
+  file->dev = stbuf->st_dev;
+  file->ino = stbuf->st_ino;
+  file->ctime = stbuf->st_ctim;
+  strncpy (file->checksum, checksum, sizeof (file->checksum) - 1);
+
+  g_hash_table_replace (self->file_checksums, file, file);
+}
+
+/* Records the checksums of the files checked out from @dir, a
+ * directory of a commit, into the directory @name of @dfd */
 static gboolean
-builder_cache_checkout (BuilderCache *self, const char *commit)
+builder_cache_record_checkout (BuilderCache *self,
+                               GFile        *dir,
+                               int           dfd,
+                               const char   *name,
+                               GError      **error)
 {
-  g_autoptr(GFile) root = NULL;
-  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  glnx_fd_close int dir_fd = -1;
+  GError *temp_error = NULL;
 
-  if (!ostree_repo_read_commit (self->repo, commit, &root, NULL, NULL, NULL))
+  if (!glnx_opendirat (dfd, name, FALSE, &dir_fd, error))
     return FALSE;
 
-  file_info = g_file_query_info (root, OSTREE_GIO_FAST_QUERYINFO,
-                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                 NULL, NULL);
-  if (file_info == NULL)
+  dir_enum = g_file_enumerate_children (dir, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        NULL, error);
+  if (dir_enum == NULL)
     return FALSE;
 
-  if (!ostree_repo_checkout_tree (self->repo,
-                                  OSTREE_REPO_CHECKOUT_MODE_NONE,
-                                  OSTREE_REPO_CHECKOUT_OVERWRITE_NONE,
-                                  self->app_dir,
-                                  OSTREE_REPO_FILE (root), file_info,
-                                  NULL, NULL))
-    return FALSE;
+  while (TRUE)
+    {
+      g_autoptr(GFileInfo) child_info = NULL;
+      g_autoptr(GFile) child = NULL;
+      const char *child_name;
+      struct stat stbuf;
+
+      child_info = g_file_enumerator_next_file (dir_enum, NULL, &temp_error);
+      if (child_info == NULL)
+        break;
+
+      child_name = g_file_info_get_name (child_info);
+      child = g_file_get_child (dir, child_name);
+
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY)
+        {
+          if (!builder_cache_record_checkout (self, child, dir_fd, child_name, error))
+            return FALSE;
+        }
+      else if (fstatat (dir_fd, child_name, &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+        builder_cache_record_file (self, &stbuf,
+                                   ostree_repo_file_get_checksum (OSTREE_REPO_FILE (child)));
+    }
+
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, temp_error);
+      return FALSE;
+    }
 
   return TRUE;
 }
 
+/* The checkout hardlinks the files from the (bare) cache repo. If
+ * @record is set, the checksum of each checked out file is recorded,
+ * so that the next commit of the app dir only has to read and hash
+ * new or changed files. */
+static gboolean
+builder_cache_checkout (BuilderCache *self,
+                        const char   *commit,
+                        gboolean      record)
+{
+  OstreeRepoCheckoutOptions options = { 0, };
+  g_autoptr(GFile) root = NULL;
+
+  options.mode = OSTREE_REPO_CHECKOUT_MODE_NONE;
+  options.overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_NONE;
+
+  if (!ostree_repo_checkout_tree_at (self->repo, &options,
+                                     AT_FDCWD, gs_file_get_path_cached (self->app_dir),
+                                     commit, NULL, NULL))
+    return FALSE;
+
+  if (!record)
+    return TRUE;
+
+  g_hash_table_remove_all (self->file_checksums);
+
+  if (!ostree_repo_read_commit (self->repo, commit, &root, NULL, NULL, NULL))
+    return FALSE;
+
+  return builder_cache_record_checkout (self, root, AT_FDCWD,
+                                        gs_file_get_path_cached (self->app_dir), NULL);
+}
+
 void
 builder_cache_ensure_checkout (BuilderCache *self)
 {
@@ -251,7 +378,7 @@ builder_cache_ensure_checkout (BuilderCache *self)
     {
       g_print ("Everything cached, checking out from cache\n");
 
-      if (!builder_cache_checkout (self, self->last_parent))
+      if (!builder_cache_checkout (self, self->last_parent, FALSE))
         g_error ("Failed to check out cache");
     }
 }
@@ -286,6 +413,7 @@ builder_cache_lookup (BuilderCache *self)
         {
           g_free (self->last_parent);
           self->last_parent = g_steal_pointer (&commit);
+          self->used = TRUE;
 
           return TRUE;
         }
@@ -299,7 +427,7 @@ builder_cache_lookup (BuilderCache *self)
     {
       g_print ("Cache miss, checking out last cache hit\n");
 
-      if (!builder_cache_checkout (self, self->last_parent))
+      if (!builder_cache_checkout (self, self->last_parent, TRUE))
         g_error ("Failed to check out cache");
     }
 
@@ -308,27 +436,189 @@ builder_cache_lookup (BuilderCache *self)
   return FALSE;
 }
 
+static void builder_cache_add_written (BuilderCache *self,
+                                       guint64       bytes);
+
+static gboolean
+builder_cache_write_dirmeta (BuilderCache      *self,
+                             struct stat       *stbuf,
+                             OstreeMutableTree *mtree,
+                             GError           **error)
+{
+  g_autoptr(GFileInfo) info = g_file_info_new ();
+  g_autoptr(GVariant) dirmeta = NULL;
+  g_autofree guchar *csum = NULL;
+  g_autofree char *checksum = NULL;
+
+  g_file_info_set_attribute_uint32 (info, "unix::uid", stbuf->st_uid);
+  g_file_info_set_attribute_uint32 (info, "unix::gid", stbuf->st_gid);
+  g_file_info_set_attribute_uint32 (info, "unix::mode", stbuf->st_mode);
+
+  dirmeta = ostree_create_directory_metadata (info, NULL);
+  if (!ostree_repo_write_metadata (self->repo, OSTREE_OBJECT_TYPE_DIR_META, NULL,
+                                   dirmeta, &csum, NULL, error))
+    return FALSE;
+
+  checksum = ostree_checksum_from_bytes (csum);
+  ostree_mutable_tree_set_metadata_checksum (mtree, checksum);
+
+  return TRUE;
+}
+
+/* Returns the checksum of the file @name in @dfd, writing it to the
+ * repo unless it is unchanged since it was last committed or checked
+ * out */
+static char *
+builder_cache_write_file (BuilderCache *self,
+                          int           dfd,
+                          const char   *name,
+                          struct stat  *stbuf,
+                          GError      **error)
+{
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GInputStream) content = NULL;
+  g_autofree guchar *csum = NULL;
+  g_autofree char *checksum = NULL;
+  const char *cached;
+  guint64 length;
+
+  cached = builder_cache_lookup_file (self, stbuf);
+  if (cached != NULL)
+    return g_strdup (cached);
+
+  info = g_file_info_new ();
+  g_file_info_set_attribute_uint32 (info, "unix::uid", stbuf->st_uid);
+  g_file_info_set_attribute_uint32 (info, "unix::gid", stbuf->st_gid);
+  g_file_info_set_attribute_uint32 (info, "unix::mode", stbuf->st_mode);
+
+  if (S_ISLNK (stbuf->st_mode))
+    {
+      g_autofree char *target = glnx_readlinkat_malloc (dfd, name, NULL, error);
+
+      if (target == NULL)
+        return NULL;
+
+      g_file_info_set_file_type (info, G_FILE_TYPE_SYMBOLIC_LINK);
+      g_file_info_set_symlink_target (info, target);
+    }
+  else
+    {
+      int fd = openat (dfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+
+      if (fd == -1)
+        {
+          glnx_set_error_from_errno (error);
+          return NULL;
+        }
+
+      g_file_info_set_file_type (info, G_FILE_TYPE_REGULAR);
+      g_file_info_set_size (info, stbuf->st_size);
+      input = g_unix_input_stream_new (fd, TRUE);
+    }
+
+  if (!ostree_raw_file_to_content_stream (input, info, NULL, &content, &length, NULL, error) ||
+      !ostree_repo_write_content (self->repo, NULL, content, length, &csum, NULL, error))
+    return NULL;
+
+  checksum = ostree_checksum_from_bytes (csum);
+
+  /* This is the stat from before we read it, so if the file changed
+     meanwhile it is hashed again next time */
+  builder_cache_record_file (self, stbuf, checksum);
+
+  return g_steal_pointer (&checksum);
+}
+
+/* Like ostree_repo_write_directory_to_mtree() without xattrs, but
+ * files that were committed or checked out before and have not
+ * changed since are not read and hashed again */
+static gboolean
+builder_cache_write_dir (BuilderCache      *self,
+                         int                dfd,
+                         const char        *name,
+                         OstreeMutableTree *mtree,
+                         GError           **error)
+{
+  g_auto(GLnxDirFdIterator) iter = {0};
+  struct dirent *dent;
+  struct stat stbuf;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, name, FALSE, &iter, error))
+    return FALSE;
+
+  if (fstat (iter.fd, &stbuf) == -1)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  if (!builder_cache_write_dirmeta (self, &stbuf, mtree, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          g_autoptr(OstreeMutableTree) child = NULL;
+
+          if (!ostree_mutable_tree_ensure_dir (mtree, dent->d_name, &child, error) ||
+              !builder_cache_write_dir (self, iter.fd, dent->d_name, child, error))
+            return FALSE;
+        }
+      else if (S_ISREG (stbuf.st_mode) || S_ISLNK (stbuf.st_mode))
+        {
+          g_autofree char *checksum = NULL;
+
+          checksum = builder_cache_write_file (self, iter.fd, dent->d_name, &stbuf, error);
+          if (checksum == NULL ||
+              !ostree_mutable_tree_replace_file (mtree, dent->d_name, checksum, error))
+            return FALSE;
+        }
+      else
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "Unsupported file type for %s", dent->d_name);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
 gboolean
 builder_cache_commit (BuilderCache  *self,
                       const char *body,
                       GError       **error)
 {
   g_autofree char *current = NULL;
-  OstreeRepoCommitModifier *modifier = NULL;
   g_autoptr(OstreeMutableTree) mtree = NULL;
   g_autoptr(GFile) root = NULL;
   g_autofree char *commit_checksum = NULL;
+  OstreeRepoTransactionStats stats = { 0, };
   gboolean res = FALSE;
 
   if (!ostree_repo_prepare_transaction (self->repo, NULL, NULL, error))
     return FALSE;
 
+  builder_profile_begin (self->profile, "cache-commit");
+
   mtree = ostree_mutable_tree_new ();
 
-  modifier = ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS,
-                                              NULL, NULL, NULL);
-  if (!ostree_repo_write_directory_to_mtree (self->repo, self->app_dir,
-                                             mtree, modifier, NULL, error))
+  if (!builder_cache_write_dir (self, AT_FDCWD, gs_file_get_path_cached (self->app_dir),
+                                mtree, error))
     goto out;
 
   if (!ostree_repo_write_mtree (self->repo, mtree, &root, NULL, error))
@@ -343,11 +633,14 @@ builder_cache_commit (BuilderCache  *self,
 
   ostree_repo_transaction_set_ref (self->repo, NULL, self->branch, commit_checksum);
 
-  if (!ostree_repo_commit_transaction (self->repo, NULL, NULL, error))
+  if (!ostree_repo_commit_transaction (self->repo, &stats, NULL, error))
     goto out;
 
+  builder_cache_add_written (self, stats.content_bytes_written);
+
   g_free (self->last_parent);
   self->last_parent = g_steal_pointer (&commit_checksum);
+  self->used = TRUE;
 
   res = TRUE;
 
@@ -357,8 +650,8 @@ builder_cache_commit (BuilderCache  *self,
       if (!ostree_repo_abort_transaction (self->repo, NULL, NULL))
         g_warning ("failed to abort transaction");
     }
-  if (modifier)
-    ostree_repo_commit_modifier_unref (modifier);
+
+  builder_profile_end (self->profile);
 
   return res;
 }
@@ -421,20 +714,402 @@ builder_cache_disable_lookups (BuilderCache  *self)
   self->disabled = TRUE;
 }
 
-gboolean
-builder_gc (BuilderCache  *self,
-            GError       **error)
+void
+builder_cache_set_profile (BuilderCache   *self,
+                           BuilderProfile *profile)
+{
+  g_set_object (&self->profile, profile);
+}
+
+/* The gc state keeps track of when each branch in the cache was last
+ * used and how much it wrote, and of the size of the cache. */
+#define BUILDER_CACHE_GC_STATE "xdg-app-builder-gc"
+#define BUILDER_CACHE_GC_GROUP "gc"
+#define BUILDER_CACHE_BRANCH_GROUP_PREFIX "branch "
+/* Unreachable objects are only pruned this often, unless a branch was
+ * evicted, as a prune has to look at every object in the cache */
+#define BUILDER_CACHE_PRUNE_INTERVAL (24 * 60 * 60)
+
+static int
+cmp_strings (gconstpointer a,
+             gconstpointer b)
+{
+  return strcmp (*(const char **)a, *(const char **)b);
+}
+
+static GKeyFile *
+builder_cache_load_gc_state (BuilderCache *self)
+{
+  g_autoptr(GFile) state_file = g_file_get_child (self->cache_dir, BUILDER_CACHE_GC_STATE);
+  GKeyFile *state = g_key_file_new ();
+
+  /* A missing or broken state file is the same as an empty one */
+  g_key_file_load_from_file (state, gs_file_get_path_cached (state_file), G_KEY_FILE_NONE, NULL);
+
+  return state;
+}
+
+static gboolean
+builder_cache_save_gc_state (BuilderCache *self,
+                             GKeyFile     *state,
+                             GError      **error)
+{
+  g_autoptr(GFile) state_file = g_file_get_child (self->cache_dir, BUILDER_CACHE_GC_STATE);
+
+  return g_key_file_save_to_file (state, gs_file_get_path_cached (state_file), error);
+}
+
+/* Adds what a commit wrote to the size of the cache, if that is known
+ * yet, and to the size of the current branch. This is saved right
+ * away, so that builds that fail later are counted too. */
+static void
+builder_cache_add_written (BuilderCache *self,
+                           guint64       bytes)
+{
+  g_autoptr(GKeyFile) state = builder_cache_load_gc_state (self);
+  g_autofree char *group = g_strconcat (BUILDER_CACHE_BRANCH_GROUP_PREFIX, self->branch, NULL);
+  g_autoptr(GError) error = NULL;
+
+  if (bytes == 0)
+    return;
+
+  g_key_file_set_uint64 (state, group, "size",
+                         g_key_file_get_uint64 (state, group, "size", NULL) + bytes);
+  if (g_key_file_has_key (state, BUILDER_CACHE_GC_GROUP, "size", NULL))
+    g_key_file_set_uint64 (state, BUILDER_CACHE_GC_GROUP, "size",
+                           g_key_file_get_uint64 (state, BUILDER_CACHE_GC_GROUP, "size", NULL) + bytes);
+
+  if (!builder_cache_save_gc_state (self, state, &error))
+    g_warning ("Failed to save build cache gc state: %s", error->message);
+}
+
+static guint64
+builder_cache_get_last_used (BuilderCache *self,
+                             GKeyFile     *state,
+                             const char   *branch,
+                             const char   *commit)
+{
+  g_autofree char *group = g_strconcat (BUILDER_CACHE_BRANCH_GROUP_PREFIX, branch, NULL);
+  g_autoptr(GVariant) variant = NULL;
+  guint64 last_used;
+
+  last_used = g_key_file_get_uint64 (state, group, "last-used", NULL);
+
+  /* Branches from before we tracked use are as old as their last commit */
+  if (last_used == 0 &&
+      ostree_repo_load_variant (self->repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
+                                &variant, NULL))
+    {
+      guint64 timestamp;
+
+      g_variant_get_child (variant, 5, "t", &timestamp);
+      last_used = GUINT64_FROM_BE (timestamp);
+    }
+
+  return last_used;
+}
+
+static gboolean
+get_dir_size (int          dfd,
+              const char  *name,
+              guint64     *size,
+              GError     **error)
+{
+  g_auto(GLnxDirFdIterator) iter = {0};
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, name, FALSE, &iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+        continue;
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          if (!get_dir_size (iter.fd, dent->d_name, size, error))
+            return FALSE;
+        }
+      else
+        *size += stbuf.st_size;
+    }
+
+  return TRUE;
+}
+
+/* The size is only measured if the state doesn't have it yet, after
+ * that it is kept up to date from what commits write and what prunes
+ * free */
+static gboolean
+builder_cache_ensure_size (BuilderCache *self,
+                           GKeyFile     *state,
+                           GError      **error)
+{
+  g_autoptr(GFile) objects_dir = g_file_get_child (self->cache_dir, "objects");
+  guint64 size = 0;
+
+  if (g_key_file_has_key (state, BUILDER_CACHE_GC_GROUP, "size", NULL))
+    return TRUE;
+
+  if (!get_dir_size (AT_FDCWD, gs_file_get_path_cached (objects_dir), &size, error))
+    return FALSE;
+
+  g_key_file_set_uint64 (state, BUILDER_CACHE_GC_GROUP, "size", size);
+
+  return TRUE;
+}
+
+static gboolean
+builder_cache_prune (BuilderCache *self,
+                     GKeyFile     *state,
+                     GError      **error)
 {
   gint objects_total;
   gint objects_pruned;
   guint64 pruned_object_size_total;
+  guint64 size;
+
+  if (!ostree_repo_prune (self->repo,
+                          OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY, -1,
+                          &objects_total,
+                          &objects_pruned,
+                          &pruned_object_size_total,
+                          NULL, error))
+    return FALSE;
+
+  g_key_file_set_uint64 (state, BUILDER_CACHE_GC_GROUP, "last-prune", g_get_real_time () / G_USEC_PER_SEC);
+
+  if (g_key_file_has_key (state, BUILDER_CACHE_GC_GROUP, "size", NULL))
+    {
+      size = g_key_file_get_uint64 (state, BUILDER_CACHE_GC_GROUP, "size", NULL);
+      g_key_file_set_uint64 (state, BUILDER_CACHE_GC_GROUP, "size",
+                             size > pruned_object_size_total ? size - pruned_object_size_total : 0);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+builder_cache_evict_branch (BuilderCache *self,
+                            GKeyFile     *state,
+                            const char   *branch,
+                            GError      **error)
+{
+  g_autofree char *group = g_strconcat (BUILDER_CACHE_BRANCH_GROUP_PREFIX, branch, NULL);
+
+  g_print ("Removing %s from the build cache\n", branch);
+
+  if (!ostree_repo_set_ref_immediate (self->repo, NULL, branch, NULL, NULL, error))
+    return FALSE;
+
+  g_key_file_remove_group (state, group, NULL);
+
+  return TRUE;
+}
+
+/* The extract cache is a directory per extracted source, whose mtime
+ * is updated each time it is used. The same limits apply to it as to
+ * the build cache. */
+static gboolean
+builder_gc_extract_cache (GFile         *extract_cache_dir,
+                          guint64        max_size,
+                          guint64        max_age,
+                          GError       **error)
+{
+  g_auto(GLnxDirFdIterator) iter = {0};
+  g_autoptr(GPtrArray) lru = g_ptr_array_new_with_free_func (g_free);
+  guint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  guint64 total_size = 0;
+  struct dirent *dent;
+  int i;
+
+  if (!g_file_query_exists (extract_cache_dir, NULL))
+    return TRUE;
+
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, gs_file_get_path_cached (extract_cache_dir),
+                                    FALSE, &iter, error))
+    return FALSE;
 
-  return ostree_repo_prune (self->repo,
-                            OSTREE_REPO_PRUNE_FLAGS_REFS_ONLY, -1,
-                            &objects_total,
-                            &objects_pruned,
-                            &pruned_object_size_total,
-                            NULL, error);
+  while (TRUE)
+    {
+      struct stat stbuf;
+      guint64 size = 0;
+
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1 ||
+          !S_ISDIR (stbuf.st_mode))
+        continue;
+
+      if (max_age > 0 && (guint64)stbuf.st_mtime + max_age < now)
+        {
+          g_print ("Removing extracted source %s\n", dent->d_name);
+          if (!glnx_shutil_rm_rf_at (iter.fd, dent->d_name, NULL, error))
+            return FALSE;
+          continue;
+        }
+
+      /* Sources that are still being extracted are never evicted */
+      if (max_size == 0 || g_str_has_prefix (dent->d_name, "tmp-"))
+        continue;
+
+      if (!get_dir_size (iter.fd, dent->d_name, &size, error))
+        return FALSE;
+
+      total_size += size;
+      g_ptr_array_add (lru, g_strdup_printf ("%020" G_GUINT64_FORMAT " %020" G_GUINT64_FORMAT " %s",
+                                             (guint64)stbuf.st_mtime, size, dent->d_name));
+    }
+
+  g_ptr_array_sort (lru, (GCompareFunc)cmp_strings);
+
+  for (i = 0; total_size > max_size && i < lru->len; i++)
+    {
+      char *entry = g_ptr_array_index (lru, i);
+      char *name = strchr (strchr (entry, ' ') + 1, ' ') + 1;
+      guint64 size = g_ascii_strtoull (strchr (entry, ' ') + 1, NULL, 10);
+
+      g_print ("Removing extracted source %s\n", name);
+      if (!glnx_shutil_rm_rf_at (iter.fd, name, NULL, error))
+        return FALSE;
+
+      total_size -= size;
+    }
+
+  return TRUE;
+}
+
+/* Garbage collects the cache. Branches (i.e. manifests) that were not
+ * used for more than max_age seconds are removed, and if the cache is
+ * larger than max_size bytes the least recently used branches are
+ * removed until it fits. A max of 0 means no limit. The current
+ * branch is never removed.
+ *
+ * To keep this cheap, unreachable objects are only pruned when a
+ * branch was removed, once per BUILDER_CACHE_PRUNE_INTERVAL, or when
+ * the cache is over max_size. The size of the cache is only measured
+ * once, and then tracked from the bytes each commit writes and each
+ * prune frees. Each branch records the bytes written while it was
+ * current, which is what evicting it is expected to free, so that all
+ * the branches needed to fit are evicted before pruning once.
+ *
+ * The extract cache in extract_cache_dir, if not NULL, is collected
+ * with the same limits.
+ */
+gboolean
+builder_gc (BuilderCache  *self,
+            GFile         *extract_cache_dir,
+            guint64        max_size,
+            guint64        max_age,
+            GError       **error)
+{
+  g_autoptr(GKeyFile) state = builder_cache_load_gc_state (self);
+  g_autoptr(GHashTable) refs = NULL;
+  g_autoptr(GPtrArray) lru = g_ptr_array_new_with_free_func (g_free);
+  g_autofree char *current_group = g_strconcat (BUILDER_CACHE_BRANCH_GROUP_PREFIX, self->branch, NULL);
+  guint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  guint64 last_prune;
+  gboolean need_prune;
+  GHashTableIter iter;
+  gpointer key, value;
+  int i;
+
+  if (self->used)
+    g_key_file_set_uint64 (state, current_group, "last-used", now);
+
+  if (max_size > 0 && !builder_cache_ensure_size (self, state, error))
+    return FALSE;
+
+  last_prune = g_key_file_get_uint64 (state, BUILDER_CACHE_GC_GROUP, "last-prune", NULL);
+  need_prune = last_prune + BUILDER_CACHE_PRUNE_INTERVAL <= now;
+
+  if (!ostree_repo_list_refs (self->repo, NULL, &refs, NULL, error))
+    return FALSE;
+
+  /* Collect the other branches, least recently used first */
+  g_hash_table_iter_init (&iter, refs);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *branch = key;
+      guint64 last_used;
+
+      if (strcmp (branch, self->branch) == 0)
+        continue;
+
+      last_used = builder_cache_get_last_used (self, state, branch, value);
+
+      if (max_age > 0 && last_used + max_age < now)
+        {
+          if (!builder_cache_evict_branch (self, state, branch, error))
+            return FALSE;
+          need_prune = TRUE;
+          continue;
+        }
+
+      /* Sort key first so that plain string sorting gives lru order */
+      g_ptr_array_add (lru, g_strdup_printf ("%020" G_GUINT64_FORMAT " %s", last_used, branch));
+    }
+
+  g_ptr_array_sort (lru, (GCompareFunc)cmp_strings);
+
+  /* If the cache is too large, first get rid of what is already
+     unreachable before removing any branches */
+  if (max_size > 0 &&
+      g_key_file_get_uint64 (state, BUILDER_CACHE_GC_GROUP, "size", NULL) > max_size)
+    need_prune = TRUE;
+
+  if (need_prune && !builder_cache_prune (self, state, error))
+    return FALSE;
+
+  i = 0;
+  while (max_size > 0 && i < lru->len &&
+         g_key_file_get_uint64 (state, BUILDER_CACHE_GC_GROUP, "size", NULL) > max_size)
+    {
+      guint64 expected_size = g_key_file_get_uint64 (state, BUILDER_CACHE_GC_GROUP, "size", NULL);
+
+      /* Evict what should be enough to fit, then prune once. Branches
+         share objects, so if that freed less than expected go again. A
+         branch from before sizes were recorded is pruned on its own. */
+      while (i < lru->len && expected_size > max_size)
+        {
+          const char *branch = strchr (g_ptr_array_index (lru, i++), ' ') + 1;
+          g_autofree char *group = g_strconcat (BUILDER_CACHE_BRANCH_GROUP_PREFIX, branch, NULL);
+          guint64 branch_size = g_key_file_get_uint64 (state, group, "size", NULL);
+
+          if (!builder_cache_evict_branch (self, state, branch, error))
+            return FALSE;
+
+          if (branch_size == 0)
+            break;
+
+          expected_size -= MIN (expected_size, branch_size);
+        }
+
+      if (!builder_cache_prune (self, state, error))
+        return FALSE;
+    }
+
+  if (!builder_cache_save_gc_state (self, state, error))
+    return FALSE;
+
+  if (extract_cache_dir != NULL &&
+      !builder_gc_extract_cache (extract_cache_dir, max_size, max_age, error))
+    return FALSE;
+
+  return TRUE;
 }
 
 void
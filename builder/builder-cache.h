@@ -24,6 +24,8 @@
 #include <gio/gio.h>
 #include <libglnx/libglnx.h>
 
+#include "builder-profile.h"
+
 G_BEGIN_DECLS
 
 typedef struct BuilderCache BuilderCache;
@@ -38,6 +40,8 @@ BuilderCache *builder_cache_new             (GFile         *cache_dir,
                                              GFile         *app_dir,
                                              const char    *branch);
 void          builder_cache_disable_lookups (BuilderCache  *self);
+void          builder_cache_set_profile     (BuilderCache  *self,
+                                             BuilderProfile *profile);
 gboolean      builder_cache_open            (BuilderCache  *self,
                                              GError       **error);
 GChecksum *   builder_cache_get_checksum    (BuilderCache  *self);
@@ -49,6 +53,9 @@ gboolean      builder_cache_commit          (BuilderCache  *self,
 GPtrArray   *builder_cache_get_changes      (BuilderCache  *self,
                                              GError       **error);
 gboolean      builder_gc                    (BuilderCache  *self,
+                                             GFile         *extract_cache_dir,
+                                             guint64        max_size,
+                                             guint64        max_age,
                                              GError       **error);
 
 void builder_cache_checksum_str     (BuilderCache  *self,
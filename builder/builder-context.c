@@ -27,6 +27,8 @@
 #include <stdlib.h>
 #include <sys/statfs.h>
 
+#include "libgsystem.h"
+
 #include "builder-context.h"
 #include "xdg-app-utils.h"
 
@@ -41,8 +43,16 @@ struct BuilderContext {
   GFile *download_dir;
   GFile *state_dir;
   GFile *cache_dir;
+  GFile *extract_cache_dir;
+  GFile *ccache_dir;
+  GFile *ccache_sdk_dir;
 
   BuilderOptions *options;
+  BuilderProfile *profile;
+  gboolean use_ccache;
+  /* The ccache stats when ccache was enabled */
+  guint64 ccache_hits_start;
+  guint64 ccache_misses_start;
 };
 
 typedef struct {
@@ -67,7 +77,11 @@ builder_context_finalize (GObject *object)
   g_clear_object (&self->app_dir);
   g_clear_object (&self->base_dir);
   g_clear_object (&self->soup_session);
+  g_clear_object (&self->extract_cache_dir);
+  g_clear_object (&self->ccache_dir);
+  g_clear_object (&self->ccache_sdk_dir);
   g_clear_object (&self->options);
+  g_clear_object (&self->profile);
   g_free (self->arch);
 
   G_OBJECT_CLASS (builder_context_parent_class)->finalize (object);
@@ -127,6 +141,7 @@ builder_context_constructed (GObject *object)
   self->state_dir = g_file_get_child (self->base_dir, ".xdg-app-builder");
   self->download_dir = g_file_get_child (self->state_dir, "downloads");
   self->cache_dir = g_file_get_child (self->state_dir, "cache");
+  self->extract_cache_dir = g_file_get_child (self->state_dir, "extract-cache");
 }
 
 static void
@@ -190,6 +205,12 @@ builder_context_get_cache_dir (BuilderContext  *self)
   return self->cache_dir;
 }
 
+GFile *
+builder_context_get_extract_cache_dir (BuilderContext  *self)
+{
+  return self->extract_cache_dir;
+}
+
 SoupSession *
 builder_context_get_soup_session (BuilderContext *self)
 {
@@ -247,6 +268,206 @@ builder_context_set_options (BuilderContext *self,
   g_set_object (&self->options, option);
 }
 
+BuilderProfile *
+builder_context_get_profile (BuilderContext *self)
+{
+  return self->profile;
+}
+
+void
+builder_context_set_profile (BuilderContext *self,
+                             BuilderProfile *profile)
+{
+  g_set_object (&self->profile, profile);
+}
+
+gboolean
+builder_context_get_use_ccache (BuilderContext *self)
+{
+  return self->use_ccache;
+}
+
+/* The ccache dir is shared between all builds of the user, and is
+ * accessed at the same path inside the build sandbox. */
+GFile *
+builder_context_get_ccache_dir (BuilderContext *self)
+{
+  if (self->ccache_dir == NULL)
+    {
+      g_autofree char *path = g_build_filename (g_get_user_cache_dir (),
+                                                "xdg-app-builder", "ccache", NULL);
+      self->ccache_dir = g_file_new_for_path (path);
+    }
+
+  return self->ccache_dir;
+}
+
+static gboolean read_ccache_stats (BuilderContext *self,
+                                   guint64        *hits,
+                                   guint64        *misses,
+                                   GError        **error);
+
+gboolean
+builder_context_enable_ccache (BuilderContext *self,
+                               GFile          *sdk_dir,
+                               GError        **error)
+{
+  g_autoptr(GFile) ccache_bin_dir = g_file_get_child (builder_context_get_ccache_dir (self), "bin");
+  const char *compilers[] = { "cc", "c++", "gcc", "g++", NULL };
+  int i;
+
+  if (!gs_file_ensure_directory (ccache_bin_dir, TRUE, NULL, error))
+    return FALSE;
+
+  g_set_object (&self->ccache_sdk_dir, sdk_dir);
+
+  /* Make sure the sdk has a ccache we can use, rather than failing
+     every compiler call later. This is also the starting point for
+     builder_context_get_ccache_stats(). */
+  if (!read_ccache_stats (self, &self->ccache_hits_start, &self->ccache_misses_start, error))
+    return FALSE;
+
+  /* These are put first in PATH in the sandbox, so that the compilers
+     are found via ccache even if CC and CXX are not set */
+  for (i = 0; compilers[i] != NULL; i++)
+    {
+      g_autoptr(GFile) link = g_file_get_child (ccache_bin_dir, compilers[i]);
+      g_autoptr(GError) my_error = NULL;
+
+      if (!g_file_make_symbolic_link (link, "/usr/bin/ccache", NULL, &my_error) &&
+          !g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+        {
+          g_propagate_error (error, g_steal_pointer (&my_error));
+          return FALSE;
+        }
+    }
+
+  self->use_ccache = TRUE;
+
+  return TRUE;
+}
+
+char **
+builder_context_extend_env (BuilderContext *self,
+                            char          **envp)
+{
+  if (self->use_ccache)
+    {
+      g_autofree char *ccache_dir_path = g_file_get_path (builder_context_get_ccache_dir (self));
+      g_autofree char *ccache_bin_path = g_build_filename (ccache_dir_path, "bin", NULL);
+      g_autofree char *path = NULL;
+      const char *old_path;
+      const char *cc_vars[] = { "CC", "CXX", NULL };
+      int i;
+
+      old_path = g_environ_getenv (envp, "PATH");
+      path = g_strconcat (ccache_bin_path, ":", old_path ? old_path : "/app/bin:/usr/bin", NULL);
+      envp = g_environ_setenv (envp, "PATH", path, TRUE);
+
+      for (i = 0; cc_vars[i] != NULL; i++)
+        {
+          const char *cc = g_environ_getenv (envp, cc_vars[i]);
+
+          if (cc != NULL && !g_str_has_prefix (cc, "ccache "))
+            {
+              g_autofree char *wrapped_cc = g_strconcat ("ccache ", cc, NULL);
+              envp = g_environ_setenv (envp, cc_vars[i], wrapped_cc, TRUE);
+            }
+        }
+
+      envp = g_environ_setenv (envp, "CCACHE_DIR", ccache_dir_path, TRUE);
+      /* Hash the compiler binary rather than its mtime, and ignore the
+         randomly named build dirs, so that the cached objects stay valid
+         when the sdk is updated, or a module is rebuilt elsewhere. */
+      envp = g_environ_setenv (envp, "CCACHE_COMPILERCHECK", "content", FALSE);
+      envp = g_environ_setenv (envp, "CCACHE_NOHASHDIR", "1", FALSE);
+    }
+
+  return envp;
+}
+
+/* The stats are read by running ccache in the sdk, as the format of
+ * the stats files differs between ccache versions. sdk_dir is a build
+ * dir initialized with the sdk by builder_context_enable_ccache(). */
+static gboolean
+read_ccache_stats (BuilderContext *self,
+                   guint64        *hits,
+                   guint64        *misses,
+                   GError        **error)
+{
+  g_autofree char *ccache_dir_path = g_file_get_path (builder_context_get_ccache_dir (self));
+  g_autofree char *filesystem_arg = g_strdup_printf ("--filesystem=%s", ccache_dir_path);
+  g_autofree char *env_arg = g_strdup_printf ("--env=CCACHE_DIR=%s", ccache_dir_path);
+  g_autoptr(GSubprocess) subp = NULL;
+  g_autofree char *output = NULL;
+  g_auto(GStrv) lines = NULL;
+  g_autoptr(GError) my_error = NULL;
+  int i;
+
+  *hits = 0;
+  *misses = 0;
+
+  subp = g_subprocess_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE | G_SUBPROCESS_FLAGS_STDERR_SILENCE,
+                           error,
+                           "xdg-app", "build", "--nofilesystem=host",
+                           filesystem_arg, env_arg,
+                           gs_file_get_path_cached (self->ccache_sdk_dir),
+                           "/usr/bin/ccache", "--print-stats",
+                           NULL);
+  if (subp == NULL)
+    return FALSE;
+
+  if (!g_subprocess_communicate_utf8 (subp, NULL, NULL, &output, NULL, error))
+    return FALSE;
+
+  if (!g_subprocess_wait_check (subp, NULL, &my_error))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "Can't run /usr/bin/ccache in the sdk, ccache 3.7 or later is needed: %s",
+                   my_error->message);
+      return FALSE;
+    }
+
+  /* Lines are counter names and values, separated by a tab */
+  lines = g_strsplit (output, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      char *value = strchr (lines[i], '\t');
+
+      if (value == NULL)
+        continue;
+      *value++ = 0;
+
+      /* ccache 3.x and 4.x name the hit counters differently */
+      if (strcmp (lines[i], "direct_cache_hit") == 0 ||
+          strcmp (lines[i], "preprocessed_cache_hit") == 0 ||
+          strcmp (lines[i], "cache_hit_direct") == 0 ||
+          strcmp (lines[i], "cache_hit_preprocessed") == 0)
+        *hits += g_ascii_strtoull (value, NULL, 10);
+      else if (strcmp (lines[i], "cache_miss") == 0)
+        *misses += g_ascii_strtoull (value, NULL, 10);
+    }
+
+  return TRUE;
+}
+
+/* Returns the ccache hits and misses since builder_context_enable_ccache() */
+gboolean
+builder_context_get_ccache_stats (BuilderContext *self,
+                                  guint64        *hits,
+                                  guint64        *misses,
+                                  GError        **error)
+{
+  if (!read_ccache_stats (self, hits, misses, error))
+    return FALSE;
+
+  /* The stats may have been zeroed meanwhile */
+  *hits = *hits >= self->ccache_hits_start ? *hits - self->ccache_hits_start : *hits;
+  *misses = *misses >= self->ccache_misses_start ? *misses - self->ccache_misses_start : *misses;
+
+  return TRUE;
+}
+
 int
 builder_context_get_n_cpu (BuilderContext *self)
 {
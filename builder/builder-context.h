@@ -24,6 +24,7 @@
 #include <gio/gio.h>
 #include <libsoup/soup.h>
 #include "builder-options.h"
+#include "builder-profile.h"
 
 G_BEGIN_DECLS
 
@@ -40,14 +41,29 @@ GFile *         builder_context_get_base_dir     (BuilderContext *self);
 GFile *         builder_context_get_state_dir    (BuilderContext *self);
 GFile *         builder_context_get_cache_dir    (BuilderContext *self);
 GFile *         builder_context_get_download_dir (BuilderContext *self);
+GFile *         builder_context_get_extract_cache_dir (BuilderContext *self);
 SoupSession *   builder_context_get_soup_session (BuilderContext *self);
 const char *    builder_context_get_arch         (BuilderContext *self);
 void            builder_context_set_arch         (BuilderContext *self,
                                                   const char     *arch);
 int             builder_context_get_n_cpu        (BuilderContext *self);
+gboolean        builder_context_get_use_ccache   (BuilderContext *self);
+GFile *         builder_context_get_ccache_dir   (BuilderContext *self);
+gboolean        builder_context_enable_ccache    (BuilderContext *self,
+                                                  GFile          *sdk_dir,
+                                                  GError        **error);
+char **         builder_context_extend_env       (BuilderContext *self,
+                                                  char          **envp);
+gboolean        builder_context_get_ccache_stats (BuilderContext *self,
+                                                  guint64        *hits,
+                                                  guint64        *misses,
+                                                  GError        **error);
 BuilderOptions *builder_context_get_options      (BuilderContext *self);
 void            builder_context_set_options      (BuilderContext *self,
                                                   BuilderOptions *option);
+BuilderProfile *builder_context_get_profile      (BuilderContext *self);
+void            builder_context_set_profile      (BuilderContext *self,
+                                                  BuilderProfile *profile);
 
 BuilderContext *builder_context_new              (GFile          *base_dir,
                                                   GFile          *app_dir);
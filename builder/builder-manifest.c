@@ -495,17 +495,13 @@ builder_manifest_get_runtime_version (BuilderManifest *self)
   return self->runtime_version ? self->runtime_version : "master";
 }
 
-gboolean
-builder_manifest_init_app_dir (BuilderManifest *self,
-                               BuilderContext *context,
-                               GError **error)
+static gboolean
+init_build_dir (BuilderManifest *self,
+                GFile *dir,
+                GError **error)
 {
-  GFile *app_dir = builder_context_get_app_dir (context);
-  g_autofree char *app_dir_path = g_file_get_path (app_dir);
-  g_autoptr(GSubprocessLauncher) launcher = NULL;
+  g_autofree char *dir_path = g_file_get_path (dir);
   g_autoptr(GSubprocess) subp = NULL;
-  g_autofree char *cwd = NULL;
-  g_autoptr(GPtrArray) args = NULL;
 
   if (self->app_id == NULL)
     {
@@ -533,7 +529,7 @@ builder_manifest_init_app_dir (BuilderManifest *self,
                       error,
                       "xdg-app",
                       "build-init",
-                      app_dir_path,
+                      dir_path,
                       self->app_id,
                       self->sdk,
                       self->runtime,
@@ -547,6 +543,32 @@ builder_manifest_init_app_dir (BuilderManifest *self,
   return TRUE;
 }
 
+gboolean
+builder_manifest_init_app_dir (BuilderManifest *self,
+                               BuilderContext *context,
+                               GError **error)
+{
+  return init_build_dir (self, builder_context_get_app_dir (context), error);
+}
+
+/* Initializes a scratch build dir in the state dir, for running tools
+   from the sdk before the app dir exists */
+GFile *
+builder_manifest_init_sdk_dir (BuilderManifest *self,
+                               BuilderContext *context,
+                               GError **error)
+{
+  g_autoptr(GFile) sdk_dir = g_file_get_child (builder_context_get_state_dir (context), "sdk");
+
+  if (!gs_shutil_rm_rf (sdk_dir, NULL, error))
+    return NULL;
+
+  if (!init_build_dir (self, sdk_dir, error))
+    return NULL;
+
+  return g_steal_pointer (&sdk_dir);
+}
+
 /* This gets the checksum of everything that globally affects the build */
 void
 builder_manifest_checksum (BuilderManifest *self,
@@ -601,6 +623,7 @@ builder_manifest_download (BuilderManifest *self,
                            BuilderContext *context,
                            GError **error)
 {
+  BuilderProfile *profile = builder_context_get_profile (context);
   GList *l;
 
   g_print ("Downloading sources\n");
@@ -608,9 +631,13 @@ builder_manifest_download (BuilderManifest *self,
     {
       BuilderModule *m = l->data;
 
+      builder_profile_set_module (profile, builder_module_get_name (m));
+      builder_profile_begin (profile, "download");
       if (! builder_module_download_sources (m, context, error))
         return FALSE;
+      builder_profile_end (profile);
     }
+  builder_profile_set_module (profile, NULL);
 
   return TRUE;
 }
@@ -621,6 +648,7 @@ builder_manifest_build (BuilderManifest *self,
                         BuilderContext *context,
                         GError **error)
 {
+  BuilderProfile *profile = builder_context_get_profile (context);
   GList *l;
 
   builder_context_set_options (context, self->build_options);
@@ -631,27 +659,40 @@ builder_manifest_build (BuilderManifest *self,
       BuilderModule *m = l->data;
       g_autoptr(GPtrArray) changes = NULL;
 
+      builder_profile_set_module (profile, builder_module_get_name (m));
+
       builder_module_checksum (m, cache, context);
 
       if (!builder_cache_lookup (cache))
         {
           g_autofree char *body =
             g_strdup_printf ("Built %s\n", builder_module_get_name (m));
+
+          builder_profile_set_cache_hit (profile, FALSE);
+          builder_profile_begin (profile, "build");
           if (!builder_module_build (m, context, error))
             return FALSE;
+          builder_profile_end (profile);
+
           if (!builder_cache_commit (cache, body, error))
             return FALSE;
         }
       else
-        g_print ("Cache hit for %s, skipping build\n",
-                 builder_module_get_name (m));
+        {
+          builder_profile_set_cache_hit (profile, TRUE);
+          g_print ("Cache hit for %s, skipping build\n",
+                   builder_module_get_name (m));
+        }
 
+      builder_profile_begin (profile, "get-changes");
       changes = builder_cache_get_changes (cache, error);
       if (changes == NULL)
         return FALSE;
+      builder_profile_end (profile);
 
       builder_module_set_changes (m, changes);
     }
+  builder_profile_set_module (profile, NULL);
 
   return TRUE;
 }
@@ -921,6 +962,7 @@ builder_manifest_cleanup (BuilderManifest *self,
   g_autoptr(GHashTable) to_remove_ht = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   GList *l;
   g_autofree char **keys = NULL;
+  BuilderProfile *profile = builder_context_get_profile (context);
   guint n_keys;
   int i;
 
@@ -931,6 +973,8 @@ builder_manifest_cleanup (BuilderManifest *self,
 
       g_print ("Cleaning up\n");
 
+      builder_profile_begin (profile, "cleanup");
+
       for (l = self->modules; l != NULL; l = l->next)
         {
           BuilderModule *m = l->data;
@@ -959,8 +1003,10 @@ builder_manifest_cleanup (BuilderManifest *self,
 
       if (self->strip)
         {
+          builder_profile_begin (profile, "strip");
           if (!foreach_file (self, strip_file_cb, NULL, app_root, error))
             return FALSE;
+          builder_profile_end (profile);
         }
 
       if (self->rename_desktop_file != NULL)
@@ -1057,6 +1103,8 @@ builder_manifest_cleanup (BuilderManifest *self,
             return FALSE;
         }
 
+      builder_profile_end (profile);
+
       if (!builder_cache_commit (cache, "Cleanup", error))
         return FALSE;
     }
@@ -1077,6 +1125,7 @@ builder_manifest_finish (BuilderManifest *self,
   g_autofree char *app_dir_path = g_file_get_path (app_dir);
   g_autoptr(GPtrArray) args = NULL;
   g_autoptr(GSubprocess) subp = NULL;
+  BuilderProfile *profile = builder_context_get_profile (context);
   int i;
 
   builder_manifest_checksum_for_finish (self, cache, context);
@@ -1084,6 +1133,8 @@ builder_manifest_finish (BuilderManifest *self,
     {
       g_print ("Finishing app\n");
 
+      builder_profile_begin (profile, "finish");
+
       args = g_ptr_array_new_with_free_func (g_free);
       g_ptr_array_add (args, g_strdup ("xdg-app"));
       g_ptr_array_add (args, g_strdup ("build-finish"));
@@ -1108,6 +1159,8 @@ builder_manifest_finish (BuilderManifest *self,
           !g_subprocess_wait_check (subp, NULL, error))
         return FALSE;
 
+      builder_profile_end (profile);
+
       if (!builder_cache_commit (cache, "Finish", error))
         return FALSE;
     }
@@ -47,6 +47,9 @@ GList *         builder_manifest_get_modules       (BuilderManifest  *self);
 gboolean        builder_manifest_init_app_dir      (BuilderManifest  *self,
                                                     BuilderContext   *context,
                                                     GError          **error);
+GFile *         builder_manifest_init_sdk_dir      (BuilderManifest  *self,
+                                                    BuilderContext   *context,
+                                                    GError          **error);
 gboolean        builder_manifest_download          (BuilderManifest  *self,
                                                     BuilderContext   *context,
                                                     GError          **error);
@@ -567,6 +567,7 @@ builder_module_build (BuilderModule *self,
                       GError **error)
 {
   GFile *app_dir = builder_context_get_app_dir (context);
+  BuilderProfile *profile = builder_context_get_profile (context);
   g_autofree char *make_j = NULL;
   g_autofree char *make_l = NULL;
   g_autofree char *makefile_content = NULL;
@@ -606,8 +607,10 @@ builder_module_build (BuilderModule *self,
   g_print ("Building module %s in %s\n", self->name, source_dir_path);
   g_print ("========================================================================\n");
 
+  builder_profile_begin (profile, "extract");
   if (!builder_module_extract_sources (self, source_dir, context, error))
     return FALSE;
+  builder_profile_end (profile);
 
   if (self->subdir != NULL && self->subdir[0] != 0)
     source_subdir = g_file_resolve_relative_path (source_dir, self->subdir);
@@ -671,9 +674,11 @@ builder_module_build (BuilderModule *self,
         }
 
       env_with_noconfigure = g_environ_setenv (g_strdupv (env), "NOCONFIGURE", "1", TRUE);
+      builder_profile_begin (profile, "autogen");
       if (!build (app_dir, source_dir, source_subdir, build_args, env_with_noconfigure, error,
                   autogen_cmd, NULL))
         return FALSE;
+      builder_profile_end (profile);
 
       if (!g_file_query_exists (configure_file, NULL))
         {
@@ -731,9 +736,11 @@ builder_module_build (BuilderModule *self,
       else
         configure_prefix_arg = "--prefix=/app";
 
+      builder_profile_begin (profile, "configure");
       if (!build (app_dir, source_dir, build_dir, build_args, env, error,
                   configure_cmd, configure_prefix_arg, strv_arg, self->config_opts, configure_final_arg, NULL))
         return FALSE;
+      builder_profile_end (profile);
     }
   else
     build_dir = g_object_ref (source_subdir);
@@ -765,26 +772,34 @@ builder_module_build (BuilderModule *self,
       make_l = g_strdup_printf ("-l%d", 2*builder_context_get_n_cpu (context));
     }
 
+  builder_profile_begin (profile, "make");
   if (!build (app_dir, source_dir, build_dir, build_args, env, error,
               "make", make_j?make_j:skip_arg, make_l?make_l:skip_arg, strv_arg, self->make_args, NULL))
     return FALSE;
+  builder_profile_end (profile);
 
+  builder_profile_begin (profile, "make-install");
   if (!build (app_dir, source_dir, build_dir, build_args, env, error,
               "make", "install", strv_arg, self->make_install_args, NULL))
     return FALSE;
+  builder_profile_end (profile);
 
   if (self->post_install)
     {
+      builder_profile_begin (profile, "post-install");
       for (i = 0; self->post_install[i] != NULL; i++)
         {
           if (!build (app_dir, source_dir, build_dir, build_args, env, error,
                       "/bin/sh", "-c", self->post_install[i], NULL))
             return FALSE;
         }
+      builder_profile_end (profile);
     }
 
+  builder_profile_begin (profile, "remove-build-dir");
   if (!gs_shutil_rm_rf (source_dir, NULL, error))
     return FALSE;
+  builder_profile_end (profile);
 
   return TRUE;
 }
@@ -395,7 +395,7 @@ builder_options_get_env (BuilderOptions *self, BuilderContext *context)
         }
     }
 
-  return envp;
+  return builder_context_extend_env (context, envp);
 }
 
 char **
@@ -421,6 +421,12 @@ builder_options_get_build_args (BuilderOptions *self,
         }
     }
 
+  if (builder_context_get_use_ccache (context))
+    {
+      g_autofree char *ccache_dir_path = g_file_get_path (builder_context_get_ccache_dir (context));
+      g_ptr_array_add (array, g_strdup_printf ("--filesystem=%s", ccache_dir_path));
+    }
+
   g_ptr_array_add (array, NULL);
 
   return (char **)g_ptr_array_free (g_steal_pointer (&array), FALSE);
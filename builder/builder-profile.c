@@ -0,0 +1,390 @@
+/* builder-profile.c
+ *
+ * Copyright (C) 2015 Red Hat, Inc
+ *
+ * This file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <json-glib/json-glib.h>
+
+#include "builder-profile.h"
+
+typedef struct {
+  char *module;
+  char *phase;
+  gint64 start;     /* usec since the profile was created */
+  gint64 wall_time; /* usec */
+  gint64 cpu_time;  /* usec, including child processes */
+  glong peak_rss;   /* kB, high water mark of us and all children so far */
+} BuilderProfilePhase;
+
+typedef struct {
+  char *name;
+  gboolean cache_hit;
+} BuilderProfileModule;
+
+struct BuilderProfile {
+  GObject parent;
+
+  gint64 start_time;
+  GPtrArray *phases;       /* In order of start */
+  GPtrArray *open_phases;  /* Stack of phases not ended yet */
+  GPtrArray *modules;
+  char *current_module;
+};
+
+typedef struct {
+  GObjectClass parent_class;
+} BuilderProfileClass;
+
+G_DEFINE_TYPE (BuilderProfile, builder_profile, G_TYPE_OBJECT);
+
+static void
+builder_profile_phase_free (BuilderProfilePhase *phase)
+{
+  g_free (phase->module);
+  g_free (phase->phase);
+  g_free (phase);
+}
+
+static void
+builder_profile_module_free (BuilderProfileModule *module)
+{
+  g_free (module->name);
+  g_free (module);
+}
+
+static void
+builder_profile_finalize (GObject *object)
+{
+  BuilderProfile *self = (BuilderProfile *)object;
+
+  g_ptr_array_unref (self->open_phases);
+  g_ptr_array_unref (self->phases);
+  g_ptr_array_unref (self->modules);
+  g_free (self->current_module);
+
+  G_OBJECT_CLASS (builder_profile_parent_class)->finalize (object);
+}
+
+static void
+builder_profile_class_init (BuilderProfileClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = builder_profile_finalize;
+}
+
+static void
+builder_profile_init (BuilderProfile *self)
+{
+  self->start_time = g_get_monotonic_time ();
+  self->phases = g_ptr_array_new_with_free_func ((GDestroyNotify)builder_profile_phase_free);
+  self->open_phases = g_ptr_array_new ();
+  self->modules = g_ptr_array_new_with_free_func ((GDestroyNotify)builder_profile_module_free);
+}
+
+BuilderProfile *
+builder_profile_new (void)
+{
+  return g_object_new (BUILDER_TYPE_PROFILE, NULL);
+}
+
+static gint64
+timeval_to_usec (struct timeval *tv)
+{
+  return (gint64)tv->tv_sec * G_USEC_PER_SEC + tv->tv_usec;
+}
+
+/* Most of the work happens in subprocesses, so we count the cpu time
+   of all the (finished) children too. The kernel only keeps the peak
+   rss of the process and of its largest child so far, so the peak rss
+   is cumulative, not per phase: it only changes in a phase that used
+   more memory than any phase before it. */
+static void
+get_resource_usage (gint64 *cpu_time,
+                    glong  *peak_rss)
+{
+  struct rusage self_usage = { { 0 } };
+  struct rusage children_usage = { { 0 } };
+
+  getrusage (RUSAGE_SELF, &self_usage);
+  getrusage (RUSAGE_CHILDREN, &children_usage);
+
+  *cpu_time =
+    timeval_to_usec (&self_usage.ru_utime) + timeval_to_usec (&self_usage.ru_stime) +
+    timeval_to_usec (&children_usage.ru_utime) + timeval_to_usec (&children_usage.ru_stime);
+  *peak_rss = MAX (self_usage.ru_maxrss, children_usage.ru_maxrss);
+}
+
+static BuilderProfileModule *
+lookup_module (BuilderProfile *self,
+               const char     *name)
+{
+  int i;
+
+  for (i = 0; i < self->modules->len; i++)
+    {
+      BuilderProfileModule *m = g_ptr_array_index (self->modules, i);
+      if (strcmp (m->name, name) == 0)
+        return m;
+    }
+
+  return NULL;
+}
+
+/* Sets the module that following phases are recorded for, or NULL for
+   the global phases */
+void
+builder_profile_set_module (BuilderProfile *self,
+                            const char     *module)
+{
+  if (self == NULL)
+    return;
+
+  g_free (self->current_module);
+  self->current_module = g_strdup (module);
+
+  if (module != NULL && lookup_module (self, module) == NULL)
+    {
+      BuilderProfileModule *m = g_new0 (BuilderProfileModule, 1);
+      m->name = g_strdup (module);
+      g_ptr_array_add (self->modules, m);
+    }
+}
+
+void
+builder_profile_set_cache_hit (BuilderProfile *self,
+                               gboolean        cache_hit)
+{
+  BuilderProfileModule *m;
+
+  if (self == NULL || self->current_module == NULL)
+    return;
+
+  m = lookup_module (self, self->current_module);
+  m->cache_hit = cache_hit;
+}
+
+/* Phases can be nested, each begin must be paired with an end */
+void
+builder_profile_begin (BuilderProfile *self,
+                       const char     *phase)
+{
+  BuilderProfilePhase *p;
+  glong peak_rss;
+
+  if (self == NULL)
+    return;
+
+  p = g_new0 (BuilderProfilePhase, 1);
+  p->module = g_strdup (self->current_module);
+  p->phase = g_strdup (phase);
+  p->start = g_get_monotonic_time () - self->start_time;
+  /* Store the start values, these are replaced by the difference in end */
+  get_resource_usage (&p->cpu_time, &peak_rss);
+
+  g_ptr_array_add (self->phases, p);
+  g_ptr_array_add (self->open_phases, p);
+}
+
+void
+builder_profile_end (BuilderProfile *self)
+{
+  BuilderProfilePhase *p;
+  gint64 cpu_time;
+
+  if (self == NULL)
+    return;
+
+  g_return_if_fail (self->open_phases->len > 0);
+
+  p = g_ptr_array_index (self->open_phases, self->open_phases->len - 1);
+  g_ptr_array_remove_index (self->open_phases, self->open_phases->len - 1);
+
+  get_resource_usage (&cpu_time, &p->peak_rss);
+  p->wall_time = g_get_monotonic_time () - self->start_time - p->start;
+  p->cpu_time = cpu_time - p->cpu_time;
+}
+
+/* Ends all phases that are still open, e.g. when the build failed */
+void
+builder_profile_end_all (BuilderProfile *self)
+{
+  if (self == NULL)
+    return;
+
+  while (self->open_phases->len > 0)
+    builder_profile_end (self);
+}
+
+static void
+add_phase_members (JsonBuilder         *builder,
+                   BuilderProfilePhase *p)
+{
+  json_builder_set_member_name (builder, "phase");
+  json_builder_add_string_value (builder, p->phase);
+  json_builder_set_member_name (builder, "start");
+  json_builder_add_double_value (builder, (double)p->start / G_USEC_PER_SEC);
+  json_builder_set_member_name (builder, "wall-time");
+  json_builder_add_double_value (builder, (double)p->wall_time / G_USEC_PER_SEC);
+  json_builder_set_member_name (builder, "cpu-time");
+  json_builder_add_double_value (builder, (double)p->cpu_time / G_USEC_PER_SEC);
+  json_builder_set_member_name (builder, "peak-rss");
+  json_builder_add_int_value (builder, p->peak_rss);
+}
+
+static void
+add_phases (JsonBuilder    *builder,
+            BuilderProfile *self,
+            const char     *module)
+{
+  int i;
+
+  json_builder_set_member_name (builder, "phases");
+  json_builder_begin_array (builder);
+  for (i = 0; i < self->phases->len; i++)
+    {
+      BuilderProfilePhase *p = g_ptr_array_index (self->phases, i);
+
+      if (g_strcmp0 (p->module, module) != 0)
+        continue;
+
+      json_builder_begin_object (builder);
+      add_phase_members (builder, p);
+      json_builder_end_object (builder);
+    }
+  json_builder_end_array (builder);
+}
+
+/* Takes ownership of builder */
+static gboolean
+write_json (JsonBuilder *builder,
+            GFile       *file,
+            GError     **error)
+{
+  JsonGenerator *generator = json_generator_new ();
+  JsonNode *root = json_builder_get_root (builder);
+  g_autofree char *data = NULL;
+  gsize len;
+
+  json_generator_set_pretty (generator, TRUE);
+  json_generator_set_root (generator, root);
+  data = json_generator_to_data (generator, &len);
+
+  json_node_free (root);
+  g_object_unref (generator);
+  g_object_unref (builder);
+
+  return g_file_replace_contents (file, data, len, NULL, FALSE,
+                                  G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL, error);
+}
+
+gboolean
+builder_profile_write_report (BuilderProfile *self,
+                              GFile          *file,
+                              GError        **error)
+{
+  JsonBuilder *builder = json_builder_new ();
+  gint64 cpu_time;
+  glong peak_rss;
+  int i;
+
+  get_resource_usage (&cpu_time, &peak_rss);
+
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "wall-time");
+  json_builder_add_double_value (builder, (double)(g_get_monotonic_time () - self->start_time) / G_USEC_PER_SEC);
+  json_builder_set_member_name (builder, "cpu-time");
+  json_builder_add_double_value (builder, (double)cpu_time / G_USEC_PER_SEC);
+  json_builder_set_member_name (builder, "peak-rss");
+  json_builder_add_int_value (builder, peak_rss);
+
+  add_phases (builder, self, NULL);
+
+  json_builder_set_member_name (builder, "modules");
+  json_builder_begin_array (builder);
+  for (i = 0; i < self->modules->len; i++)
+    {
+      BuilderProfileModule *m = g_ptr_array_index (self->modules, i);
+
+      json_builder_begin_object (builder);
+      json_builder_set_member_name (builder, "name");
+      json_builder_add_string_value (builder, m->name);
+      json_builder_set_member_name (builder, "cache-hit");
+      json_builder_add_boolean_value (builder, m->cache_hit);
+      add_phases (builder, self, m->name);
+      json_builder_end_object (builder);
+    }
+  json_builder_end_array (builder);
+
+  json_builder_end_object (builder);
+
+  return write_json (builder, file, error);
+}
+
+/* Writes the phases in the Chrome trace event format, which can be
+   loaded in chrome://tracing */
+gboolean
+builder_profile_write_trace (BuilderProfile *self,
+                             GFile          *file,
+                             GError        **error)
+{
+  JsonBuilder *builder = json_builder_new ();
+  int i;
+
+  json_builder_begin_object (builder);
+  json_builder_set_member_name (builder, "traceEvents");
+  json_builder_begin_array (builder);
+  for (i = 0; i < self->phases->len; i++)
+    {
+      BuilderProfilePhase *p = g_ptr_array_index (self->phases, i);
+
+      json_builder_begin_object (builder);
+      json_builder_set_member_name (builder, "name");
+      json_builder_add_string_value (builder, p->phase);
+      json_builder_set_member_name (builder, "cat");
+      json_builder_add_string_value (builder, p->module ? p->module : "global");
+      json_builder_set_member_name (builder, "ph");
+      json_builder_add_string_value (builder, "X");
+      json_builder_set_member_name (builder, "ts");
+      json_builder_add_int_value (builder, p->start);
+      json_builder_set_member_name (builder, "dur");
+      json_builder_add_int_value (builder, p->wall_time);
+      json_builder_set_member_name (builder, "pid");
+      json_builder_add_int_value (builder, getpid ());
+      json_builder_set_member_name (builder, "tid");
+      json_builder_add_int_value (builder, 1);
+      json_builder_set_member_name (builder, "args");
+      json_builder_begin_object (builder);
+      add_phase_members (builder, p);
+      json_builder_end_object (builder);
+      json_builder_end_object (builder);
+    }
+  json_builder_end_array (builder);
+  json_builder_end_object (builder);
+
+  return write_json (builder, file, error);
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright © 2015 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#ifndef __BUILDER_PROFILE_H__
+#define __BUILDER_PROFILE_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct BuilderProfile BuilderProfile;
+
+#define BUILDER_TYPE_PROFILE (builder_profile_get_type())
+#define BUILDER_PROFILE(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), BUILDER_TYPE_PROFILE, BuilderProfile))
+#define BUILDER_IS_PROFILE(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BUILDER_TYPE_PROFILE))
+
+GType builder_profile_get_type (void);
+
+/* All of these except _new accept a NULL profile and then do nothing,
+   so callers don't have to check whether profiling is enabled. */
+
+BuilderProfile *builder_profile_new            (void);
+void            builder_profile_set_module     (BuilderProfile *self,
+                                                const char     *module);
+void            builder_profile_set_cache_hit  (BuilderProfile *self,
+                                                gboolean        cache_hit);
+void            builder_profile_begin          (BuilderProfile *self,
+                                                const char     *phase);
+void            builder_profile_end            (BuilderProfile *self);
+void            builder_profile_end_all        (BuilderProfile *self);
+gboolean        builder_profile_write_report   (BuilderProfile *self,
+                                                GFile          *file,
+                                                GError        **error);
+gboolean        builder_profile_write_trace    (BuilderProfile *self,
+                                                GFile          *file,
+                                                GError        **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(BuilderProfile, g_object_unref)
+
+G_END_DECLS
+
+#endif /* __BUILDER_PROFILE_H__ */
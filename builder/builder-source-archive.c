@@ -581,6 +581,7 @@ builder_source_archive_class_init (BuilderSourceArchiveClass *klass)
   source_class->download = builder_source_archive_download;
   source_class->extract = builder_source_archive_extract;
   source_class->checksum = builder_source_archive_checksum;
+  source_class->cache_extract = TRUE;
 
   g_object_class_install_property (object_class,
                                    PROP_URL,
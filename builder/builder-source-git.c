@@ -591,6 +591,22 @@ builder_source_git_checksum (BuilderSource  *source,
     g_warning ("Failed to get current git checksum: %s", error->message);
 }
 
+static gboolean
+builder_source_git_extract_cacheable (BuilderSource  *source,
+                                      BuilderContext *context)
+{
+  BuilderSourceGit *self = BUILDER_SOURCE_GIT (source);
+  g_autoptr(GFile) mirror_dir = NULL;
+  g_autofree char *current_commit = NULL;
+
+  /* Without a commit the checksum is only url and branch, which
+     would match a cached checkout of an older commit */
+  mirror_dir = git_get_mirror_dir (self->url, context);
+  current_commit = git_get_current_commit (mirror_dir, get_branch (self), context, NULL);
+
+  return current_commit != NULL;
+}
+
 static void
 builder_source_git_class_init (BuilderSourceGitClass *klass)
 {
@@ -604,6 +620,8 @@ builder_source_git_class_init (BuilderSourceGitClass *klass)
   source_class->download = builder_source_git_download;
   source_class->extract = builder_source_git_extract;
   source_class->checksum = builder_source_git_checksum;
+  source_class->cache_extract = TRUE;
+  source_class->extract_cacheable = builder_source_git_extract_cacheable;
 
   g_object_class_install_property (object_class,
                                    PROP_URL,
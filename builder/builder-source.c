@@ -26,6 +26,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/statfs.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "libgsystem.h"
 
 #include "builder-utils.h"
 #include "builder-source.h"
@@ -189,6 +193,84 @@ builder_source_download (BuilderSource *self,
   return class->download (self, context, error);
 }
 
+static char *
+builder_source_get_extract_key (BuilderSource *self,
+                                BuilderContext *context)
+{
+  BuilderSourceClass *class = BUILDER_SOURCE_GET_CLASS (self);
+  g_autoptr(BuilderCache) cache = builder_cache_new (NULL, NULL, NULL);
+
+  /* This is not the same as builder_source_checksum(), as the
+     extracted tree doesn't depend on dest */
+  builder_cache_checksum_str (cache, BUILDER_SOURCE_EXTRACT_CACHE_VERSION);
+  builder_cache_checksum_str (cache, G_OBJECT_TYPE_NAME (self));
+  class->checksum (self, cache, context);
+
+  return g_strdup (g_checksum_get_string (builder_cache_get_checksum (cache)));
+}
+
+static gboolean
+builder_source_extract_cached (BuilderSource *self,
+                               GFile *dest,
+                               BuilderContext *context,
+                               GError **error)
+{
+  BuilderSourceClass *class = BUILDER_SOURCE_GET_CLASS (self);
+  GFile *extract_cache_dir = builder_context_get_extract_cache_dir (context);
+  g_autofree char *key = builder_source_get_extract_key (self, context);
+  g_autoptr(GFile) cached_dir = g_file_get_child (extract_cache_dir, key);
+
+  if (!g_file_query_exists (cached_dir, NULL))
+    {
+      g_autoptr(GFile) tmp_dir_template = g_file_get_child (extract_cache_dir, "tmp-XXXXXX");
+      g_autofree char *tmp_dir_path = g_file_get_path (tmp_dir_template);
+      g_autoptr(GFile) tmp_dir = NULL;
+
+      if (!gs_file_ensure_directory (extract_cache_dir, TRUE, NULL, error))
+        return FALSE;
+
+      if (g_mkdtemp (tmp_dir_path) == NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Can't create extract directory");
+          return FALSE;
+        }
+
+      tmp_dir = g_file_new_for_path (tmp_dir_path);
+
+      if (!class->extract (self, tmp_dir, context, error))
+        {
+          gs_shutil_rm_rf (tmp_dir, NULL, NULL);
+          return FALSE;
+        }
+
+      if (rename (tmp_dir_path, gs_file_get_path_cached (cached_dir)) != 0)
+        {
+          /* Someone else may have extracted the same source meanwhile */
+          if (errno != EEXIST && errno != ENOTEMPTY)
+            {
+              g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                           "Can't rename extracted source to %s: %s",
+                           gs_file_get_path_cached (cached_dir), g_strerror (errno));
+              gs_shutil_rm_rf (tmp_dir, NULL, NULL);
+              return FALSE;
+            }
+
+          if (!gs_shutil_rm_rf (tmp_dir, NULL, error))
+            return FALSE;
+        }
+    }
+  else
+    {
+      g_print ("Using cached extracted source %s\n", key);
+
+      /* The mtime of the cached tree is its last use, for builder_gc() */
+      if (utimensat (AT_FDCWD, gs_file_get_path_cached (cached_dir), NULL, 0) != 0)
+        g_debug ("Can't update mtime of %s: %s", gs_file_get_path_cached (cached_dir), g_strerror (errno));
+    }
+
+  return builder_copy_tree (cached_dir, dest, error);
+}
+
 gboolean
 builder_source_extract  (BuilderSource *self,
                          GFile *dest,
@@ -211,6 +293,9 @@ builder_source_extract  (BuilderSource *self,
   else
     real_dest = g_object_ref (dest);
 
+  if (class->cache_extract &&
+      (class->extract_cacheable == NULL || class->extract_cacheable (self, context)))
+    return builder_source_extract_cached (self, real_dest, context, error);
 
   return class->extract (self, real_dest, context, error);
 }
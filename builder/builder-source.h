@@ -30,6 +30,10 @@ G_BEGIN_DECLS
 
 typedef struct BuilderSource BuilderSource;
 
+/* Bump this if extraction changes in incompatible ways to invalidate
+   the extract cache */
+#define BUILDER_SOURCE_EXTRACT_CACHE_VERSION "1"
+
 #define BUILDER_TYPE_SOURCE             (builder_source_get_type())
 #define BUILDER_SOURCE(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj), BUILDER_TYPE_SOURCE, BuilderSource))
 #define BUILDER_SOURCE_CLASS(klass)	(G_TYPE_CHECK_CLASS_CAST ((klass), BUILDER_TYPE_SOURCE, BuilderSourceClass))
@@ -46,6 +50,10 @@ struct BuilderSource {
 typedef struct {
   GObjectClass parent_class;
 
+  /* If set, the result of extract only depends on the checksum, so it
+     can be kept in the extract cache and copied out from there */
+  gboolean cache_extract;
+
   gboolean (* download) (BuilderSource *self,
                          BuilderContext *context,
                          GError **error);
@@ -56,6 +64,10 @@ typedef struct {
   void     (* checksum) (BuilderSource *self,
                          BuilderCache   *cache,
                          BuilderContext *context);
+  /* Optional, returns FALSE if the checksum can't currently identify
+     the extracted tree, so the extract cache must not be used */
+  gboolean (* extract_cacheable) (BuilderSource *self,
+                                  BuilderContext *context);
 } BuilderSourceClass;
 
 GType builder_source_get_type (void);
@@ -22,9 +22,21 @@
 #include "config.h"
 
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "libglnx/libglnx.h"
+#include "libgsystem.h"
 
 #include "builder-utils.h"
 
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int) /* Same as BTRFS_IOC_CLONE */
+#endif
+
 char *
 builder_uri_to_filename (const char *uri)
 {
@@ -113,3 +125,201 @@ path_prefix_match (const char *pattern,
     }
   return NULL; /* Should not be reached */
 }
+
+static gboolean
+copy_regfile_bytes (int src_fd,
+                    int dest_fd,
+                    GError **error)
+{
+  char buf[64*1024];
+  ssize_t n_read;
+
+  while (TRUE)
+    {
+      char *p = buf;
+
+      do
+        n_read = read (src_fd, buf, sizeof (buf));
+      while (G_UNLIKELY (n_read == -1 && errno == EINTR));
+      if (n_read == -1)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      if (n_read == 0)
+        break;
+
+      while (n_read > 0)
+        {
+          ssize_t n_written;
+
+          do
+            n_written = write (dest_fd, p, n_read);
+          while (G_UNLIKELY (n_written == -1 && errno == EINTR));
+          if (n_written == -1)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+
+          p += n_written;
+          n_read -= n_written;
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+copy_regfile_at (int src_dfd,
+                 const char *name,
+                 struct stat *stbuf,
+                 int dest_dfd,
+                 GError **error)
+{
+  glnx_fd_close int src_fd = -1;
+  glnx_fd_close int dest_fd = -1;
+  struct timespec times[2] = { stbuf->st_atim, stbuf->st_mtim };
+
+  src_fd = openat (src_dfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (src_fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  if (unlinkat (dest_dfd, name, 0) != 0 && errno != ENOENT)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  dest_fd = openat (dest_dfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (dest_fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  /* Try to share the extents with the source first (btrfs, xfs), which
+   * is both instant and copy-on-write, and only copy the data if the
+   * filesystem can't do that. */
+  if (ioctl (dest_fd, FICLONE, src_fd) != 0 &&
+      !copy_regfile_bytes (src_fd, dest_fd, error))
+    return FALSE;
+
+  if (fchmod (dest_fd, stbuf->st_mode & 07777) != 0 ||
+      futimens (dest_fd, times) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+copy_tree_at (int src_parent_dfd,
+              const char *src_name,
+              int dest_parent_dfd,
+              const char *dest_name,
+              struct stat *dir_stbuf,
+              GError **error)
+{
+  g_auto(GLnxDirFdIterator) src_iter = {0};
+  glnx_fd_close int dest_dfd = -1;
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (src_parent_dfd, src_name, FALSE, &src_iter, error))
+    return FALSE;
+
+  if (mkdirat (dest_parent_dfd, dest_name, 0700) != 0 && errno != EEXIST)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  if (!gs_file_open_dir_fd_at (dest_parent_dfd, dest_name, &dest_dfd, NULL, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&src_iter, &dent, NULL, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (fstatat (src_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          if (!copy_tree_at (src_iter.fd, dent->d_name, dest_dfd, dent->d_name, &stbuf, error))
+            return FALSE;
+        }
+      else if (S_ISREG (stbuf.st_mode))
+        {
+          if (!copy_regfile_at (src_iter.fd, dent->d_name, &stbuf, dest_dfd, error))
+            return FALSE;
+        }
+      else if (S_ISLNK (stbuf.st_mode))
+        {
+          g_autofree char *target = g_malloc (stbuf.st_size + 1);
+          struct timespec link_times[2] = { stbuf.st_atim, stbuf.st_mtim };
+          ssize_t len;
+
+          len = readlinkat (src_iter.fd, dent->d_name, target, stbuf.st_size + 1);
+          if (len == -1)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+          target[MIN (len, stbuf.st_size)] = 0;
+
+          if ((unlinkat (dest_dfd, dent->d_name, 0) != 0 && errno != ENOENT) ||
+              symlinkat (target, dest_dfd, dent->d_name) != 0 ||
+              utimensat (dest_dfd, dent->d_name, link_times, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+        }
+      /* Sockets, fifos and devices don't come out of source extraction */
+    }
+
+  /* Do this last, as adding the children changed the mtime */
+  if (dir_stbuf != NULL)
+    {
+      struct timespec times[2] = { dir_stbuf->st_atim, dir_stbuf->st_mtim };
+
+      if (fchmod (dest_dfd, dir_stbuf->st_mode & 07777) != 0 ||
+          futimens (dest_dfd, times) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Copies the contents of @src into @dest (which may already contain
+ * files), preserving modes and timestamps of everything below it so that
+ * make doesn't see the result as out of date. File data is reflinked where the filesystem
+ * supports it. */
+gboolean
+builder_copy_tree (GFile *src,
+                   GFile *dest,
+                   GError **error)
+{
+  return copy_tree_at (AT_FDCWD, gs_file_get_path_cached (src),
+                       AT_FDCWD, gs_file_get_path_cached (dest),
+                       NULL, error);
+}
@@ -33,6 +33,10 @@ char *builder_uri_to_filename (const char *uri);
 const char *path_prefix_match (const char *pattern,
                                const char *string);
 
+gboolean builder_copy_tree (GFile   *src,
+                            GFile   *dest,
+                            GError **error);
+
 G_END_DECLS
 
 #endif /* __BUILDER_UTILS_H__ */
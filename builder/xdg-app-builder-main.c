@@ -38,6 +38,11 @@ static gboolean opt_download_only;
 static gboolean opt_build_only;
 static gboolean opt_disable_download;
 static gboolean opt_require_changes;
+static gboolean opt_ccache;
+static char *opt_profile;
+static char *opt_profile_trace;
+static char *opt_cache_max_size;
+static int opt_cache_max_age;
 
 static GOptionEntry entries[] = {
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print debug information during command processing", NULL },
@@ -47,6 +52,11 @@ static GOptionEntry entries[] = {
   { "download-only", 0, 0, G_OPTION_ARG_NONE, &opt_download_only, "Only download sources, don't build", NULL },
   { "build-only", 0, 0, G_OPTION_ARG_NONE, &opt_build_only, "Stop after build, don't run clean and finish phases", NULL },
   { "require-changes", 0, 0, G_OPTION_ARG_NONE, &opt_require_changes, "Don't create app dir if no changes", NULL },
+  { "ccache", 0, 0, G_OPTION_ARG_NONE, &opt_ccache, "Use ccache", NULL },
+  { "profile", 0, 0, G_OPTION_ARG_FILENAME, &opt_profile, "Write a json report of the time and resources used by each build phase to FILE", "FILE" },
+  { "profile-trace", 0, 0, G_OPTION_ARG_FILENAME, &opt_profile_trace, "Write the build phases as a chrome trace to FILE", "FILE" },
+  { "cache-max-size", 0, 0, G_OPTION_ARG_STRING, &opt_cache_max_size, "Remove least recently used builds from the cache when it is larger than SIZE", "SIZE" },
+  { "cache-max-age", 0, 0, G_OPTION_ARG_INT, &opt_cache_max_age, "Remove builds from the cache that were not used for DAYS days", "DAYS" },
   { NULL }
 };
 
@@ -63,6 +73,41 @@ message_handler (const gchar *log_domain,
     g_printerr ("%s: %s\n", g_get_prgname (), message);
 }
 
+static gboolean
+parse_size (const char *str,
+            guint64    *size)
+{
+  char *end;
+  guint64 multiplier = 1;
+
+  *size = g_ascii_strtoull (str, &end, 10);
+  if (end == str)
+    return FALSE;
+
+  switch (g_ascii_toupper (*end))
+    {
+    case 0:
+      break;
+    case 'K':
+      multiplier = 1024;
+      break;
+    case 'M':
+      multiplier = 1024 * 1024;
+      break;
+    case 'G':
+      multiplier = 1024 * 1024 * 1024;
+      break;
+    default:
+      return FALSE;
+    }
+
+  if (*end != 0 && end[1] != 0)
+    return FALSE;
+
+  *size *= multiplier;
+  return TRUE;
+}
+
 int
 usage (GOptionContext *context, const char *message)
 {
@@ -86,7 +131,10 @@ main (int    argc,
   g_autoptr(GFile) base_dir = NULL;
   g_autoptr(GFile) app_dir = NULL;
   g_autoptr(BuilderCache) cache = NULL;
+  g_autoptr(BuilderProfile) profile = NULL;
+  guint64 cache_max_size = 0;
   g_autofree char *cache_branch = NULL;
+  int ret = 1;
 
   setlocale (LC_ALL, "");
 
@@ -120,6 +168,12 @@ main (int    argc,
   if (opt_verbose)
     g_log_set_handler (NULL, G_LOG_LEVEL_DEBUG, message_handler, NULL);
 
+  if (opt_cache_max_size && !parse_size (opt_cache_max_size, &cache_max_size))
+    return usage (context, "Invalid cache size");
+
+  if (opt_cache_max_age < 0)
+    return usage (context, "Invalid cache age");
+
   if (argc == 1)
     return usage (context, "DIRECTORY must be specified");
 
@@ -155,17 +209,38 @@ main (int    argc,
 
   build_context = builder_context_new (base_dir, app_dir);
 
+  if (opt_profile || opt_profile_trace)
+    {
+      profile = builder_profile_new ();
+      builder_context_set_profile (build_context, profile);
+    }
+
+  if (opt_ccache)
+    {
+      g_autoptr(GFile) sdk_dir = builder_manifest_init_sdk_dir (manifest, build_context, &error);
+
+      if (sdk_dir == NULL ||
+          !builder_context_enable_ccache (build_context, sdk_dir, &error))
+        {
+          g_printerr ("Can't initialize ccache use: %s\n", error->message);
+          goto out;
+        }
+    }
+
   if (!opt_disable_download)
     {
       if (!builder_manifest_download (manifest, build_context, &error))
         {
           g_print ("error: %s\n", error->message);
-          return 1;
+          goto out;
         }
     }
 
   if (opt_download_only)
-    return 0;
+    {
+      ret = 0;
+      goto out;
+    }
 
   cache_branch = g_path_get_basename (manifest_path);
 
@@ -173,12 +248,14 @@ main (int    argc,
   if (!builder_cache_open (cache, &error))
     {
       g_print ("Error opening cache: %s\n", error->message);
-      return 1;
+      goto out;
     }
 
   if (opt_disable_cache) /* This disables *lookups*, but we still build the cache */
     builder_cache_disable_lookups (cache);
 
+  builder_cache_set_profile (cache, profile);
+
   builder_manifest_checksum (manifest, cache, build_context);
 
   if (!builder_cache_lookup (cache))
@@ -186,23 +263,25 @@ main (int    argc,
       g_autofree char *body =
         g_strdup_printf ("Initialized %s\n",
                          builder_manifest_get_app_id (manifest));
+      builder_profile_begin (profile, "init");
       if (!builder_manifest_init_app_dir (manifest, build_context, &error))
         {
           g_print ("error: %s\n", error->message);
-          return 1;
+          goto out;
         }
+      builder_profile_end (profile);
 
       if (!builder_cache_commit (cache, body, &error))
         {
           g_print ("error: %s\n", error->message);
-          return 1;
+          goto out;
         }
     }
 
   if (!builder_manifest_build (manifest, cache, build_context, &error))
     {
       g_print ("error: %s\n", error->message);
-      return 1;
+      goto out;
     }
 
   if (!opt_build_only)
@@ -210,24 +289,70 @@ main (int    argc,
       if (!builder_manifest_cleanup (manifest, cache, build_context, &error))
         {
           g_print ("error: %s\n", error->message);
-          return 1;
+          goto out;
         }
 
       if (!builder_manifest_finish (manifest, cache, build_context, &error))
         {
           g_print ("error: %s\n", error->message);
-          return 1;
+          goto out;
         }
     }
 
   if (!opt_require_changes)
     builder_cache_ensure_checkout (cache);
 
-  if (!builder_gc (cache, &error))
+  if (opt_ccache)
+    {
+      guint64 ccache_hits, ccache_misses;
+
+      if (builder_context_get_ccache_stats (build_context, &ccache_hits, &ccache_misses, &error))
+        g_print ("ccache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses\n",
+                 ccache_hits, ccache_misses);
+      else
+        {
+          g_warning ("Can't get ccache stats: %s\n", error->message);
+          g_clear_error (&error);
+        }
+    }
+
+  if (!builder_gc (cache, builder_context_get_extract_cache_dir (build_context),
+                   cache_max_size, (guint64)opt_cache_max_age * 24 * 60 * 60, &error))
     {
       g_warning ("Failed to GC build cache: %s\n", error->message);
       g_clear_error (&error);
     }
 
-  return 0;
+  ret = 0;
+
+ out:
+  g_clear_error (&error);
+
+  /* The profile is written for failed builds too, with the phases
+     that were in progress ending at the failure */
+  builder_profile_end_all (profile);
+
+  if (opt_profile)
+    {
+      g_autoptr(GFile) profile_file = g_file_new_for_path (opt_profile);
+
+      if (!builder_profile_write_report (profile, profile_file, &error))
+        {
+          g_print ("error: %s\n", error->message);
+          return 1;
+        }
+    }
+
+  if (opt_profile_trace)
+    {
+      g_autoptr(GFile) trace_file = g_file_new_for_path (opt_profile_trace);
+
+      if (!builder_profile_write_trace (profile, trace_file, &error))
+        {
+          g_print ("error: %s\n", error->message);
+          return 1;
+        }
+    }
+
+  return ret;
 }
@@ -0,0 +1,872 @@
+/*
+ * Copyright © 2015 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "libgsystem.h"
+#include "libglnx/libglnx.h"
+
+#include "xdg-app-bundle.h"
+#include "xdg-app-utils.h"
+
+/* An indexed bundle is a stream of independently compressed parts, each
+ * holding a set of ostree objects, so that parts can be built and
+ * applied in parallel, and applied while the file is still being read:
+ *
+ *   magic
+ *   u64 header size, header (XDG_APP_BUNDLE_HEADER_FORMAT)
+ *   for each part: u64 size, u64 uncompressed size, compressed data
+ *   u64 0
+ *   u64 index size, index (XDG_APP_BUNDLE_INDEX_FORMAT)
+ *   u64 offset of the index size, magic
+ *
+ * All integers are big endian. Uncompressed, a part is a sequence of
+ * objects, each a type byte, the binary checksum, the u64 size and the
+ * object in the form ostree_repo_write_content/metadata take it. */
+
+#define XDG_APP_BUNDLE_MAGIC "XABNDL01"
+#define XDG_APP_BUNDLE_MAGIC_LEN 8
+
+/* metadata, to commit, detached metadata, compression */
+#define XDG_APP_BUNDLE_HEADER_FORMAT "(a{sv}aya{sv}y)"
+/* offset and size of each part */
+#define XDG_APP_BUNDLE_INDEX_FORMAT "a(tt)"
+
+#define OBJECT_HEADER_SIZE (1 + 32 + 8)
+
+/* Uncompressed size to aim for per part */
+#define PART_TARGET_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+  OstreeRepo *repo;
+  XdgAppBundleCompression compression;
+  GCancellable *cancellable;
+  GMutex lock;
+  GCond cond;
+  guint in_flight;
+  GError *error;
+  GVariant *commit; /* Written only when all parts are applied */
+  char commit_checksum[65];
+} BundleData;
+
+typedef struct {
+  GPtrArray *objects;
+  GBytes *data;
+  guint64 uncompressed_size;
+  gboolean done;
+  GError *error;
+} BundlePart;
+
+static void
+bundle_part_free (BundlePart *part)
+{
+  if (part->objects)
+    g_ptr_array_unref (part->objects);
+  if (part->data)
+    g_bytes_unref (part->data);
+  g_clear_error (&part->error);
+  g_free (part);
+}
+
+static gboolean
+write_uint64 (GOutputStream *out,
+              guint64        value,
+              GCancellable  *cancellable,
+              GError       **error)
+{
+  guint64 be = GUINT64_TO_BE (value);
+
+  return g_output_stream_write_all (out, &be, sizeof (be), NULL, cancellable, error);
+}
+
+/* The sizes in a bundle are untrusted, so all reads are checked
+   against *remaining, the number of bytes that can still follow */
+static gboolean
+read_exact (GInputStream  *in,
+            void          *buf,
+            gsize          size,
+            guint64       *remaining,
+            GCancellable  *cancellable,
+            GError       **error)
+{
+  gsize n_read;
+
+  if (size > *remaining)
+    return xdg_app_fail (error, "Invalid bundle, size %" G_GSIZE_FORMAT " larger than the rest of the data", size);
+
+  if (!g_input_stream_read_all (in, buf, size, &n_read, cancellable, error))
+    return FALSE;
+
+  if (n_read != size)
+    return xdg_app_fail (error, "Truncated bundle");
+
+  *remaining -= size;
+  return TRUE;
+}
+
+static gboolean
+read_uint64 (GInputStream  *in,
+             guint64       *out_value,
+             guint64       *remaining,
+             GCancellable  *cancellable,
+             GError       **error)
+{
+  guint64 be;
+
+  if (!read_exact (in, &be, sizeof (be), remaining, cancellable, error))
+    return FALSE;
+
+  *out_value = GUINT64_FROM_BE (be);
+  return TRUE;
+}
+
+static GBytes *
+read_bytes (GInputStream  *in,
+            guint64        size,
+            guint64       *remaining,
+            GCancellable  *cancellable,
+            GError       **error)
+{
+  g_autofree guchar *buf = NULL;
+
+  if (size > *remaining || size > G_MAXSSIZE)
+    {
+      xdg_app_fail (error, "Invalid bundle, size %" G_GUINT64_FORMAT " larger than the rest of the data", size);
+      return NULL;
+    }
+
+  if (size == 0)
+    return g_bytes_new (NULL, 0);
+
+  buf = g_try_malloc (size);
+  if (buf == NULL)
+    {
+      xdg_app_fail (error, "Can't allocate %" G_GUINT64_FORMAT " bytes for bundle data", size);
+      return NULL;
+    }
+
+  if (!read_exact (in, buf, size, remaining, cancellable, error))
+    return NULL;
+
+  return g_bytes_new_take (g_steal_pointer (&buf), size);
+}
+
+static gboolean
+write_object_header (GOutputStream    *out,
+                     OstreeObjectType  objtype,
+                     const char       *checksum,
+                     guint64           size,
+                     GCancellable     *cancellable,
+                     GError          **error)
+{
+  guint8 header[OBJECT_HEADER_SIZE];
+  guint64 size_be = GUINT64_TO_BE (size);
+
+  header[0] = objtype;
+  ostree_checksum_inplace_to_bytes (checksum, header + 1);
+  memcpy (header + 1 + 32, &size_be, sizeof (size_be));
+
+  return g_output_stream_write_all (out, header, sizeof (header), NULL, cancellable, error);
+}
+
+static gboolean
+write_object (OstreeRepo    *repo,
+              GOutputStream *out,
+              GVariant      *objname,
+              guint64       *out_size,
+              GCancellable  *cancellable,
+              GError       **error)
+{
+  const char *checksum;
+  OstreeObjectType objtype;
+
+  ostree_object_name_deserialize (objname, &checksum, &objtype);
+
+  if (objtype == OSTREE_OBJECT_TYPE_FILE)
+    {
+      g_autoptr(GInputStream) input = NULL;
+      g_autoptr(GFileInfo) file_info = NULL;
+      g_autoptr(GVariant) xattrs = NULL;
+      g_autoptr(GInputStream) content = NULL;
+      guint64 content_size;
+      gssize n_written;
+
+      if (!ostree_repo_load_file (repo, checksum, &input, &file_info, &xattrs,
+                                  cancellable, error))
+        return FALSE;
+
+      if (!ostree_raw_file_to_content_stream (input, file_info, xattrs,
+                                              &content, &content_size,
+                                              cancellable, error))
+        return FALSE;
+
+      if (!write_object_header (out, objtype, checksum, content_size, cancellable, error))
+        return FALSE;
+
+      n_written = g_output_stream_splice (out, content, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                                          cancellable, error);
+      if (n_written < 0)
+        return FALSE;
+
+      if (n_written != content_size)
+        return xdg_app_fail (error, "Short read of object %s", checksum);
+
+      *out_size += OBJECT_HEADER_SIZE + content_size;
+    }
+  else
+    {
+      g_autoptr(GVariant) variant = NULL;
+
+      if (!ostree_repo_load_variant (repo, objtype, checksum, &variant, error))
+        return FALSE;
+
+      if (!write_object_header (out, objtype, checksum, g_variant_get_size (variant),
+                                cancellable, error))
+        return FALSE;
+
+      if (!g_output_stream_write_all (out, g_variant_get_data (variant), g_variant_get_size (variant),
+                                      NULL, cancellable, error))
+        return FALSE;
+
+      *out_size += OBJECT_HEADER_SIZE + g_variant_get_size (variant);
+    }
+
+  return TRUE;
+}
+
+static void
+build_part_thread (gpointer data,
+                   gpointer user_data)
+{
+  BundlePart *part = data;
+  BundleData *bundle = user_data;
+  g_autoptr(GOutputStream) mem = NULL;
+  g_autoptr(GOutputStream) out = NULL;
+  GError *error = NULL;
+  int i;
+
+  mem = g_memory_output_stream_new_resizable ();
+  if (bundle->compression == XDG_APP_BUNDLE_COMPRESSION_ZLIB)
+    {
+      g_autoptr(GConverter) compressor = NULL;
+
+      compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, -1));
+      out = g_converter_output_stream_new (mem, compressor);
+    }
+  else
+    out = g_object_ref (mem);
+
+  for (i = 0; i < part->objects->len; i++)
+    {
+      if (!write_object (bundle->repo, out, g_ptr_array_index (part->objects, i),
+                         &part->uncompressed_size, bundle->cancellable, &error))
+        goto out;
+    }
+
+  /* Also closes mem */
+  if (!g_output_stream_close (out, bundle->cancellable, &error))
+    goto out;
+
+  part->data = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (mem));
+
+ out:
+  g_mutex_lock (&bundle->lock);
+  part->error = error;
+  part->done = TRUE;
+  g_cond_broadcast (&bundle->cond);
+  g_mutex_unlock (&bundle->lock);
+}
+
+static int
+compare_object_names (gconstpointer a,
+                      gconstpointer b)
+{
+  GVariant *name_a = *(GVariant **)a;
+  GVariant *name_b = *(GVariant **)b;
+  const char *checksum_a, *checksum_b;
+  OstreeObjectType objtype_a, objtype_b;
+
+  ostree_object_name_deserialize (name_a, &checksum_a, &objtype_a);
+  ostree_object_name_deserialize (name_b, &checksum_b, &objtype_b);
+
+  if (objtype_a != objtype_b)
+    return objtype_a - objtype_b;
+
+  return strcmp (checksum_a, checksum_b);
+}
+
+gboolean
+xdg_app_bundle_is_indexed (GFile        *file,
+                           GCancellable *cancellable)
+{
+  g_autoptr(GFileInputStream) in = NULL;
+  char magic[XDG_APP_BUNDLE_MAGIC_LEN];
+  gsize n_read;
+
+  in = g_file_read (file, cancellable, NULL);
+  if (in == NULL)
+    return FALSE;
+
+  if (!g_input_stream_read_all (G_INPUT_STREAM (in), magic, sizeof (magic), &n_read,
+                                cancellable, NULL))
+    return FALSE;
+
+  return n_read == sizeof (magic) &&
+    memcmp (magic, XDG_APP_BUNDLE_MAGIC, XDG_APP_BUNDLE_MAGIC_LEN) == 0;
+}
+
+/* Writes the objects of @commit to @file as an indexed bundle, with
+ * @metadata (consumed if floating) in its header. If @from is given,
+ * objects that are also in that commit are left out. The parts are
+ * compressed on all cores, but written in order, with only a few of
+ * them kept in memory at a time. */
+gboolean
+xdg_app_bundle_write (OstreeRepo              *repo,
+                      const char              *from,
+                      const char              *commit,
+                      GVariant                *metadata,
+                      XdgAppBundleCompression  compression,
+                      GFile                   *file,
+                      GCancellable            *cancellable,
+                      GError                 **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GHashTable) reachable = NULL;
+  g_autoptr(GPtrArray) objects = NULL;
+  g_autoptr(GPtrArray) parts = NULL;
+  g_autoptr(GVariant) detached = NULL;
+  g_autoptr(GVariant) header = NULL;
+  g_autoptr(GVariant) index = NULL;
+  g_autoptr(GFileOutputStream) file_out = NULL;
+  GOutputStream *out;
+  GVariantBuilder index_builder;
+  GHashTableIter iter;
+  gpointer key;
+  BundleData bundle = { repo, compression, cancellable };
+  BundlePart *part = NULL;
+  guint64 part_size = 0;
+  GThreadPool *pool = NULL;
+  guint n_threads, pushed;
+  guint64 offset, index_offset;
+  int i;
+
+  g_mutex_init (&bundle.lock);
+  g_cond_init (&bundle.cond);
+  g_variant_builder_init (&index_builder, G_VARIANT_TYPE (XDG_APP_BUNDLE_INDEX_FORMAT));
+
+  if (!ostree_repo_traverse_commit (repo, commit, 0, &reachable, cancellable, error))
+    goto out;
+
+  if (from != NULL)
+    {
+      g_autoptr(GHashTable) from_reachable = NULL;
+
+      if (!ostree_repo_traverse_commit (repo, from, 0, &from_reachable, cancellable, error))
+        goto out;
+
+      g_hash_table_iter_init (&iter, from_reachable);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        g_hash_table_remove (reachable, key);
+    }
+
+  if (!ostree_repo_read_commit_detached_metadata (repo, commit, &detached, cancellable, error))
+    goto out;
+
+  objects = g_ptr_array_new ();
+  g_hash_table_iter_init (&iter, reachable);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_ptr_array_add (objects, key);
+  g_ptr_array_sort (objects, compare_object_names);
+
+  parts = g_ptr_array_new_with_free_func ((GDestroyNotify)bundle_part_free);
+  for (i = 0; i < objects->len; i++)
+    {
+      GVariant *objname = g_ptr_array_index (objects, i);
+      const char *checksum;
+      OstreeObjectType objtype;
+      guint64 size;
+
+      ostree_object_name_deserialize (objname, &checksum, &objtype);
+      if (!ostree_repo_query_object_storage_size (repo, objtype, checksum, &size,
+                                                  cancellable, error))
+        goto out;
+
+      if (part == NULL || (part_size > 0 && part_size + size > PART_TARGET_SIZE))
+        {
+          part = g_new0 (BundlePart, 1);
+          part->objects = g_ptr_array_new ();
+          g_ptr_array_add (parts, part);
+          part_size = 0;
+        }
+
+      g_ptr_array_add (part->objects, objname);
+      part_size += size;
+    }
+
+  file_out = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                             cancellable, error);
+  if (file_out == NULL)
+    goto out;
+  out = G_OUTPUT_STREAM (file_out);
+
+  header = g_variant_ref_sink (g_variant_new ("(@a{sv}@ay@a{sv}y)",
+                                              metadata,
+                                              ostree_checksum_to_bytes_v (commit),
+                                              detached ? detached : g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0),
+                                              (guchar)compression));
+
+  if (!g_output_stream_write_all (out, XDG_APP_BUNDLE_MAGIC, XDG_APP_BUNDLE_MAGIC_LEN,
+                                  NULL, cancellable, error) ||
+      !write_uint64 (out, g_variant_get_size (header), cancellable, error) ||
+      !g_output_stream_write_all (out, g_variant_get_data (header), g_variant_get_size (header),
+                                  NULL, cancellable, error))
+    goto out;
+  offset = XDG_APP_BUNDLE_MAGIC_LEN + 8 + g_variant_get_size (header);
+
+  n_threads = g_get_num_processors ();
+  pool = g_thread_pool_new (build_part_thread, &bundle, n_threads, FALSE, error);
+  if (pool == NULL)
+    goto out;
+
+  pushed = 0;
+  for (i = 0; i < parts->len; i++)
+    {
+      gsize size;
+
+      while (pushed < parts->len && pushed < i + 2 * n_threads)
+        g_thread_pool_push (pool, g_ptr_array_index (parts, pushed++), NULL);
+
+      part = g_ptr_array_index (parts, i);
+
+      g_mutex_lock (&bundle.lock);
+      while (!part->done)
+        g_cond_wait (&bundle.cond, &bundle.lock);
+      g_mutex_unlock (&bundle.lock);
+
+      if (part->error)
+        {
+          g_propagate_error (error, g_steal_pointer (&part->error));
+          goto out;
+        }
+
+      size = g_bytes_get_size (part->data);
+      g_variant_builder_add (&index_builder, "(tt)", offset, (guint64)size);
+
+      if (!write_uint64 (out, size, cancellable, error) ||
+          !write_uint64 (out, part->uncompressed_size, cancellable, error) ||
+          !g_output_stream_write_all (out, g_bytes_get_data (part->data, NULL), size,
+                                      NULL, cancellable, error))
+        goto out;
+      offset += 8 + 8 + size;
+
+      g_clear_pointer (&part->data, g_bytes_unref);
+    }
+
+  if (!write_uint64 (out, 0, cancellable, error))
+    goto out;
+  offset += 8;
+
+  index = g_variant_ref_sink (g_variant_builder_end (&index_builder));
+  index_offset = offset;
+
+  if (!write_uint64 (out, g_variant_get_size (index), cancellable, error) ||
+      !g_output_stream_write_all (out, g_variant_get_data (index), g_variant_get_size (index),
+                                  NULL, cancellable, error) ||
+      !write_uint64 (out, index_offset, cancellable, error) ||
+      !g_output_stream_write_all (out, XDG_APP_BUNDLE_MAGIC, XDG_APP_BUNDLE_MAGIC_LEN,
+                                  NULL, cancellable, error))
+    goto out;
+
+  if (!g_output_stream_close (out, cancellable, error))
+    goto out;
+
+  g_debug ("Wrote %u objects in %u parts", objects->len, parts->len);
+
+  ret = TRUE;
+
+ out:
+  if (pool)
+    g_thread_pool_free (pool, TRUE, TRUE);
+
+  g_variant_builder_clear (&index_builder);
+  g_mutex_clear (&bundle.lock);
+  g_cond_clear (&bundle.cond);
+
+  if (!ret && file_out)
+    {
+      g_clear_object (&file_out);
+      g_file_delete (file, NULL, NULL);
+    }
+
+  return ret;
+}
+
+/* Opens an indexed bundle, reading its header. The returned stream is
+ * positioned at the first part, ready for xdg_app_bundle_apply(), and
+ * @out_remaining is set to the number of bytes left in the file. */
+GInputStream *
+xdg_app_bundle_open (GFile                    *file,
+                     GVariant                **out_metadata,
+                     char                    **out_commit,
+                     GVariant                **out_detached_metadata,
+                     XdgAppBundleCompression  *out_compression,
+                     guint64                  *out_remaining,
+                     GCancellable             *cancellable,
+                     GError                  **error)
+{
+  g_autoptr(GFileInputStream) file_in = NULL;
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GInputStream) in = NULL;
+  g_autoptr(GBytes) magic = NULL;
+  g_autoptr(GBytes) header_bytes = NULL;
+  g_autoptr(GVariant) header = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(GVariant) csum_v = NULL;
+  g_autoptr(GVariant) detached = NULL;
+  guint64 header_size;
+  guint64 remaining;
+  guchar compression;
+
+  file_in = g_file_read (file, cancellable, error);
+  if (file_in == NULL)
+    return NULL;
+
+  info = g_file_input_stream_query_info (file_in, G_FILE_ATTRIBUTE_STANDARD_SIZE, cancellable, error);
+  if (info == NULL)
+    return NULL;
+
+  remaining = g_file_info_get_size (info);
+
+  /* The part headers are small reads, the parts themselves are read
+     directly */
+  in = g_buffered_input_stream_new_sized (G_INPUT_STREAM (file_in), 64 * 1024);
+
+  magic = read_bytes (in, XDG_APP_BUNDLE_MAGIC_LEN, &remaining, cancellable, error);
+  if (magic == NULL)
+    return NULL;
+
+  if (memcmp (g_bytes_get_data (magic, NULL), XDG_APP_BUNDLE_MAGIC, XDG_APP_BUNDLE_MAGIC_LEN) != 0)
+    {
+      xdg_app_fail (error, "Not an indexed bundle");
+      return NULL;
+    }
+
+  if (!read_uint64 (in, &header_size, &remaining, cancellable, error))
+    return NULL;
+
+  header_bytes = read_bytes (in, header_size, &remaining, cancellable, error);
+  if (header_bytes == NULL)
+    return NULL;
+
+  header = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (XDG_APP_BUNDLE_HEADER_FORMAT),
+                                                         header_bytes, FALSE));
+  g_variant_get (header, "(@a{sv}@ay@a{sv}y)", &metadata, &csum_v, &detached, &compression);
+
+  if (!ostree_validate_structureof_csum_v (csum_v, error))
+    return NULL;
+
+  if (compression != XDG_APP_BUNDLE_COMPRESSION_NONE &&
+      compression != XDG_APP_BUNDLE_COMPRESSION_ZLIB)
+    {
+      xdg_app_fail (error, "Unsupported bundle compression '%c'", compression);
+      return NULL;
+    }
+
+  *out_metadata = g_steal_pointer (&metadata);
+  *out_commit = ostree_checksum_from_bytes_v (csum_v);
+  *out_detached_metadata = g_variant_n_children (detached) > 0 ? g_steal_pointer (&detached) : NULL;
+  *out_compression = compression;
+  *out_remaining = remaining;
+
+  return g_steal_pointer (&in);
+}
+
+static gboolean
+apply_part (BundleData    *bundle,
+            BundlePart    *part,
+            GCancellable  *cancellable,
+            GError       **error)
+{
+  g_autoptr(GInputStream) mem = NULL;
+  g_autoptr(GInputStream) in = NULL;
+  guint64 remaining = part->uncompressed_size;
+
+  mem = g_memory_input_stream_new_from_bytes (part->data);
+  if (bundle->compression == XDG_APP_BUNDLE_COMPRESSION_ZLIB)
+    {
+      g_autoptr(GConverter) decompressor = NULL;
+
+      decompressor = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW));
+      in = g_converter_input_stream_new (mem, decompressor);
+    }
+  else
+    in = g_object_ref (mem);
+
+  /* The objects are bounded by the uncompressed size of the part */
+  while (remaining > 0)
+    {
+      guint8 header[OBJECT_HEADER_SIZE];
+      char checksum[65];
+      OstreeObjectType objtype;
+      guint64 size_be;
+      g_autoptr(GBytes) object = NULL;
+      gboolean have_object;
+
+      if (!read_exact (in, header, sizeof (header), &remaining, cancellable, error))
+        return FALSE;
+
+      objtype = header[0];
+      if (objtype < OSTREE_OBJECT_TYPE_FILE || objtype > OSTREE_OBJECT_TYPE_COMMIT)
+        return xdg_app_fail (error, "Invalid object type %d in bundle", objtype);
+
+      ostree_checksum_inplace_from_bytes (header + 1, checksum);
+      memcpy (&size_be, header + 1 + 32, sizeof (size_be));
+
+      object = read_bytes (in, GUINT64_FROM_BE (size_be), &remaining, cancellable, error);
+      if (object == NULL)
+        return FALSE;
+
+      if (!ostree_repo_has_object (bundle->repo, objtype, checksum, &have_object,
+                                   cancellable, error))
+        return FALSE;
+
+      if (have_object)
+        continue;
+
+      /* Both verify the checksum */
+      if (objtype == OSTREE_OBJECT_TYPE_FILE)
+        {
+          g_autoptr(GInputStream) content = g_memory_input_stream_new_from_bytes (object);
+
+          if (!ostree_repo_write_content (bundle->repo, checksum, content,
+                                          g_bytes_get_size (object), NULL,
+                                          cancellable, error))
+            return FALSE;
+        }
+      else
+        {
+          g_autoptr(GVariant) variant = NULL;
+
+          variant = g_variant_ref_sink (g_variant_new_from_bytes (ostree_metadata_variant_type (objtype),
+                                                                  object, FALSE));
+
+          /* With the commit in the repo the ref looks complete, so it
+             waits until every other object is there */
+          if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+            {
+              gboolean duplicate;
+
+              g_mutex_lock (&bundle->lock);
+              duplicate = bundle->commit != NULL;
+              if (!duplicate)
+                {
+                  bundle->commit = g_steal_pointer (&variant);
+                  strcpy (bundle->commit_checksum, checksum);
+                }
+              g_mutex_unlock (&bundle->lock);
+
+              if (duplicate)
+                return xdg_app_fail (error, "Invalid bundle, more than one commit");
+
+              continue;
+            }
+
+          if (!ostree_repo_write_metadata (bundle->repo, objtype, checksum, variant, NULL,
+                                           cancellable, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+apply_part_thread (gpointer data,
+                   gpointer user_data)
+{
+  BundlePart *part = data;
+  BundleData *bundle = user_data;
+  GError *error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&bundle->lock);
+  failed = bundle->error != NULL;
+  g_mutex_unlock (&bundle->lock);
+
+  if (!failed)
+    apply_part (bundle, part, bundle->cancellable, &error);
+
+  bundle_part_free (part);
+
+  g_mutex_lock (&bundle->lock);
+  if (error != NULL && bundle->error == NULL)
+    bundle->error = error;
+  else
+    g_clear_error (&error);
+  bundle->in_flight--;
+  g_cond_signal (&bundle->cond);
+  g_mutex_unlock (&bundle->lock);
+}
+
+/* Writes the objects in the parts of an opened bundle to @repo, which
+ * must be in a transaction. Parts are handed to worker threads as soon
+ * as they are read, the commit object is written last, once all of them
+ * succeeded. If this fails the caller must abort the transaction.
+ * @remaining is the size of the rest of the bundle, as returned by
+ * xdg_app_bundle_open(). */
+gboolean
+xdg_app_bundle_apply (OstreeRepo               *repo,
+                      GInputStream             *stream,
+                      XdgAppBundleCompression   compression,
+                      guint64                   remaining,
+                      GCancellable             *cancellable,
+                      GError                  **error)
+{
+  gboolean ret = FALSE;
+  BundleData bundle = { repo, compression, cancellable };
+  g_autoptr(GArray) sizes = NULL;
+  g_autoptr(GBytes) index_bytes = NULL;
+  g_autoptr(GVariant) index = NULL;
+  g_autoptr(GBytes) magic = NULL;
+  GThreadPool *pool = NULL;
+  guint n_threads;
+  guint64 index_size, index_offset;
+  int i;
+
+  g_mutex_init (&bundle.lock);
+  g_cond_init (&bundle.cond);
+
+  n_threads = g_get_num_processors ();
+  pool = g_thread_pool_new (apply_part_thread, &bundle, n_threads, FALSE, error);
+  if (pool == NULL)
+    goto out;
+
+  sizes = g_array_new (FALSE, FALSE, sizeof (guint64));
+  while (TRUE)
+    {
+      guint64 size;
+      BundlePart *part;
+      gboolean failed;
+
+      if (!read_uint64 (stream, &size, &remaining, cancellable, error))
+        goto out;
+
+      if (size == 0)
+        break;
+
+      part = g_new0 (BundlePart, 1);
+      if (!read_uint64 (stream, &part->uncompressed_size, &remaining, cancellable, error) ||
+          (part->data = read_bytes (stream, size, &remaining, cancellable, error)) == NULL)
+        {
+          bundle_part_free (part);
+          goto out;
+        }
+
+      /* Don't read ahead more than the workers can keep up with */
+      g_mutex_lock (&bundle.lock);
+      while (bundle.in_flight >= 2 * n_threads)
+        g_cond_wait (&bundle.cond, &bundle.lock);
+      failed = bundle.error != NULL;
+      if (!failed)
+        bundle.in_flight++;
+      g_mutex_unlock (&bundle.lock);
+
+      if (failed)
+        {
+          bundle_part_free (part);
+          break;
+        }
+
+      g_thread_pool_push (pool, part, NULL);
+      g_array_append_val (sizes, size);
+    }
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+  pool = NULL;
+
+  if (bundle.error)
+    {
+      g_propagate_error (error, g_steal_pointer (&bundle.error));
+      goto out;
+    }
+
+  /* Everything has been applied, now just make sure it was all of it */
+  if (!read_uint64 (stream, &index_size, &remaining, cancellable, error))
+    goto out;
+
+  index_bytes = read_bytes (stream, index_size, &remaining, cancellable, error);
+  if (index_bytes == NULL)
+    goto out;
+
+  index = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (XDG_APP_BUNDLE_INDEX_FORMAT),
+                                                        index_bytes, FALSE));
+  if (g_variant_n_children (index) != sizes->len)
+    {
+      xdg_app_fail (error, "Invalid bundle, index doesn't match parts");
+      goto out;
+    }
+
+  for (i = 0; i < sizes->len; i++)
+    {
+      guint64 size;
+
+      g_variant_get_child (index, i, "(tt)", NULL, &size);
+      if (size != g_array_index (sizes, guint64, i))
+        {
+          xdg_app_fail (error, "Invalid bundle, index doesn't match parts");
+          goto out;
+        }
+    }
+
+  if (!read_uint64 (stream, &index_offset, &remaining, cancellable, error))
+    goto out;
+
+  magic = read_bytes (stream, XDG_APP_BUNDLE_MAGIC_LEN, &remaining, cancellable, error);
+  if (magic == NULL)
+    goto out;
+
+  if (memcmp (g_bytes_get_data (magic, NULL), XDG_APP_BUNDLE_MAGIC, XDG_APP_BUNDLE_MAGIC_LEN) != 0)
+    {
+      xdg_app_fail (error, "Invalid bundle, bad trailer");
+      goto out;
+    }
+
+  if (bundle.commit != NULL &&
+      !ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_COMMIT, bundle.commit_checksum,
+                                   bundle.commit, NULL, cancellable, error))
+    goto out;
+
+  g_debug ("Applied %u parts, index at %" G_GUINT64_FORMAT, sizes->len, index_offset);
+
+  ret = TRUE;
+
+ out:
+  if (pool)
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+  g_clear_pointer (&bundle.commit, g_variant_unref);
+  g_clear_error (&bundle.error);
+  g_mutex_clear (&bundle.lock);
+  g_cond_clear (&bundle.cond);
+
+  return ret;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright © 2015 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#ifndef __XDG_APP_BUNDLE_H__
+#define __XDG_APP_BUNDLE_H__
+
+#include <gio/gio.h>
+#include <ostree.h>
+
+typedef enum {
+  XDG_APP_BUNDLE_COMPRESSION_NONE = 0,
+  XDG_APP_BUNDLE_COMPRESSION_ZLIB = 'z',
+} XdgAppBundleCompression;
+
+gboolean      xdg_app_bundle_is_indexed (GFile                    *file,
+                                         GCancellable             *cancellable);
+gboolean      xdg_app_bundle_write      (OstreeRepo               *repo,
+                                         const char               *from,
+                                         const char               *commit,
+                                         GVariant                 *metadata,
+                                         XdgAppBundleCompression   compression,
+                                         GFile                    *file,
+                                         GCancellable             *cancellable,
+                                         GError                  **error);
+GInputStream *xdg_app_bundle_open       (GFile                    *file,
+                                         GVariant                **out_metadata,
+                                         char                    **out_commit,
+                                         GVariant                **out_detached_metadata,
+                                         XdgAppBundleCompression  *out_compression,
+                                         guint64                  *out_remaining,
+                                         GCancellable             *cancellable,
+                                         GError                  **error);
+gboolean      xdg_app_bundle_apply      (OstreeRepo               *repo,
+                                         GInputStream             *stream,
+                                         XdgAppBundleCompression   compression,
+                                         guint64                   remaining,
+                                         GCancellable             *cancellable,
+                                         GError                  **error);
+
+#endif /* __XDG_APP_BUNDLE_H__ */
@@ -23,6 +23,9 @@
 #include <string.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include <gio/gio.h>
 #include "libgsystem.h"
@@ -33,6 +36,10 @@
 
 #include "errno.h"
 
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
 struct XdgAppDir {
   GObject parent;
 
@@ -438,6 +445,32 @@ xdg_app_dir_get_origin (XdgAppDir      *self,
   return repository;
 }
 
+/* The last summary fetched from each remote is cached in
+ * summaries/REMOTE, so that unchanged summaries are not downloaded
+ * again. */
+gboolean
+xdg_app_dir_load_remote_summary (XdgAppDir      *self,
+                                 const char     *remote,
+                                 GVariant      **out_summary,
+                                 GCancellable   *cancellable,
+                                 GError        **error)
+{
+  g_autofree char *url = NULL;
+  g_autoptr(GFile) cache_dir = NULL;
+  g_autoptr(GFile) cache_file = NULL;
+
+  if (!xdg_app_dir_ensure_repo (self, cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_remote_get_url (self->repo, remote, &url, error))
+    return FALSE;
+
+  cache_dir = g_file_get_child (self->basedir, "summaries");
+  cache_file = g_file_get_child (cache_dir, remote);
+
+  return xdg_app_load_summary (url, cache_file, out_summary, cancellable, error);
+}
+
 gboolean
 xdg_app_dir_ensure_path (XdgAppDir     *self,
                          GCancellable  *cancellable,
@@ -499,11 +532,34 @@ xdg_app_dir_pull (XdgAppDir *self,
                   const char *ref,
                   GCancellable *cancellable,
                   GError **error)
+{
+  const char *refs[2];
+
+  refs[0] = ref;
+  refs[1] = NULL;
+
+  if (!xdg_app_dir_pull_refs (self, repository, refs, NULL, cancellable, error))
+    {
+      g_prefix_error (error, "While pulling %s from remote %s: ", ref, repository);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Pulls all of REFS from REPOSITORY in a single operation, so objects
+   shared between them are only fetched once */
+gboolean
+xdg_app_dir_pull_refs (XdgAppDir *self,
+                       const char *repository,
+                       const char **refs,
+                       XdgAppPullStats *out_stats,
+                       GCancellable *cancellable,
+                       GError **error)
 {
   gboolean ret = FALSE;
   GSConsole *console = NULL;
   g_autoptr(OstreeAsyncProgress) progress = NULL;
-  const char *refs[2];
 
   if (!xdg_app_dir_ensure_repo (self, cancellable, error))
     goto out;
@@ -514,21 +570,28 @@ xdg_app_dir_pull (XdgAppDir *self,
       gs_console_begin_status_line (console, "", NULL, NULL);
       progress = ostree_async_progress_new_and_connect (ostree_repo_pull_default_console_progress_changed, console);
     }
+  else if (out_stats)
+    progress = ostree_async_progress_new ();
 
-  refs[0] = ref;
-  refs[1] = NULL;
   if (!ostree_repo_pull (self->repo, repository,
                          (char **)refs, OSTREE_REPO_PULL_FLAGS_NONE,
                          progress,
                          cancellable, error))
-    {
-      g_prefix_error (error, "While pulling %s from remote %s: ", ref, repository);
-      goto out;
-    }
+    goto out;
 
   if (console)
     gs_console_end_status_line (console, NULL, NULL);
 
+  /* ostree uses static deltas where the remote has them, these tell
+     how much came from deltas and how much as loose objects */
+  if (out_stats)
+    {
+      out_stats->fetched_objects = ostree_async_progress_get_uint (progress, "fetched");
+      out_stats->fetched_delta_parts = ostree_async_progress_get_uint (progress, "fetched-delta-parts");
+      out_stats->total_delta_parts = ostree_async_progress_get_uint (progress, "total-delta-parts");
+      out_stats->bytes_transferred = ostree_async_progress_get_uint64 (progress, "bytes-transferred");
+    }
+
   ret = TRUE;
  out:
   return ret;
@@ -620,13 +683,13 @@ strvcmp(char **a, char **b)
   return strcmp (*a, *b);
 }
 
-gboolean
-xdg_app_dir_list_refs_for_name (XdgAppDir      *self,
-                                const char     *kind,
-                                const char     *name,
-                                char         ***refs_out,
-                                GCancellable   *cancellable,
-                                GError        **error)
+static gboolean
+scan_refs_for_name (XdgAppDir      *self,
+                    const char     *kind,
+                    const char     *name,
+                    char         ***refs_out,
+                    GCancellable   *cancellable,
+                    GError        **error)
 {
   gboolean ret = FALSE;
   g_autoptr(GFile) base = NULL;
@@ -683,9 +746,18 @@ xdg_app_dir_list_refs_for_name (XdgAppDir      *self,
 
           if (g_file_info_get_file_type (child_info2) == G_FILE_TYPE_DIRECTORY)
             {
+              g_autoptr(GFile) branch_dir = NULL;
+              g_autoptr(GFile) active = NULL;
+
               branch = g_file_info_get_name (child_info2);
-              g_ptr_array_add (refs,
-                               g_strdup_printf ("%s/%s/%s/%s", kind, name, arch, branch));
+
+              /* Uninstalling drops the active deployment before removing
+                 the ref, so only list what is still installed */
+              branch_dir = g_file_get_child (child, branch);
+              active = g_file_get_child (branch_dir, "active");
+              if (g_file_query_exists (active, cancellable))
+                g_ptr_array_add (refs,
+                                 g_strdup_printf ("%s/%s/%s/%s", kind, name, arch, branch));
             }
 
           g_clear_object (&child_info2);
@@ -719,12 +791,12 @@ out:
   return ret;
 }
 
-gboolean
-xdg_app_dir_list_refs (XdgAppDir      *self,
-                       const char     *kind,
-                       char         ***refs_out,
-                       GCancellable   *cancellable,
-                       GError        **error)
+static gboolean
+scan_refs (XdgAppDir      *self,
+           const char     *kind,
+           char         ***refs_out,
+           GCancellable   *cancellable,
+           GError        **error)
 {
   gboolean ret = FALSE;
   g_autoptr(GFile) base;
@@ -763,7 +835,7 @@ xdg_app_dir_list_refs (XdgAppDir      *self,
 
       name = g_file_info_get_name (child_info);
 
-      if (!xdg_app_dir_list_refs_for_name (self, kind, name, &sub_refs, cancellable, error))
+      if (!scan_refs_for_name (self, kind, name, &sub_refs, cancellable, error))
         goto out;
 
       for (i = 0; sub_refs[i] != NULL; i++)
@@ -794,330 +866,1433 @@ out:
   return ret;
 }
 
-char *
-xdg_app_dir_read_active (XdgAppDir *self,
-                         const char *ref,
-                         GCancellable *cancellable)
+/* The deployed index is a GVariant file listing all deployed refs in
+   the installation, sorted, with the active commit and origin of each.
+   It is rewritten whenever the active deployment of a ref changes, and
+   lets us find and list the deployed refs without enumerating the whole
+   app and runtime trees.
+
+   Changes to it are serialized by a lock file, which works between
+   processes too, and each change bumps a generation counter before
+   touching the deployments. The index records the generation it was
+   written for, so it is not trusted if a change started after it was
+   written, even if that change never finished. It also records the
+   mtimes of the app and runtime dirs, to catch changes made without
+   going through here. */
+#define DEPLOYED_INDEX_NAME "deployed-index"
+#define DEPLOYED_INDEX_LOCK_NAME "deployed-index.lock"
+#define DEPLOYED_GENERATION_NAME "deployed-generation"
+#define DEPLOYED_INDEX_VERSION 4
+#define DEPLOYED_INDEX_TYPE "(uta{st}a(sa{sv}))"
+
+static const char *deployed_index_kinds[] = { "app", "runtime" };
+
+/* In nanoseconds, or 0 if the dir doesn't exist */
+static guint64
+get_kind_dir_mtime (XdgAppDir  *self,
+                    const char *kind)
 {
-  g_autoptr(GFile) deploy_base = NULL;
-  g_autoptr(GFile) active_link = NULL;
-  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GFile) dir = g_file_get_child (self->basedir, kind);
+  struct stat stbuf;
 
-  deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
-  active_link = g_file_get_child (deploy_base, "active");
-
-  file_info = g_file_query_info (active_link, OSTREE_GIO_FAST_QUERYINFO,
-                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                 cancellable, NULL);
-  if (file_info == NULL)
-    return NULL;
+  if (stat (gs_file_get_path_cached (dir), &stbuf) != 0)
+    return 0;
 
-  return g_strdup (g_file_info_get_symlink_target (file_info));
+  return (guint64) stbuf.st_mtim.tv_sec * 1000000000 + stbuf.st_mtim.tv_nsec;
 }
 
-gboolean
-xdg_app_dir_set_active (XdgAppDir *self,
-                        const char *ref,
-                        const char *checksum,
-                        GCancellable *cancellable,
-                        GError **error)
+/* Returns the locked fd, which unlocks when closed, or -1 */
+static int
+lock_deployed_index (XdgAppDir  *self,
+                     GError    **error)
 {
-  gboolean ret = FALSE;
-  g_autoptr(GFile) deploy_base = NULL;
-  g_autofree char *tmpname = NULL;
-  g_autoptr(GFile) active_tmp_link = NULL;
-  g_autoptr(GFile) active_link = NULL;
-  g_autoptr (GError) my_error = NULL;
-
-  deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
-  active_link = g_file_get_child (deploy_base, "active");
+  g_autoptr(GFile) lock_file = g_file_get_child (self->basedir, DEPLOYED_INDEX_LOCK_NAME);
+  int fd;
 
-  if (checksum != NULL)
+  fd = open (gs_file_get_path_cached (lock_file), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1)
     {
-      tmpname = gs_fileutil_gen_tmp_name (".active-", NULL);
-      active_tmp_link = g_file_get_child (deploy_base, tmpname);
-      if (!g_file_make_symbolic_link (active_tmp_link, checksum, cancellable, error))
-        goto out;
-
-      if (!gs_file_rename (active_tmp_link,
-                           active_link,
-                           cancellable, error))
-        goto out;
+      glnx_set_error_from_errno (error);
+      return -1;
     }
-  else
+
+  while (flock (fd, LOCK_EX) != 0)
     {
-      if (!g_file_delete (active_link, cancellable, &my_error) &&
-          !g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+      if (errno != EINTR)
         {
-          g_propagate_error (error, my_error);
-          my_error = NULL;
-          goto out;
+          glnx_set_error_from_errno (error);
+          close (fd);
+          return -1;
         }
     }
 
-  ret = TRUE;
- out:
-  return ret;
+  return fd;
 }
 
+static guint64
+read_deployed_generation (XdgAppDir *self)
+{
+  g_autoptr(GFile) generation_file = g_file_get_child (self->basedir, DEPLOYED_GENERATION_NAME);
+  g_autofree char *contents = NULL;
 
-gboolean
-xdg_app_dir_run_triggers (XdgAppDir *self,
-			  GCancellable *cancellable,
-			  GError **error)
+  if (!g_file_get_contents (gs_file_get_path_cached (generation_file), &contents, NULL, NULL))
+    return 0;
+
+  return g_ascii_strtoull (contents, NULL, 10);
+}
+
+/* Must be called with the index locked, before changing anything */
+static gboolean
+bump_deployed_generation (XdgAppDir  *self,
+                          guint64    *generation_out,
+                          GError    **error)
 {
-  gboolean ret = FALSE;
-  g_autoptr(GFileEnumerator) dir_enum = NULL;
-  g_autoptr(GFileInfo) child_info = NULL;
-  g_autoptr(GFile) triggersdir = NULL;
-  GError *temp_error = NULL;
+  g_autoptr(GFile) generation_file = g_file_get_child (self->basedir, DEPLOYED_GENERATION_NAME);
+  guint64 generation = read_deployed_generation (self) + 1;
+  g_autofree char *contents = g_strdup_printf ("%" G_GUINT64_FORMAT "\n", generation);
 
-  g_debug ("running triggers");
+  if (!g_file_set_contents (gs_file_get_path_cached (generation_file), contents, -1, error))
+    return FALSE;
 
-  triggersdir = g_file_new_for_path (XDG_APP_TRIGGERDIR);
+  *generation_out = generation;
+  return TRUE;
+}
 
-  dir_enum = g_file_enumerate_children (triggersdir, "standard::type,standard::name",
-                                        0, cancellable, error);
-  if (!dir_enum)
-    goto out;
+/* Taken before scanning, so any change during the scan makes the
+   index look stale rather than hiding it */
+static GVariant *
+get_kind_dir_mtimes (XdgAppDir *self)
+{
+  GVariantBuilder mtimes_builder;
+  int i;
 
-  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
-    {
-      g_autoptr(GFile) child = NULL;
-      const char *name;
-      GError *trigger_error = NULL;
+  g_variant_builder_init (&mtimes_builder, G_VARIANT_TYPE ("a{st}"));
+  for (i = 0; i < G_N_ELEMENTS (deployed_index_kinds); i++)
+    g_variant_builder_add (&mtimes_builder, "{st}", deployed_index_kinds[i],
+                           get_kind_dir_mtime (self, deployed_index_kinds[i]));
 
-      name = g_file_info_get_name (child_info);
+  return g_variant_ref_sink (g_variant_builder_end (&mtimes_builder));
+}
 
-      child = g_file_get_child (triggersdir, name);
+/* The (sa{sv}) index entry for ref, or NULL if it's not active */
+static GVariant *
+make_deployed_index_entry (XdgAppDir    *self,
+                           const char   *ref,
+                           GCancellable *cancellable)
+{
+  g_autofree char *active = xdg_app_dir_read_active (self, ref, cancellable);
+  g_autofree char *origin = NULL;
+  GVariantBuilder props_builder;
 
-      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_REGULAR &&
-	  g_str_has_suffix (name, ".trigger"))
-	{
-	  g_autoptr(GPtrArray) argv_array = NULL;
-
-	  g_debug ("running trigger %s", name);
-
-	  argv_array = g_ptr_array_new_with_free_func (g_free);
-	  g_ptr_array_add (argv_array, g_strdup (HELPER));
-	  g_ptr_array_add (argv_array, g_strdup ("-a"));
-	  g_ptr_array_add (argv_array, g_file_get_path (self->basedir));
-	  g_ptr_array_add (argv_array, g_strdup ("-e"));
-	  g_ptr_array_add (argv_array, g_strdup ("-F"));
-	  g_ptr_array_add (argv_array, g_strdup ("/usr"));
-	  g_ptr_array_add (argv_array, g_file_get_path (child));
-	  g_ptr_array_add (argv_array, NULL);
-
-	  if (!g_spawn_sync ("/",
-			     (char **)argv_array->pdata,
-			     NULL,
-			     G_SPAWN_DEFAULT,
-			     NULL, NULL,
-			     NULL, NULL,
-			     NULL, &trigger_error))
-	    {
-	      g_warning ("Error running trigger %s: %s", name, trigger_error->message);
-	      g_clear_error (&trigger_error);
-	    }
-	}
+  if (active == NULL)
+    return NULL;
 
-      g_clear_object (&child_info);
-    }
+  origin = xdg_app_dir_get_origin (self, ref, cancellable, NULL);
 
-  if (temp_error != NULL)
-    {
-      g_propagate_error (error, temp_error);
-      goto out;
-    }
+  g_variant_builder_init (&props_builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&props_builder, "{sv}", "active", g_variant_new_string (active));
+  if (origin)
+    g_variant_builder_add (&props_builder, "{sv}", "origin", g_variant_new_string (origin));
 
-  ret = TRUE;
- out:
-  return ret;
+  return g_variant_ref_sink (g_variant_new ("(s@a{sv})", ref,
+                                            g_variant_builder_end (&props_builder)));
+}
+
+static int
+compare_deployed_index_entries (gconstpointer a,
+                                gconstpointer b)
+{
+  const char *ref_a, *ref_b;
+
+  g_variant_get_child (*(GVariant **)a, 0, "&s", &ref_a);
+  g_variant_get_child (*(GVariant **)b, 0, "&s", &ref_b);
+
+  return strcmp (ref_a, ref_b);
 }
 
 static gboolean
-read_fd (int           fd,
-         struct stat  *stat_buf,
-         gchar       **contents,
-         gsize        *length,
-         GError      **error)
+save_deployed_index (XdgAppDir     *self,
+                     guint64        generation,
+                     GVariant      *mtimes,
+                     GPtrArray     *entries,
+                     GCancellable  *cancellable,
+                     GError       **error)
 {
-  gchar *buf;
-  gsize bytes_read;
-  gsize size;
-  gsize alloc_size;
+  g_autoptr(GFile) index_file = NULL;
+  g_autoptr(GVariant) index = NULL;
+
+  g_ptr_array_sort (entries, compare_deployed_index_entries);
+
+  index = g_variant_ref_sink (g_variant_new ("(ut@a{st}@a(sa{sv}))", DEPLOYED_INDEX_VERSION,
+                                             generation, mtimes,
+                                             g_variant_new_array (G_VARIANT_TYPE ("(sa{sv})"),
+                                                                  (GVariant **)entries->pdata,
+                                                                  entries->len)));
+
+  /* Written to a temp file and renamed, so readers never see a partial index */
+  index_file = g_file_get_child (self->basedir, DEPLOYED_INDEX_NAME);
+  if (!g_file_replace_contents (index_file,
+                                g_variant_get_data (index),
+                                g_variant_get_size (index),
+                                NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                cancellable, error))
+    return FALSE;
 
-  size = stat_buf->st_size;
+  return TRUE;
+}
 
-  alloc_size = size + 1;
-  buf = g_try_malloc (alloc_size);
+/* Must be called with the index locked, after the change */
+static gboolean
+write_deployed_index (XdgAppDir     *self,
+                      guint64        generation,
+                      GCancellable  *cancellable,
+                      GError       **error)
+{
+  g_autoptr(GVariant) mtimes = NULL;
+  g_autoptr(GPtrArray) entries = NULL;
+  int i, j;
 
-  if (buf == NULL)
-    {
-      g_set_error (error,
-                   G_FILE_ERROR,
-                   G_FILE_ERROR_NOMEM,
-                   "not enough memory");
-      return FALSE;
-    }
+  mtimes = get_kind_dir_mtimes (self);
 
-  bytes_read = 0;
-  while (bytes_read < size)
+  entries = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  for (i = 0; i < G_N_ELEMENTS (deployed_index_kinds); i++)
     {
-      gssize rc;
+      g_auto(GStrv) refs = NULL;
 
-      rc = read (fd, buf + bytes_read, size - bytes_read);
+      if (!scan_refs (self, deployed_index_kinds[i], &refs, cancellable, error))
+        return FALSE;
 
-      if (rc < 0)
+      for (j = 0; refs[j] != NULL; j++)
         {
-          if (errno != EINTR)
-            {
-              int save_errno = errno;
-
-              g_free (buf);
-              g_set_error (error,
-                           G_FILE_ERROR,
-                           g_file_error_from_errno (save_errno),
-                           "Failed to read from exported file");
-              return FALSE;
-            }
+          GVariant *entry = make_deployed_index_entry (self, refs[j], cancellable);
+          if (entry)
+            g_ptr_array_add (entries, entry);
         }
-      else if (rc == 0)
-        break;
-      else
-        bytes_read += rc;
     }
 
-  buf[bytes_read] = '\0';
+  return save_deployed_index (self, generation, mtimes, entries, cancellable, error);
+}
 
-  if (length)
-    *length = bytes_read;
+/* The whole index variant, or NULL if it is missing or has an older version */
+static GVariant *
+read_deployed_index_file (XdgAppDir *self)
+{
+  g_autoptr(GFile) index_file = NULL;
+  g_autoptr(GMappedFile) mapped = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) index = NULL;
+  guint32 version;
+
+  index_file = g_file_get_child (self->basedir, DEPLOYED_INDEX_NAME);
+  mapped = g_mapped_file_new (gs_file_get_path_cached (index_file), FALSE, NULL);
+  if (mapped == NULL)
+    return NULL;
 
-  *contents = buf;
+  bytes = g_mapped_file_get_bytes (mapped);
+  index = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (DEPLOYED_INDEX_TYPE),
+                                                        bytes, FALSE));
 
-  return TRUE;
+  g_variant_get_child (index, 0, "u", &version);
+  if (version != DEPLOYED_INDEX_VERSION)
+    return NULL;
+
+  return g_steal_pointer (&index);
 }
 
-/* This is conservative, but lets us avoid escaping most
-   regular Exec= lines, which is nice as that can sometimes
-   cause problems for apps launching desktop files. */
+/* Adds the names in the kind dir to names, as "kind/name" */
 static gboolean
-need_quotes (const char *str)
+list_kind_names (XdgAppDir     *self,
+                 const char    *kind,
+                 GHashTable    *names,
+                 GCancellable  *cancellable,
+                 GError       **error)
 {
-  const char *p;
+  g_autoptr(GFile) base = NULL;
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  GError *temp_error = NULL;
+  GFileInfo *child_info;
 
-  for (p = str; *p; p++)
+  base = g_file_get_child (self->basedir, kind);
+  if (!g_file_query_exists (base, cancellable))
+    return TRUE;
+
+  dir_enum = g_file_enumerate_children (base, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (!dir_enum)
+    return FALSE;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)))
     {
-      if (!g_ascii_isalnum (*p) &&
-          strchr ("-_%.=:/@", *p) == NULL)
-        return TRUE;
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY)
+        g_hash_table_add (names, g_strconcat (kind, "/", g_file_info_get_name (child_info), NULL));
+      g_object_unref (child_info);
     }
 
-  return FALSE;
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, temp_error);
+      return FALSE;
+    }
+
+  return TRUE;
 }
 
+/* The "kind/name" prefix of ref */
 static char *
-maybe_quote (const char *str)
+ref_kind_name (const char *ref)
 {
-  if (need_quotes (str))
-    return g_shell_quote (str);
-  return g_strdup (str);
+  const char *slash = strchr (ref, '/');
+
+  if (slash != NULL)
+    slash = strchr (slash + 1, '/');
+  if (slash == NULL)
+    return g_strdup (ref);
+
+  return g_strndup (ref, slash - ref);
 }
 
+/* Must be called with the index locked, after changing ref. If the
+   index was up to date before the change, only the entry for ref is
+   updated, and for the names that appeared or went away, rather than
+   reading every deployment again. */
 static gboolean
-export_desktop_file (const char    *app,
-                     const char    *branch,
-                     const char    *arch,
-                     int            parent_fd,
-                     const char    *name,
-                     struct stat   *stat_buf,
-                     char         **target,
-                     GCancellable  *cancellable,
-                     GError       **error)
+update_deployed_index_ref (XdgAppDir     *self,
+                           guint64        generation,
+                           const char    *ref,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+  g_autoptr(GVariant) index = NULL;
+  g_autoptr(GVariant) old_mtimes = NULL;
+  g_autoptr(GVariant) old_refs = NULL;
+  g_autoptr(GVariant) mtimes = NULL;
+  g_autoptr(GPtrArray) entries = NULL;
+  g_autoptr(GHashTable) names = NULL;
+  g_autoptr(GHashTable) indexed_names = NULL;
+  gboolean kind_changed[G_N_ELEMENTS (deployed_index_kinds)];
+  GVariant *entry;
+  GHashTableIter iter;
+  gpointer key;
+  guint64 old_generation;
+  gsize i, n_refs;
+  int j;
+
+  index = read_deployed_index_file (self);
+  if (index != NULL)
+    g_variant_get_child (index, 1, "t", &old_generation);
+  if (index == NULL || old_generation + 1 != generation)
+    return write_deployed_index (self, generation, cancellable, error);
+
+  old_mtimes = g_variant_get_child_value (index, 2);
+  old_refs = g_variant_get_child_value (index, 3);
+  mtimes = get_kind_dir_mtimes (self);
+
+  /* A changed kind dir means names were added or removed */
+  names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (j = 0; j < G_N_ELEMENTS (deployed_index_kinds); j++)
+    {
+      guint64 old_mtime, mtime;
+
+      g_variant_lookup (mtimes, deployed_index_kinds[j], "t", &mtime);
+      kind_changed[j] = !g_variant_lookup (old_mtimes, deployed_index_kinds[j], "t", &old_mtime) ||
+        old_mtime != mtime;
+
+      if (kind_changed[j] &&
+          !list_kind_names (self, deployed_index_kinds[j], names, cancellable, error))
+        return FALSE;
+    }
+
+  entries = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+  indexed_names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  n_refs = g_variant_n_children (old_refs);
+  for (i = 0; i < n_refs; i++)
+    {
+      g_autofree char *kind_name = NULL;
+      const char *old_ref;
+
+      entry = g_variant_get_child_value (old_refs, i);
+      g_variant_get_child (entry, 0, "&s", &old_ref);
+      kind_name = ref_kind_name (old_ref);
+
+      if (strcmp (old_ref, ref) == 0)
+        {
+          g_variant_unref (entry);
+          continue;
+        }
+
+      for (j = 0; j < G_N_ELEMENTS (deployed_index_kinds); j++)
+        if (kind_changed[j] && g_str_has_prefix (old_ref, deployed_index_kinds[j]) &&
+            old_ref[strlen (deployed_index_kinds[j])] == '/')
+          break;
+
+      /* In a changed kind dir, and the name is gone */
+      if (j < G_N_ELEMENTS (deployed_index_kinds) &&
+          !g_hash_table_contains (names, kind_name))
+        {
+          g_variant_unref (entry);
+          continue;
+        }
+
+      g_ptr_array_add (entries, entry);
+      g_hash_table_add (indexed_names, g_steal_pointer (&kind_name));
+    }
+
+  /* New names, which may have been deployed by an older version */
+  g_hash_table_iter_init (&iter, names);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      const char *kind_name = key;
+      const char *name = strchr (kind_name, '/') + 1;
+      g_autofree char *kind = g_strndup (kind_name, name - 1 - kind_name);
+      g_auto(GStrv) refs = NULL;
+
+      if (g_hash_table_contains (indexed_names, kind_name))
+        continue;
+
+      if (!scan_refs_for_name (self, kind, name, &refs, cancellable, error))
+        return FALSE;
+
+      for (j = 0; refs[j] != NULL; j++)
+        {
+          if (strcmp (refs[j], ref) == 0)
+            continue;
+
+          entry = make_deployed_index_entry (self, refs[j], cancellable);
+          if (entry)
+            g_ptr_array_add (entries, entry);
+        }
+    }
+
+  entry = make_deployed_index_entry (self, ref, cancellable);
+  if (entry)
+    g_ptr_array_add (entries, entry);
+
+  return save_deployed_index (self, generation, mtimes, entries, cancellable, error);
+}
+
+/* Rewrites the index after changing the deployments without
+   xdg_app_dir_set_active(), like removing their dirs */
+gboolean
+xdg_app_dir_update_deployed_index (XdgAppDir     *self,
+                                   GCancellable  *cancellable,
+                                   GError       **error)
+{
+  glnx_fd_close int lock_fd = -1;
+  guint64 generation;
+
+  lock_fd = lock_deployed_index (self, error);
+  if (lock_fd == -1)
+    return FALSE;
+
+  if (!bump_deployed_generation (self, &generation, error))
+    return FALSE;
+
+  return write_deployed_index (self, generation, cancellable, error);
+}
+
+/* Returns the a(sa{sv}) list of refs, or NULL if there is no usable
+   index. The index is not usable if it has an older version, if the
+   deployments changed since it was written, or if the app or runtime
+   dirs changed since. */
+GVariant *
+xdg_app_dir_load_deployed_index (XdgAppDir *self)
+{
+  g_autoptr(GVariant) index = NULL;
+  g_autoptr(GVariant) mtimes = NULL;
+  guint64 generation;
+  int i;
+
+  index = read_deployed_index_file (self);
+  if (index == NULL)
+    return NULL;
+
+  g_variant_get_child (index, 1, "t", &generation);
+  if (generation != read_deployed_generation (self))
+    return NULL;
+
+  mtimes = g_variant_get_child_value (index, 2);
+  for (i = 0; i < G_N_ELEMENTS (deployed_index_kinds); i++)
+    {
+      guint64 mtime;
+
+      if (!g_variant_lookup (mtimes, deployed_index_kinds[i], "t", &mtime) ||
+          mtime != get_kind_dir_mtime (self, deployed_index_kinds[i]))
+        return NULL;
+    }
+
+  return g_variant_get_child_value (index, 3);
+}
+
+/* Index of the first ref in the index that is >= prefix */
+static gsize
+deployed_index_lower_bound (GVariant   *refs,
+                            const char *prefix)
+{
+  gsize lo = 0, hi = g_variant_n_children (refs), mid;
+
+  while (lo < hi)
+    {
+      const char *ref;
+
+      mid = lo + (hi - lo) / 2;
+      g_variant_get_child (refs, mid, "(&s@a{sv})", &ref, NULL);
+      if (strcmp (ref, prefix) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+/* Lists the refs in the index starting with @prefix that have an
+   active deployment. Returns FALSE if there is no usable index. */
+static gboolean
+list_refs_from_index (XdgAppDir   *self,
+                      const char  *prefix,
+                      char      ***refs_out)
+{
+  g_autoptr(GVariant) index_refs = NULL;
+  GPtrArray *refs;
+  gsize i, n_refs;
+
+  index_refs = xdg_app_dir_load_deployed_index (self);
+  if (index_refs == NULL)
+    return FALSE;
+
+  refs = g_ptr_array_new ();
+  n_refs = g_variant_n_children (index_refs);
+  for (i = deployed_index_lower_bound (index_refs, prefix); i < n_refs; i++)
+    {
+      g_autoptr(GVariant) props = NULL;
+      const char *ref;
+
+      g_variant_get_child (index_refs, i, "(&s@a{sv})", &ref, &props);
+      if (!g_str_has_prefix (ref, prefix))
+        break;
+
+      /* Like scan_refs(), only list what is still installed */
+      if (g_variant_lookup (props, "active", "&s", NULL))
+        g_ptr_array_add (refs, g_strdup (ref));
+    }
+
+  g_ptr_array_add (refs, NULL);
+  *refs_out = (char **)g_ptr_array_free (refs, FALSE);
+
+  return TRUE;
+}
+
+gboolean
+xdg_app_dir_list_refs_for_name (XdgAppDir      *self,
+                                const char     *kind,
+                                const char     *name,
+                                char         ***refs_out,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  g_autofree char *prefix = g_strconcat (kind, "/", name, "/", NULL);
+
+  if (list_refs_from_index (self, prefix, refs_out))
+    return TRUE;
+
+  return scan_refs_for_name (self, kind, name, refs_out, cancellable, error);
+}
+
+gboolean
+xdg_app_dir_list_refs (XdgAppDir      *self,
+                       const char     *kind,
+                       char         ***refs_out,
+                       GCancellable   *cancellable,
+                       GError        **error)
+{
+  g_autofree char *prefix = g_strconcat (kind, "/", NULL);
+
+  if (list_refs_from_index (self, prefix, refs_out))
+    return TRUE;
+
+  return scan_refs (self, kind, refs_out, cancellable, error);
+}
+
+/* Returns the a{sv} properties @index_refs, as returned by
+   xdg_app_dir_load_deployed_index(), has for @ref: "active" and
+   "origin". Returns NULL if the ref is not in the index. */
+GVariant *
+xdg_app_deployed_index_lookup (GVariant   *index_refs,
+                               const char *ref)
+{
+  gsize i;
+
+  i = deployed_index_lower_bound (index_refs, ref);
+  if (i < g_variant_n_children (index_refs))
+    {
+      GVariant *props;
+      const char *found;
+
+      g_variant_get_child (index_refs, i, "(&s@a{sv})", &found, &props);
+      if (strcmp (found, ref) == 0)
+        return props;
+
+      g_variant_unref (props);
+    }
+
+  return NULL;
+}
+
+char *
+xdg_app_dir_read_active (XdgAppDir *self,
+                         const char *ref,
+                         GCancellable *cancellable)
+{
+  g_autoptr(GFile) deploy_base = NULL;
+  g_autoptr(GFile) active_link = NULL;
+  g_autoptr(GFileInfo) file_info = NULL;
+
+  deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
+  active_link = g_file_get_child (deploy_base, "active");
+
+  file_info = g_file_query_info (active_link, OSTREE_GIO_FAST_QUERYINFO,
+                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                 cancellable, NULL);
+  if (file_info == NULL)
+    return NULL;
+
+  return g_strdup (g_file_info_get_symlink_target (file_info));
+}
+
+gboolean
+xdg_app_dir_set_active (XdgAppDir *self,
+                        const char *ref,
+                        const char *checksum,
+                        GCancellable *cancellable,
+                        GError **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GFile) deploy_base = NULL;
+  g_autofree char *tmpname = NULL;
+  g_autoptr(GFile) active_tmp_link = NULL;
+  g_autoptr(GFile) active_link = NULL;
+  g_autoptr (GError) my_error = NULL;
+  g_autoptr (GError) index_error = NULL;
+  g_autoptr(GFile) index_file = NULL;
+  glnx_fd_close int lock_fd = -1;
+  gboolean have_generation = FALSE;
+  guint64 generation;
+
+  deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
+  active_link = g_file_get_child (deploy_base, "active");
+  index_file = g_file_get_child (self->basedir, DEPLOYED_INDEX_NAME);
+
+  lock_fd = lock_deployed_index (self, &index_error);
+  if (lock_fd != -1 &&
+      bump_deployed_generation (self, &generation, &index_error))
+    have_generation = TRUE;
+  else
+    {
+      /* A stale index is worse than none, we fall back to scanning */
+      g_warning ("Unable to update deployed index: %s\n", index_error->message);
+      g_file_delete (index_file, NULL, NULL);
+      g_clear_error (&index_error);
+    }
+
+  if (checksum != NULL)
+    {
+      tmpname = gs_fileutil_gen_tmp_name (".active-", NULL);
+      active_tmp_link = g_file_get_child (deploy_base, tmpname);
+      if (!g_file_make_symbolic_link (active_tmp_link, checksum, cancellable, error))
+        goto out;
+
+      if (!gs_file_rename (active_tmp_link,
+                           active_link,
+                           cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (!g_file_delete (active_link, cancellable, &my_error) &&
+          !g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, my_error);
+          my_error = NULL;
+          goto out;
+        }
+    }
+
+  if (have_generation &&
+      !update_deployed_index_ref (self, generation, ref, cancellable, &index_error))
+    {
+      g_warning ("Unable to update deployed index: %s\n", index_error->message);
+      g_file_delete (index_file, NULL, NULL);
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+
+/* Triggers can declare the subdirectory of the exports that they use
+   with a line like "# xdg-app-trigger-input: share/icons", and are then
+   only run when an export below it was added, removed or updated. As
+   the triggers run with the host /usr, they also have to list the files
+   they use from it, with a line like
+   "# xdg-app-trigger-host-input: /usr/bin/tool", so that they run again
+   when those are updated. */
+#define TRIGGER_INPUT_KEY "# xdg-app-trigger-input:"
+#define TRIGGER_HOST_INPUT_KEY "# xdg-app-trigger-host-input:"
+
+static void
+get_trigger_inputs (GFile  *trigger,
+                    char  **out_input,
+                    char ***out_host_inputs)
+{
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  int i;
+
+  *out_input = NULL;
+  *out_host_inputs = NULL;
+
+  if (!g_file_load_contents (trigger, NULL, &contents, NULL, NULL, NULL))
+    return;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      if (g_str_has_prefix (lines[i], TRIGGER_INPUT_KEY) && *out_input == NULL)
+        *out_input = g_strstrip (g_strdup (lines[i] + strlen (TRIGGER_INPUT_KEY)));
+      else if (g_str_has_prefix (lines[i], TRIGGER_HOST_INPUT_KEY) && *out_host_inputs == NULL)
+        {
+          g_autofree char *host_inputs = g_strstrip (g_strdup (lines[i] + strlen (TRIGGER_HOST_INPUT_KEY)));
+          *out_host_inputs = g_strsplit_set (host_inputs, " \t", -1);
+        }
+    }
+}
+
+/* Hashes the identity of the host files, missing files included, so
+   that it changes when they are installed, updated or removed */
+static void
+hash_host_inputs (GChecksum  *checksum,
+                  char      **host_inputs)
+{
+  int i;
+
+  for (i = 0; host_inputs != NULL && host_inputs[i] != NULL; i++)
+    {
+      g_autofree char *data = NULL;
+      struct stat stbuf;
+
+      if (*host_inputs[i] == 0)
+        continue;
+
+      if (stat (host_inputs[i], &stbuf) != 0)
+        data = g_strdup_printf ("%s\nmissing\n", host_inputs[i]);
+      else
+        data = g_strdup_printf ("%s\n%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT "\n",
+                                host_inputs[i],
+                                (guint64) stbuf.st_dev, (guint64) stbuf.st_ino,
+                                (guint64) stbuf.st_size, (gint64) stbuf.st_mtime);
+      g_checksum_update (checksum, (const guchar *)data, strlen (data));
+    }
+}
+
+static char *
+hash_trigger_host_inputs (char **host_inputs)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  hash_host_inputs (checksum, host_inputs);
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* Whether any of the changed exports is below input. NULL means the
+   changes are not known, for instance after sweeping the exports. */
+static gboolean
+trigger_input_changed (const char *input,
+                       GPtrArray  *changed_paths)
+{
+  size_t len = strlen (input);
+  int i;
+
+  if (changed_paths == NULL)
+    return TRUE;
+
+  while (len > 0 && input[len - 1] == '/')
+    len--;
+
+  for (i = 0; i < changed_paths->len; i++)
+    {
+      const char *path = g_ptr_array_index (changed_paths, i);
+
+      if (strncmp (path, input, len) == 0 &&
+          (path[len] == 0 || path[len] == '/'))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static GFile *
+xdg_app_dir_get_trigger_hash_file (XdgAppDir  *self,
+                                   const char *trigger_name)
+{
+  g_autoptr(GFile) hashes_dir = g_file_get_child (self->basedir, "trigger-hashes");
+
+  return g_file_get_child (hashes_dir, trigger_name);
+}
+
+typedef struct {
+  XdgAppDir *self;
+  char *name;
+  GFile *trigger;
+  char *input_hash;
+} TriggerRun;
+
+static void
+trigger_run_free (TriggerRun *run)
+{
+  g_free (run->name);
+  g_object_unref (run->trigger);
+  g_free (run->input_hash);
+  g_free (run);
+}
+
+static void
+run_trigger_thread (gpointer data,
+                    gpointer user_data)
+{
+  TriggerRun *run = data;
+  g_autoptr(GPtrArray) argv_array = NULL;
+  GError *trigger_error = NULL;
+  int status;
+
+  g_debug ("running trigger %s", run->name);
+
+  argv_array = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (argv_array, g_strdup (HELPER));
+  g_ptr_array_add (argv_array, g_strdup ("-a"));
+  g_ptr_array_add (argv_array, g_file_get_path (run->self->basedir));
+  g_ptr_array_add (argv_array, g_strdup ("-e"));
+  g_ptr_array_add (argv_array, g_strdup ("-F"));
+  g_ptr_array_add (argv_array, g_strdup ("/usr"));
+  g_ptr_array_add (argv_array, g_file_get_path (run->trigger));
+  g_ptr_array_add (argv_array, NULL);
+
+  if (!g_spawn_sync ("/",
+                     (char **)argv_array->pdata,
+                     NULL,
+                     G_SPAWN_DEFAULT,
+                     NULL, NULL,
+                     NULL, NULL,
+                     &status, &trigger_error) ||
+      !g_spawn_check_exit_status (status, &trigger_error))
+    {
+      g_warning ("Error running trigger %s: %s", run->name, trigger_error->message);
+      g_clear_error (&trigger_error);
+      return;
+    }
+
+  /* Only remember the input once the trigger has succeeded with it */
+  if (run->input_hash != NULL)
+    {
+      g_autoptr(GFile) hash_file = xdg_app_dir_get_trigger_hash_file (run->self, run->name);
+      g_autoptr(GFile) hashes_dir = g_file_get_parent (hash_file);
+
+      if (!gs_file_ensure_directory (hashes_dir, TRUE, NULL, &trigger_error) ||
+          !g_file_replace_contents (hash_file, run->input_hash, strlen (run->input_hash),
+                                    NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                    NULL, NULL, &trigger_error))
+        {
+          g_debug ("Unable to save input hash of trigger %s: %s", run->name, trigger_error->message);
+          g_clear_error (&trigger_error);
+        }
+    }
+}
+
+/* Runs all triggers whose input is among CHANGED_PATHS, the export
+ * relpaths that were added, removed or updated, or whose host inputs
+ * changed since they last ran, in parallel, as they work on separate
+ * parts of the exports. */
+gboolean
+xdg_app_dir_run_triggers (XdgAppDir *self,
+                          GPtrArray *changed_paths,
+			  GCancellable *cancellable,
+			  GError **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GFileInfo) child_info = NULL;
+  g_autoptr(GFile) triggersdir = NULL;
+  g_autoptr(GPtrArray) runs = NULL;
+  GError *temp_error = NULL;
+  int i;
+
+  g_debug ("running triggers");
+
+  triggersdir = g_file_new_for_path (XDG_APP_TRIGGERDIR);
+
+  dir_enum = g_file_enumerate_children (triggersdir, "standard::type,standard::name",
+                                        0, cancellable, error);
+  if (!dir_enum)
+    goto out;
+
+  runs = g_ptr_array_new_with_free_func ((GDestroyNotify)trigger_run_free);
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
+    {
+      g_autoptr(GFile) child = NULL;
+      const char *name;
+
+      name = g_file_info_get_name (child_info);
+
+      child = g_file_get_child (triggersdir, name);
+
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_REGULAR &&
+	  g_str_has_suffix (name, ".trigger"))
+	{
+	  g_autofree char *input = NULL;
+	  g_auto(GStrv) host_inputs = NULL;
+	  TriggerRun *run;
+
+	  get_trigger_inputs (child, &input, &host_inputs);
+
+	  run = g_new0 (TriggerRun, 1);
+	  run->self = self;
+	  run->name = g_strdup (name);
+	  run->trigger = g_object_ref (child);
+
+	  if (input != NULL)
+	    {
+	      g_autoptr(GFile) hash_file = xdg_app_dir_get_trigger_hash_file (self, name);
+	      g_autofree char *old_hash = NULL;
+
+	      run->input_hash = hash_trigger_host_inputs (host_inputs);
+	      if (!trigger_input_changed (input, changed_paths) &&
+		  g_file_load_contents (hash_file, cancellable, &old_hash, NULL, NULL, NULL) &&
+		  strcmp (old_hash, run->input_hash) == 0)
+		{
+		  g_debug ("skipping trigger %s, %s is unchanged", name, input);
+		  trigger_run_free (run);
+		  g_clear_object (&child_info);
+		  continue;
+		}
+
+	      /* Saved again when the trigger succeeds, so a failed run
+	         is retried next time even if nothing changes */
+	      g_file_delete (hash_file, NULL, NULL);
+	    }
+
+	  g_ptr_array_add (runs, run);
+	}
+
+      g_clear_object (&child_info);
+    }
+
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  if (runs->len == 1)
+    run_trigger_thread (g_ptr_array_index (runs, 0), NULL);
+  else if (runs->len > 1)
+    {
+      GThreadPool *pool;
+
+      pool = g_thread_pool_new (run_trigger_thread, NULL,
+                                MIN (g_get_num_processors (), runs->len),
+                                FALSE, error);
+      if (pool == NULL)
+        goto out;
+
+      for (i = 0; i < runs->len; i++)
+        g_thread_pool_push (pool, g_ptr_array_index (runs, i), NULL);
+
+      g_thread_pool_free (pool, FALSE, TRUE);
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+read_fd (int           fd,
+         struct stat  *stat_buf,
+         gchar       **contents,
+         gsize        *length,
+         GError      **error)
 {
-  gboolean ret = FALSE;
-  glnx_fd_close int desktop_fd = -1;
-  g_autofree char *tmpfile_name = NULL;
-  g_autoptr(GOutputStream) out_stream = NULL;
-  g_autofree gchar *data = NULL;
-  gsize data_len;
-  g_autofree gchar *new_data = NULL;
-  gsize new_data_len;
-  g_autoptr(GKeyFile) keyfile = NULL;
-  g_autofree gchar *old_exec = NULL;
+  gchar *buf;
+  gsize bytes_read;
+  gsize size;
+  gsize alloc_size;
+
+  size = stat_buf->st_size;
+
+  alloc_size = size + 1;
+  buf = g_try_malloc (alloc_size);
+
+  if (buf == NULL)
+    {
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   G_FILE_ERROR_NOMEM,
+                   "not enough memory");
+      return FALSE;
+    }
+
+  bytes_read = 0;
+  while (bytes_read < size)
+    {
+      gssize rc;
+
+      rc = read (fd, buf + bytes_read, size - bytes_read);
+
+      if (rc < 0)
+        {
+          if (errno != EINTR)
+            {
+              int save_errno = errno;
+
+              g_free (buf);
+              g_set_error (error,
+                           G_FILE_ERROR,
+                           g_file_error_from_errno (save_errno),
+                           "Failed to read from exported file");
+              return FALSE;
+            }
+        }
+      else if (rc == 0)
+        break;
+      else
+        bytes_read += rc;
+    }
+
+  buf[bytes_read] = '\0';
+
+  if (length)
+    *length = bytes_read;
+
+  *contents = buf;
+
+  return TRUE;
+}
+
+/* This is conservative, but lets us avoid escaping most
+   regular Exec= lines, which is nice as that can sometimes
+   cause problems for apps launching desktop files. */
+static gboolean
+need_quotes (const char *str)
+{
+  const char *p;
+
+  for (p = str; *p; p++)
+    {
+      if (!g_ascii_isalnum (*p) &&
+          strchr ("-_%.=:/@", *p) == NULL)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static char *
+maybe_quote (const char *str)
+{
+  if (need_quotes (str))
+    return g_shell_quote (str);
+  return g_strdup (str);
+}
+
+/* Inverse of escape_key_file_value(), like g_key_file_get_string()
+   returns NULL for invalid escapes */
+static char *
+unescape_key_file_value (const char *value,
+                         gsize       len)
+{
+  GString *str = g_string_sized_new (len);
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    {
+      if (value[i] != '\\')
+        {
+          g_string_append_c (str, value[i]);
+          continue;
+        }
+
+      if (++i == len)
+        goto invalid;
+
+      switch (value[i])
+        {
+        case 's':
+          g_string_append_c (str, ' ');
+          break;
+        case 'n':
+          g_string_append_c (str, '\n');
+          break;
+        case 't':
+          g_string_append_c (str, '\t');
+          break;
+        case 'r':
+          g_string_append_c (str, '\r');
+          break;
+        case '\\':
+          g_string_append_c (str, '\\');
+          break;
+        default:
+          goto invalid;
+        }
+    }
+
+  return g_string_free (str, FALSE);
+
+ invalid:
+  g_string_free (str, TRUE);
+  return NULL;
+}
+
+/* Escapes a value the way g_key_file_set_string() does */
+static void
+escape_key_file_value (GString    *str,
+                       const char *value)
+{
+  const char *p;
+
+  for (p = value; *p; p++)
+    {
+      if (*p == ' ' && p == value)
+        g_string_append (str, "\\s");
+      else if (*p == '\n')
+        g_string_append (str, "\\n");
+      else if (*p == '\t')
+        g_string_append (str, "\\t");
+      else if (*p == '\r')
+        g_string_append (str, "\\r");
+      else if (*p == '\\')
+        g_string_append (str, "\\\\");
+      else
+        g_string_append_c (str, *p);
+    }
+}
+
+static char *
+make_export_exec (const char *old_exec,
+                  const char *escaped_app,
+                  const char *escaped_branch,
+                  const char *escaped_arch)
+{
+  GString *new_exec;
   gint old_argc;
   g_auto(GStrv) old_argv = NULL;
-  g_auto(GStrv) groups = NULL;
-  GString *new_exec = NULL;
+
+  new_exec = g_string_new ("");
+  g_string_append_printf (new_exec, XDG_APP_BINDIR"/xdg-app run --branch=%s --arch=%s", escaped_branch, escaped_arch);
+
+  if (old_exec && g_shell_parse_argv (old_exec, &old_argc, &old_argv, NULL) && old_argc >= 1)
+    {
+      int i;
+      g_autofree char *command = maybe_quote (old_argv[0]);
+
+      g_string_append_printf (new_exec, " --command=%s", command);
+
+      g_string_append (new_exec, " ");
+      g_string_append (new_exec, escaped_app);
+
+      for (i = 1; i < old_argc; i++)
+        {
+          g_autofree char *arg = maybe_quote (old_argv[i]);
+          g_string_append (new_exec, " ");
+          g_string_append (new_exec, arg);
+        }
+    }
+  else
+    {
+      g_string_append (new_exec, " ");
+      g_string_append (new_exec, escaped_app);
+    }
+
+  return g_string_free (new_exec, FALSE);
+}
+
+typedef enum {
+  KEY_FILE_LINE_OTHER,
+  KEY_FILE_LINE_GROUP,
+  KEY_FILE_LINE_KEY,
+} KeyFileLineType;
+
+typedef struct {
+  KeyFileLineType type;
+  const char *start;
+  gsize len;
+  /* For groups the name, for keys the key */
+  const char *name;
+  gsize name_len;
+  const char *value;
+  gsize value_len;
+  /* For keys, the index of their group line */
+  int group;
+} KeyFileLine;
+
+typedef struct {
+  int last_key;
+  int exec;
+} KeyFileGroup;
+
+static gboolean
+key_file_line_is (KeyFileLine *line,
+                  const char  *name)
+{
+  return line->name_len == strlen (name) && strncmp (line->name, name, line->name_len) == 0;
+}
+
+/* Splits a key file into lines the way GKeyFile parses it, failing
+   on the same kinds of invalid lines */
+static GArray *
+split_key_file (const char  *data,
+                gsize        data_len,
+                const char  *name,
+                GError     **error)
+{
+  g_autoptr(GArray) lines = g_array_new (FALSE, TRUE, sizeof (KeyFileLine));
+  const char *p = data, *end = data + data_len;
+  int group = -1;
+
+  if (!g_utf8_validate (data, data_len, NULL))
+    {
+      xdg_app_fail (error, "Exported file %s is not UTF-8", name);
+      return NULL;
+    }
+
+  while (p < end)
+    {
+      const char *eol = memchr (p, '\n', end - p);
+      const char *s, *eq, *line_end;
+      KeyFileLine line = { KEY_FILE_LINE_OTHER, p, (eol ? eol : end) - p };
+
+      /* Like GKeyFile, ignore the \r of CRLF line endings, but keep it
+         in the line so it is copied as is */
+      line_end = p + line.len;
+      if (line_end > p && *(line_end - 1) == '\r')
+        line_end--;
+
+      s = p;
+      while (s < line_end && g_ascii_isspace (*s))
+        s++;
+
+      if (s == line_end || *s == '#')
+        ;
+      else if (*s == '[')
+        {
+          const char *group_end = memchr (s, ']', line_end - s);
+          const char *t;
+
+          if (group_end == NULL)
+            {
+              xdg_app_fail (error, "Invalid group line in %s", name);
+              return NULL;
+            }
+
+          /* Only whitespace may follow the first ] */
+          for (t = group_end + 1; t < line_end; t++)
+            {
+              if (*t != ' ' && *t != '\t')
+                {
+                  xdg_app_fail (error, "Invalid group line in %s", name);
+                  return NULL;
+                }
+            }
+
+          line.type = KEY_FILE_LINE_GROUP;
+          line.name = s + 1;
+          line.name_len = group_end - line.name;
+          group = lines->len;
+        }
+      else if ((eq = memchr (s, '=', line_end - s)) != NULL)
+        {
+          const char *key_end = eq;
+
+          if (group < 0)
+            {
+              xdg_app_fail (error, "Exported file %s does not start with a group", name);
+              return NULL;
+            }
+
+          while (key_end > s && g_ascii_isspace (*(key_end - 1)))
+            key_end--;
+
+          line.type = KEY_FILE_LINE_KEY;
+          line.name = s;
+          line.name_len = key_end - s;
+          line.value = eq + 1;
+          while (line.value < line_end && g_ascii_isspace (*line.value))
+            line.value++;
+          line.value_len = line_end - line.value;
+          line.group = group;
+        }
+      else
+        {
+          xdg_app_fail (error, "Exported file %s contains an invalid line", name);
+          return NULL;
+        }
+
+      g_array_append_val (lines, line);
+      p = eol ? eol + 1 : end;
+    }
+
+  return g_steal_pointer (&lines);
+}
+
+/* Rewrites the Exec line of every group to run the app with xdg-app, and
+   drops keys that would run things outside the sandbox. This works on
+   the lines directly, so everything else, including the translations,
+   is copied as is rather than parsed and re-serialized. */
+char *
+xdg_app_rewrite_desktop_data (const char  *app,
+                              const char  *branch,
+                              const char  *arch,
+                              const char  *name,
+                              const char  *data,
+                              gsize        data_len,
+                              gsize       *new_data_len,
+                              GError     **error)
+{
+  g_autoptr(GArray) lines = NULL;
+  g_autoptr(GHashTable) groups = NULL;
   g_autofree char *escaped_app = maybe_quote (app);
   g_autofree char *escaped_branch = maybe_quote (branch);
   g_autofree char *escaped_arch = maybe_quote (arch);
+  g_autofree char *dbus_name = NULL;
+  GString *new_data;
   int i;
 
-  if (!gs_file_openat_noatime (parent_fd, name, &desktop_fd, cancellable, error))
-    goto out;
+  lines = split_key_file (data, data_len, name, error);
+  if (lines == NULL)
+    return NULL;
 
-  if (!read_fd (desktop_fd, stat_buf, &data, &data_len, error))
-    goto out;
+  /* For each group line, the last key line in it and its (last) Exec line */
+  groups = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+  for (i = 0; i < lines->len; i++)
+    {
+      KeyFileLine *line = &g_array_index (lines, KeyFileLine, i);
+      KeyFileGroup *group;
 
-  keyfile = g_key_file_new ();
-  if (!g_key_file_load_from_data (keyfile, data, data_len, G_KEY_FILE_KEEP_TRANSLATIONS, error))
-    goto out;
+      if (line->type == KEY_FILE_LINE_GROUP)
+        {
+          group = g_new (KeyFileGroup, 1);
+          group->last_key = i;
+          group->exec = -1;
+          g_hash_table_insert (groups, GINT_TO_POINTER (i), group);
+        }
+      else if (line->type == KEY_FILE_LINE_KEY)
+        {
+          KeyFileLine *group_line = &g_array_index (lines, KeyFileLine, line->group);
+
+          group = g_hash_table_lookup (groups, GINT_TO_POINTER (line->group));
+          group->last_key = i;
+          if (key_file_line_is (line, G_KEY_FILE_DESKTOP_KEY_EXEC))
+            group->exec = i;
+
+          if (key_file_line_is (group_line, "D-BUS Service") && key_file_line_is (line, "Name"))
+            {
+              g_free (dbus_name);
+              dbus_name = unescape_key_file_value (line->value, line->value_len);
+            }
+        }
+    }
 
   if (g_str_has_suffix (name, ".service"))
     {
-      g_autofree gchar *dbus_name = NULL;
       g_autofree gchar *expected_dbus_name = g_strndup (name, strlen (name) - strlen (".service"));
 
-      dbus_name = g_key_file_get_string (keyfile, "D-BUS Service", "Name", NULL);
-
       if (dbus_name == NULL || strcmp (dbus_name, expected_dbus_name) != 0)
         {
           xdg_app_fail (error, "dbus service file %s has wrong name", name);
-          return FALSE;
+          return NULL;
         }
     }
 
-  groups = g_key_file_get_groups (keyfile, NULL);
-
-  for (i = 0; groups[i] != NULL; i++)
+  new_data = g_string_sized_new (data_len + 256);
+  for (i = 0; i < lines->len; i++)
     {
-      g_key_file_remove_key (keyfile, groups[i], "TryExec", NULL);
+      KeyFileLine *line = &g_array_index (lines, KeyFileLine, i);
+      KeyFileGroup *group = NULL;
+      gboolean keep = TRUE;
 
-      /* Remove this to make sure nothing tries to execute it outside the sandbox*/
-      g_key_file_remove_key (keyfile, groups[i], "X-GNOME-Bugzilla-ExtraInfoScript", NULL);
+      if (line->type == KEY_FILE_LINE_KEY)
+        {
+          group = g_hash_table_lookup (groups, GINT_TO_POINTER (line->group));
+
+          /* Remove X-GNOME-Bugzilla-ExtraInfoScript to make sure nothing
+             tries to execute it outside the sandbox */
+          if (key_file_line_is (line, "TryExec") ||
+              key_file_line_is (line, "X-GNOME-Bugzilla-ExtraInfoScript") ||
+              (key_file_line_is (line, G_KEY_FILE_DESKTOP_KEY_EXEC) && i != group->exec))
+            keep = FALSE;
+        }
+      else if (line->type == KEY_FILE_LINE_GROUP)
+        group = g_hash_table_lookup (groups, GINT_TO_POINTER (i));
 
-      new_exec = g_string_new ("");
-      g_string_append_printf (new_exec, XDG_APP_BINDIR"/xdg-app run --branch=%s --arch=%s", escaped_branch, escaped_arch);
+      if (keep && (group == NULL || i != group->exec))
+        {
+          g_string_append_len (new_data, line->start, line->len);
+          g_string_append_c (new_data, '\n');
+        }
 
-      old_exec = g_key_file_get_string (keyfile, groups[i], "Exec", NULL);
-      if (old_exec && g_shell_parse_argv (old_exec, &old_argc, &old_argv, NULL) && old_argc >= 1)
+      /* The Exec line replaces the old one, or goes after the last key
+         of the group if there was none, with the same line ending */
+      if (group != NULL &&
+          (i == group->exec || (group->exec == -1 && i == group->last_key)))
         {
-          int i;
-          g_autofree char *command = maybe_quote (old_argv[0]);
+          g_autofree char *old_exec = NULL;
+          g_autofree char *new_exec = NULL;
+          gboolean crlf = line->len > 0 && line->start[line->len - 1] == '\r';
 
-          g_string_append_printf (new_exec, " --command=%s", command);
+          if (group->exec != -1)
+            old_exec = unescape_key_file_value (line->value, line->value_len);
 
-          g_string_append (new_exec, " ");
-          g_string_append (new_exec, escaped_app);
+          new_exec = make_export_exec (old_exec, escaped_app, escaped_branch, escaped_arch);
+          g_string_append (new_data, G_KEY_FILE_DESKTOP_KEY_EXEC "=");
+          escape_key_file_value (new_data, new_exec);
+          g_string_append (new_data, crlf ? "\r\n" : "\n");
+        }
+    }
+
+  *new_data_len = new_data->len;
+  return g_string_free (new_data, FALSE);
+}
+
+static gboolean
+export_desktop_file (const char    *app,
+                     const char    *branch,
+                     const char    *arch,
+                     int            parent_fd,
+                     const char    *name,
+                     struct stat   *stat_buf,
+                     char         **target,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  gboolean ret = FALSE;
+  glnx_fd_close int desktop_fd = -1;
+  g_autofree char *tmpfile_name = NULL;
+  g_autoptr(GOutputStream) out_stream = NULL;
+  g_autofree gchar *data = NULL;
+  gsize data_len;
+  g_autofree gchar *new_data = NULL;
+  gsize new_data_len;
 
-          for (i = 1; i < old_argc; i++)
-            {
-              g_autofree char *arg = maybe_quote (old_argv[i]);
-              g_string_append (new_exec, " ");
-              g_string_append (new_exec, arg);
-            }
-        }
-      else
-        {
-          g_string_append (new_exec, " ");
-          g_string_append (new_exec, escaped_app);
-        }
+  if (!gs_file_openat_noatime (parent_fd, name, &desktop_fd, cancellable, error))
+    goto out;
 
-      g_key_file_set_string (keyfile, groups[i], G_KEY_FILE_DESKTOP_KEY_EXEC, new_exec->str);
-    }
+  if (!read_fd (desktop_fd, stat_buf, &data, &data_len, error))
+    goto out;
 
-  new_data = g_key_file_to_data (keyfile, &new_data_len, error);
+  new_data = xdg_app_rewrite_desktop_data (app, branch, arch, name, data, data_len, &new_data_len, error);
   if (new_data == NULL)
     goto out;
 
@@ -1135,35 +2310,31 @@ export_desktop_file (const char    *app,
 
   ret = TRUE;
  out:
-
-  if (new_exec != NULL)
-    g_string_free (new_exec, TRUE);
-
   return ret;
 }
 
+/* Walks the export dir, removing what must not be exported, and collects
+   the relative paths of the desktop and service files to rewrite */
 static gboolean
 rewrite_export_dir (const char    *app,
-                    const char    *branch,
-                    const char    *arch,
                     int            source_parent_fd,
                     const char    *source_name,
+                    const char    *relpath,
+                    GPtrArray     *desktop_files,
                     GCancellable  *cancellable,
                     GError       **error)
 {
   gboolean ret = FALSE;
   g_auto(GLnxDirFdIterator) source_iter = {0};
-  g_autoptr(GHashTable) visited_children = NULL;
   struct dirent *dent;
 
   if (!glnx_dirfd_iterator_init_at (source_parent_fd, source_name, FALSE, &source_iter, error))
     goto out;
 
-  visited_children = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-
   while (TRUE)
     {
       struct stat stbuf;
+      g_autofree char *child_relpath = NULL;
 
       if (!glnx_dirfd_iterator_next_dent (&source_iter, &dent, cancellable, error))
         goto out;
@@ -1171,12 +2342,6 @@ rewrite_export_dir (const char    *app,
       if (dent == NULL)
         break;
 
-      if (g_hash_table_contains (visited_children, dent->d_name))
-          continue;
-
-      /* Avoid processing the same file again if it was re-created during an export */
-      g_hash_table_insert (visited_children, g_strdup (dent->d_name), GINT_TO_POINTER(1));
-
       if (fstatat (source_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
         {
           if (errno == ENOENT)
@@ -1188,11 +2353,12 @@ rewrite_export_dir (const char    *app,
             }
         }
 
+      child_relpath = g_build_filename (relpath, dent->d_name, NULL);
+
       if (S_ISDIR (stbuf.st_mode))
         {
-          if (!rewrite_export_dir (app, branch, arch,
-                                   source_iter.fd, dent->d_name,
-                                   cancellable, error))
+          if (!rewrite_export_dir (app, source_iter.fd, dent->d_name, child_relpath,
+                                   desktop_files, cancellable, error))
             goto out;
         }
       else if (S_ISREG (stbuf.st_mode))
@@ -1205,55 +2371,574 @@ rewrite_export_dir (const char    *app,
                   glnx_set_error_from_errno (error);
                   goto out;
                 }
+              continue;
             }
 
           if (g_str_has_suffix (dent->d_name, ".desktop") || g_str_has_suffix (dent->d_name, ".service"))
+            g_ptr_array_add (desktop_files, g_steal_pointer (&child_relpath));
+        }
+      else
+        {
+          g_warning ("Not exporting file %s of unsupported type\n", dent->d_name);
+          if (unlinkat (source_iter.fd, dent->d_name, 0) != 0 && errno != ENOENT)
             {
-              g_autofree gchar *new_name = NULL;
+              glnx_set_error_from_errno (error);
+              goto out;
+            }
+        }
+    }
+
+  ret = TRUE;
+ out:
 
-              if (!export_desktop_file (app, branch, arch, source_iter.fd, dent->d_name, &stbuf, &new_name, cancellable, error))
-                goto out;
+  return ret;
+}
 
-              g_hash_table_insert (visited_children, g_strdup (new_name), GINT_TO_POINTER(1));
+typedef struct {
+  const char *app;
+  const char *branch;
+  const char *arch;
+  int root_fd;
+  GCancellable *cancellable;
+  GMutex lock;
+  GCond cond;
+  guint pending;
+  GError *error;
+} RewriteData;
 
-              if (renameat (source_iter.fd, new_name, source_iter.fd, dent->d_name) != 0)
-                {
-                  glnx_set_error_from_errno (error);
-                  goto out;
-                }
-            }
+typedef struct {
+  RewriteData *rewrite;
+  const char *relpath;
+} RewriteJob;
+
+static gboolean
+rewrite_desktop_file (RewriteData  *rewrite,
+                      const char   *relpath,
+                      GError      **error)
+{
+  g_autofree char *dirname = g_path_get_dirname (relpath);
+  g_autofree char *basename = g_path_get_basename (relpath);
+  g_autofree char *new_name = NULL;
+  glnx_fd_close int dir_fd = -1;
+  struct stat stbuf;
+
+  dir_fd = openat (rewrite->root_fd, dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1 ||
+      fstatat (dir_fd, basename, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  if (!export_desktop_file (rewrite->app, rewrite->branch, rewrite->arch,
+                            dir_fd, basename, &stbuf, &new_name,
+                            rewrite->cancellable, error))
+    return FALSE;
+
+  if (renameat (dir_fd, new_name, dir_fd, basename) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+rewrite_desktop_file_thread (gpointer data,
+                             gpointer user_data)
+{
+  RewriteJob *job = data;
+  RewriteData *rewrite = job->rewrite;
+  GError *error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&rewrite->lock);
+  failed = rewrite->error != NULL;
+  g_mutex_unlock (&rewrite->lock);
+
+  if (!failed)
+    rewrite_desktop_file (rewrite, job->relpath, &error);
+
+  g_free (job);
+
+  g_mutex_lock (&rewrite->lock);
+  if (error != NULL && rewrite->error == NULL)
+    rewrite->error = error;
+  else
+    g_clear_error (&error);
+  if (--rewrite->pending == 0)
+    g_cond_signal (&rewrite->cond);
+  g_mutex_unlock (&rewrite->lock);
+}
+
+/* One pool for all rewrites in the process, so that deploying several
+   refs in parallel doesn't start a pool of threads for each of them */
+static GThreadPool *
+get_rewrite_pool (void)
+{
+  static gsize initialized = 0;
+  static GThreadPool *pool = NULL;
+
+  if (g_once_init_enter (&initialized))
+    {
+      /* Non-exclusive pools can't fail to be created */
+      pool = g_thread_pool_new (rewrite_desktop_file_thread, NULL,
+                                g_get_num_processors (), FALSE, NULL);
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return pool;
+}
+
+gboolean
+xdg_app_rewrite_export_dir (const char *app,
+                            const char *branch,
+                            const char *arch,
+                            GFile    *source,
+                            GCancellable  *cancellable,
+                            GError       **error)
+{
+  gboolean ret = FALSE;
+  glnx_fd_close int root_fd = -1;
+  g_autoptr(GPtrArray) desktop_files = NULL;
+  RewriteData rewrite = { app, branch, arch, -1, cancellable };
+  GThreadPool *pool;
+  int i;
+
+  g_mutex_init (&rewrite.lock);
+  g_cond_init (&rewrite.cond);
+
+  root_fd = openat (AT_FDCWD, gs_file_get_path_cached (source), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      goto out;
+    }
+
+  /* First find all the files, then rewrite them in parallel, as
+     parsing and writing them is what takes the time */
+  desktop_files = g_ptr_array_new_with_free_func (g_free);
+  if (!rewrite_export_dir (app, root_fd, ".", "", desktop_files, cancellable, error))
+    goto out;
+
+  if (desktop_files->len == 0)
+    {
+      ret = TRUE;
+      goto out;
+    }
+
+  rewrite.root_fd = root_fd;
+  rewrite.pending = desktop_files->len;
+  pool = get_rewrite_pool ();
+
+  for (i = 0; i < desktop_files->len; i++)
+    {
+      RewriteJob *job = g_new (RewriteJob, 1);
+
+      job->rewrite = &rewrite;
+      job->relpath = g_ptr_array_index (desktop_files, i);
+      g_thread_pool_push (pool, job, NULL);
+    }
+
+  g_mutex_lock (&rewrite.lock);
+  while (rewrite.pending > 0)
+    g_cond_wait (&rewrite.cond, &rewrite.lock);
+  g_mutex_unlock (&rewrite.lock);
+
+  if (rewrite.error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&rewrite.error));
+      goto out;
+    }
+
+  ret = TRUE;
+
+ out:
+  g_mutex_clear (&rewrite.lock);
+  g_cond_clear (&rewrite.cond);
+  return ret;
+}
+
+/* Adds the relative paths of all the regular files in the export dir,
+   i.e. everything export_dir() links to, to FILES */
+static gboolean
+collect_export_files (int            parent_fd,
+                      const char    *name,
+                      const char    *relpath,
+                      GPtrArray     *files,
+                      GCancellable  *cancellable,
+                      GError       **error)
+{
+  g_auto(GLnxDirFdIterator) iter = {0};
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (parent_fd, name, FALSE, &iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+          if (errno == ENOENT)
+            continue;
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          g_autofree gchar *child_relpath = g_strconcat (relpath, dent->d_name, "/", NULL);
+
+          if (!collect_export_files (iter.fd, dent->d_name, child_relpath, files,
+                                     cancellable, error))
+            return FALSE;
+        }
+      else if (S_ISREG (stbuf.st_mode))
+        g_ptr_array_add (files, g_strconcat (relpath, dent->d_name, NULL));
+    }
+
+  return TRUE;
+}
+
+/* The symlink export_dir() creates for RELPATH */
+static char *
+export_symlink_target (const char *app,
+                       const char *relpath)
+{
+  GString *target = g_string_new ("");
+  const char *p;
+
+  for (p = strchr (relpath, '/'); p != NULL; p = strchr (p + 1, '/'))
+    g_string_append (target, "../");
+
+  g_string_append_printf (target, "../app/%s/current/active/export/%s", app, relpath);
+
+  return g_string_free (target, FALSE);
+}
+
+static GFile *
+xdg_app_dir_get_export_list_file (XdgAppDir  *self,
+                                  const char *app)
+{
+  g_autoptr(GFile) lists_dir = g_file_get_child (self->basedir, "export-lists");
+
+  return g_file_get_child (lists_dir, app);
+}
+
+/* The list starts with the active deployment the files were exported
+   from, so that we know when their contents may have changed */
+#define EXPORT_LIST_ACTIVE_KEY "# active: "
+
+/* Returns the sorted list of files exported for APP last time, or NULL
+   if none was recorded. OUT_ACTIVE is set to the deployment they came
+   from, or NULL if not known. */
+static GPtrArray *
+xdg_app_dir_load_export_list (XdgAppDir  *self,
+                              const char *app,
+                              char      **out_active)
+{
+  g_autoptr(GFile) list_file = xdg_app_dir_get_export_list_file (self, app);
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  GPtrArray *files;
+  int i;
+
+  *out_active = NULL;
+
+  if (!g_file_load_contents (list_file, NULL, &contents, NULL, NULL, NULL))
+    return NULL;
+
+  files = g_ptr_array_new_with_free_func (g_free);
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      if (i == 0 && g_str_has_prefix (lines[i], EXPORT_LIST_ACTIVE_KEY))
+        *out_active = g_strdup (lines[i] + strlen (EXPORT_LIST_ACTIVE_KEY));
+      else if (*lines[i] != 0)
+        g_ptr_array_add (files, g_steal_pointer (&lines[i]));
+    }
+
+  return files;
+}
+
+/* An empty list is saved too, so that an app that exports nothing
+   doesn't look like one without a record */
+static gboolean
+xdg_app_dir_save_export_list (XdgAppDir     *self,
+                              const char    *app,
+                              const char    *active,
+                              GPtrArray     *files,
+                              GCancellable  *cancellable,
+                              GError       **error)
+{
+  g_autoptr(GFile) list_file = xdg_app_dir_get_export_list_file (self, app);
+  g_autoptr(GFile) lists_dir = g_file_get_parent (list_file);
+  g_autoptr(GString) contents = g_string_new ("");
+  int i;
+
+  if (!gs_file_ensure_directory (lists_dir, TRUE, cancellable, error))
+    return FALSE;
+
+  if (active != NULL)
+    g_string_append_printf (contents, "%s%s\n", EXPORT_LIST_ACTIVE_KEY, active);
+
+  for (i = 0; i < files->len; i++)
+    g_string_append_printf (contents, "%s\n", (char *)g_ptr_array_index (files, i));
+
+  return g_file_replace_contents (list_file, contents->str, contents->len,
+                                  NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                  NULL, cancellable, error);
+}
+
+static gboolean
+add_export_symlink (GFile         *exports,
+                    int            exports_dfd,
+                    const char    *app,
+                    const char    *relpath,
+                    GError       **error)
+{
+  g_autofree char *target = export_symlink_target (app, relpath);
+  g_autofree char *dirname = g_path_get_dirname (relpath);
+
+  if (strcmp (dirname, ".") != 0)
+    {
+      g_autofree char *dirpath = g_build_filename (gs_file_get_path_cached (exports), dirname, NULL);
+
+      if (g_mkdir_with_parents (dirpath, 0755) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+    }
+
+  if (unlinkat (exports_dfd, relpath, 0) != 0 && errno != ENOENT)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  if (symlinkat (target, exports_dfd, relpath) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+has_export_symlink (int            exports_dfd,
+                    const char    *app,
+                    const char    *relpath)
+{
+  g_autofree char *target = export_symlink_target (app, relpath);
+  size_t target_len = strlen (target);
+  g_autofree char *buf = g_malloc (target_len + 1);
+  ssize_t len;
+
+  /* One byte more than needed, so we notice longer targets */
+  len = readlinkat (exports_dfd, relpath, buf, target_len + 1);
+
+  return len >= 0 && (size_t) len == target_len && memcmp (buf, target, target_len) == 0;
+}
+
+/* Only removes the symlink if it is still ours */
+static gboolean
+remove_export_symlink (int            exports_dfd,
+                       const char    *app,
+                       const char    *relpath,
+                       GError       **error)
+{
+  if (has_export_symlink (exports_dfd, app, relpath) &&
+      unlinkat (exports_dfd, relpath, 0) != 0 && errno != ENOENT)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Updates the exports of CHANGED_APP by diffing the files exported by
+ * its current version against those recorded the last time, so only
+ * the symlinks that were added or removed are touched. The symlinks go
+ * via the current and active links of the app, so they stay valid
+ * across updates. Returns in OUT_NEEDS_SWEEP whether there was no
+ * record, in which case everything is exported, and stale symlinks
+ * have to be found by sweeping the whole exports dir. The relpaths of
+ * the exports that were added, removed or may have new contents, as
+ * the app was updated, are added to CHANGED_PATHS. */
+static gboolean
+xdg_app_dir_export_app (XdgAppDir *self,
+                        GFile *exports,
+                        const char *changed_app,
+                        gboolean *out_needs_sweep,
+                        GPtrArray *changed_paths,
+                        GCancellable *cancellable,
+                        GError **error)
+{
+  g_autofree char *current_ref = NULL;
+  g_autofree char *active_id = NULL;
+  g_autofree char *old_active_id = NULL;
+  gboolean active_changed;
+  g_autoptr(GPtrArray) old_files = NULL;
+  g_autoptr(GPtrArray) new_files = NULL;
+  glnx_fd_close int exports_dfd = -1;
+  int i, j;
+
+  new_files = g_ptr_array_new_with_free_func (g_free);
+
+  if ((current_ref = xdg_app_dir_current_ref (self, changed_app, cancellable)) &&
+      (active_id = xdg_app_dir_read_active (self, current_ref, cancellable)))
+    {
+      g_autoptr(GFile) deploy_base = NULL;
+      g_autoptr(GFile) active = NULL;
+      g_autoptr(GFile) export = NULL;
+
+      deploy_base = xdg_app_dir_get_deploy_dir (self, current_ref);
+      active = g_file_get_child (deploy_base, active_id);
+      export = g_file_get_child (active, "export");
+
+      if (g_file_query_exists (export, cancellable) &&
+          !collect_export_files (AT_FDCWD, gs_file_get_path_cached (export), "",
+                                 new_files, cancellable, error))
+        return FALSE;
+    }
+
+  g_ptr_array_sort (new_files, (GCompareFunc)strvcmp);
+
+  old_files = xdg_app_dir_load_export_list (self, changed_app, &old_active_id);
+  if (old_files == NULL)
+    {
+      old_files = g_ptr_array_new ();
+      *out_needs_sweep = TRUE;
+    }
+
+  /* The symlinks stay the same across updates, but not what they point to */
+  active_changed = old_active_id == NULL || g_strcmp0 (old_active_id, active_id) != 0;
+
+  if (!gs_file_open_dir_fd (exports, &exports_dfd, cancellable, error))
+    return FALSE;
+
+  /* Both lists are sorted, so walk them in step */
+  i = j = 0;
+  while (i < old_files->len || j < new_files->len)
+    {
+      const char *old_file = i < old_files->len ? g_ptr_array_index (old_files, i) : NULL;
+      const char *new_file = j < new_files->len ? g_ptr_array_index (new_files, j) : NULL;
+      int cmp;
+
+      if (old_file == NULL)
+        cmp = 1;
+      else if (new_file == NULL)
+        cmp = -1;
+      else
+        cmp = strcmp (old_file, new_file);
+
+      if (cmp < 0)
+        {
+          if (!remove_export_symlink (exports_dfd, changed_app, old_file, error))
+            return FALSE;
+          g_ptr_array_add (changed_paths, g_strdup (old_file));
+          i++;
+        }
+      else if (cmp > 0)
+        {
+          if (!add_export_symlink (exports, exports_dfd, changed_app, new_file, error))
+            return FALSE;
+          g_ptr_array_add (changed_paths, g_strdup (new_file));
+          j++;
         }
       else
         {
-          g_warning ("Not exporting file %s of unsupported type\n", dent->d_name);
-          if (unlinkat (source_iter.fd, dent->d_name, 0) != 0 && errno != ENOENT)
+          /* Repair the symlink if something removed or replaced it */
+          if (!has_export_symlink (exports_dfd, changed_app, new_file))
             {
-              glnx_set_error_from_errno (error);
-              goto out;
+              if (!add_export_symlink (exports, exports_dfd, changed_app, new_file, error))
+                return FALSE;
+              g_ptr_array_add (changed_paths, g_strdup (new_file));
             }
+          else if (active_changed)
+            g_ptr_array_add (changed_paths, g_strdup (new_file));
+          i++;
+          j++;
         }
     }
 
-  ret = TRUE;
- out:
+  /* The record is only dropped when the app is uninstalled */
+  if (current_ref == NULL)
+    {
+      g_autoptr(GFile) list_file = xdg_app_dir_get_export_list_file (self, changed_app);
+      g_autoptr(GError) my_error = NULL;
 
-  return ret;
+      if (!g_file_delete (list_file, cancellable, &my_error) &&
+          !g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_propagate_error (error, g_steal_pointer (&my_error));
+          return FALSE;
+        }
+    }
+  else if (!xdg_app_dir_save_export_list (self, changed_app, active_id, new_files,
+                                         cancellable, error))
+    return FALSE;
+
+  return TRUE;
 }
 
 gboolean
-xdg_app_rewrite_export_dir (const char *app,
-                            const char *branch,
-                            const char *arch,
-                            GFile    *source,
-                            GCancellable  *cancellable,
-                            GError       **error)
+xdg_app_dir_update_exports (XdgAppDir *self,
+                            const char *changed_app,
+                            GCancellable *cancellable,
+                            GError **error)
+{
+  const char *changed_apps[2] = { changed_app, NULL };
+
+  return xdg_app_dir_update_exports_for_apps (self, changed_apps, cancellable, error);
+}
+
+/* Exports all of CHANGED_APPS, then cleans up and runs the triggers
+   once for all of them */
+gboolean
+xdg_app_dir_update_exports_for_apps (XdgAppDir *self,
+                                     const char **changed_apps,
+                                     GCancellable *cancellable,
+                                     GError **error)
 {
   gboolean ret = FALSE;
+  g_autoptr(GFile) exports = NULL;
+  g_autoptr(GPtrArray) changed_paths = NULL;
+  gboolean needs_sweep = FALSE;
+  int i;
 
-  /* The fds are closed by this call */
-  if (!rewrite_export_dir (app, branch, arch,
-                           AT_FDCWD, gs_file_get_path_cached (source),
-                           cancellable, error))
+  exports = xdg_app_dir_get_exports_dir (self);
+  changed_paths = g_ptr_array_new_with_free_func (g_free);
+
+  if (!gs_file_ensure_directory (exports, TRUE, cancellable, error))
+    goto out;
+
+  for (i = 0; changed_apps[i] != NULL; i++)
+    {
+      if (!xdg_app_dir_export_app (self, exports, changed_apps[i], &needs_sweep,
+                                   changed_paths, cancellable, error))
+        goto out;
+    }
+
+  if (needs_sweep &&
+      !xdg_app_remove_dangling_symlinks (exports, cancellable, error))
+    goto out;
+
+  /* We don't know what the sweep removed, so then all triggers run */
+  if (!xdg_app_dir_run_triggers (self, needs_sweep ? NULL : changed_paths,
+                                 cancellable, error))
     goto out;
 
   ret = TRUE;
@@ -1262,173 +2947,267 @@ xdg_app_rewrite_export_dir (const char *app,
   return ret;
 }
 
+typedef enum {
+  CHECKOUT_METHOD_HARDLINK,
+  CHECKOUT_METHOD_REFLINK,
+  CHECKOUT_METHOD_COPY,
+} CheckoutMethod;
 
-static gboolean
-export_dir (int            source_parent_fd,
-            const char    *source_name,
-            const char    *source_symlink_prefix,
-            const char    *source_relpath,
-            int            destination_parent_fd,
-            const char    *destination_name,
-            GCancellable  *cancellable,
-            GError       **error)
-{
-  gboolean ret = FALSE;
-  int res;
-  g_auto(GLnxDirFdIterator) source_iter = {0};
-  glnx_fd_close int destination_dfd = -1;
-  struct dirent *dent;
-
-  if (!glnx_dirfd_iterator_init_at (source_parent_fd, source_name, FALSE, &source_iter, error))
-    goto out;
+static const char *checkout_method_names[] = { "hardlink", "reflink", "copy" };
 
-  do
-    res = mkdirat (destination_parent_fd, destination_name, 0755);
-  while (G_UNLIKELY (res == -1 && errno == EINTR));
-  if (res == -1)
+typedef struct {
+  CheckoutMethod method;
+  int repo_dfd;
+  guint64 bytes_linked;
+  guint64 bytes_copied;
+} CheckoutData;
+
+/* ostree only hardlinks checkouts from a bare repo in MODE_NONE and
+ * from a bare-user repo in MODE_USER, and only within a filesystem. If
+ * that is not possible here we prefer cloning the objects with
+ * reflinks, which is as cheap on btrfs and xfs, over copying them. */
+static CheckoutMethod
+xdg_app_dir_get_checkout_method (XdgAppDir *self,
+                                 int        repo_dfd,
+                                 GFile     *deploy_base)
+{
+  OstreeRepoMode mode = ostree_repo_get_mode (self->repo);
+  g_autofree char *tmpname = gs_fileutil_gen_tmp_name (".checkout-probe-", NULL);
+  glnx_fd_close int deploy_dfd = -1;
+  glnx_fd_close int src_fd = -1;
+  glnx_fd_close int probe_fd = -1;
+  CheckoutMethod method = CHECKOUT_METHOD_COPY;
+
+  deploy_dfd = open (gs_file_get_path_cached (deploy_base), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (deploy_dfd == -1)
+    return CHECKOUT_METHOD_COPY;
+
+  if ((mode == OSTREE_REPO_MODE_BARE && !self->user) ||
+      (mode == OSTREE_REPO_MODE_BARE_USER && self->user))
     {
-      if (errno != EEXIST)
+      if (linkat (repo_dfd, "config", deploy_dfd, tmpname, 0) == 0)
         {
-          glnx_set_error_from_errno (error);
-          goto out;
+          unlinkat (deploy_dfd, tmpname, 0);
+          return CHECKOUT_METHOD_HARDLINK;
         }
     }
 
-  if (!gs_file_open_dir_fd_at (destination_parent_fd, destination_name,
-                               &destination_dfd,
-                               cancellable, error))
-    goto out;
+  /* We only do our own checkouts for user installations, system ones
+     would also need ownership and xattrs applied */
+  if (!self->user ||
+      (mode != OSTREE_REPO_MODE_BARE && mode != OSTREE_REPO_MODE_BARE_USER))
+    return CHECKOUT_METHOD_COPY;
 
-  while (TRUE)
-    {
-      struct stat stbuf;
+  src_fd = openat (repo_dfd, "config", O_RDONLY | O_CLOEXEC);
+  probe_fd = openat (deploy_dfd, tmpname, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (src_fd != -1 && probe_fd != -1 &&
+      ioctl (probe_fd, FICLONE, src_fd) == 0)
+    method = CHECKOUT_METHOD_REFLINK;
 
-      if (!glnx_dirfd_iterator_next_dent (&source_iter, &dent, cancellable, error))
-        goto out;
+  if (probe_fd != -1)
+    unlinkat (deploy_dfd, tmpname, 0);
 
-      if (dent == NULL)
-        break;
+  return method;
+}
 
-      if (fstatat (source_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
-        {
-          if (errno == ENOENT)
-            continue;
-          else
-            {
-              glnx_set_error_from_errno (error);
-              goto out;
-            }
-        }
+static gboolean
+copy_fd_data (int src_fd, int dest_fd)
+{
+  char buf[64 * 1024];
+  ssize_t n;
 
-      if (S_ISDIR (stbuf.st_mode))
-        {
-          g_autofree gchar *child_symlink_prefix = g_build_filename ("..", source_symlink_prefix, dent->d_name, NULL);
-          g_autofree gchar *child_relpath = g_strconcat (source_relpath, dent->d_name, "/", NULL);
+  while ((n = TEMP_FAILURE_RETRY (read (src_fd, buf, sizeof buf))) > 0)
+    {
+      char *p = buf;
 
-          if (!export_dir (source_iter.fd, dent->d_name, child_symlink_prefix, child_relpath, destination_dfd, dent->d_name,
-                           cancellable, error))
-            goto out;
-        }
-      else if (S_ISREG (stbuf.st_mode))
+      while (n > 0)
         {
-          g_autofree gchar *target = NULL;
-
-          target = g_build_filename (source_symlink_prefix, dent->d_name, NULL);
-
-          if (unlinkat (destination_dfd, dent->d_name, 0) != 0 && errno != ENOENT)
-            {
-              glnx_set_error_from_errno (error);
-              goto out;
-            }
-
-          if (symlinkat (target, destination_dfd, dent->d_name) != 0)
-            {
-              glnx_set_error_from_errno (error);
-              goto out;
-            }
+          ssize_t w = TEMP_FAILURE_RETRY (write (dest_fd, p, n));
+          if (w < 0)
+            return FALSE;
+          p += w;
+          n -= w;
         }
     }
 
-  ret = TRUE;
- out:
-
-  return ret;
+  return n == 0;
 }
 
-gboolean
-xdg_app_export_dir (GFile    *source,
-                    GFile    *destination,
-                    const char *symlink_prefix,
-                    GCancellable  *cancellable,
-                    GError       **error)
+static gboolean
+checkout_file_reflink (CheckoutData  *data,
+                       int            dfd,
+                       const char    *name,
+                       const char    *checksum,
+                       GFileInfo     *info,
+                       GError       **error)
 {
-  gboolean ret = FALSE;
+  g_autofree char *objpath = ostree_get_relative_object_path (checksum, OSTREE_OBJECT_TYPE_FILE, FALSE);
+  guint32 mode = g_file_info_get_attribute_uint32 (info, "unix::mode");
+  guint64 size = g_file_info_get_size (info);
+  glnx_fd_close int src_fd = -1;
+  glnx_fd_close int dest_fd = -1;
+
+  src_fd = openat (data->repo_dfd, objpath, O_RDONLY | O_CLOEXEC);
+  if (src_fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
 
-  if (!gs_file_ensure_directory (destination, TRUE, cancellable, error))
-    goto out;
+  dest_fd = openat (dfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (dest_fd == -1)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
 
-  /* The fds are closed by this call */
-  if (!export_dir (AT_FDCWD, gs_file_get_path_cached (source), symlink_prefix, "",
-                   AT_FDCWD, gs_file_get_path_cached (destination),
-                   cancellable, error))
-    goto out;
+  if (ioctl (dest_fd, FICLONE, src_fd) == 0)
+    data->bytes_linked += size;
+  else if (copy_fd_data (src_fd, dest_fd))
+    data->bytes_copied += size;
+  else
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
 
-  ret = TRUE;
+  /* Same as ostree does in MODE_USER */
+  if (fchmod (dest_fd, mode & 07777 & ~(S_ISUID | S_ISGID)) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
 
- out:
-  return ret;
+  return TRUE;
 }
 
-gboolean
-xdg_app_dir_update_exports (XdgAppDir *self,
-                            const char *changed_app,
-                            GCancellable *cancellable,
-                            GError **error)
+static gboolean
+checkout_tree_reflink (CheckoutData  *data,
+                       int            parent_dfd,
+                       const char    *name,
+                       GFile         *source,
+                       guint32        dir_mode,
+                       GCancellable  *cancellable,
+                       GError       **error)
 {
-  gboolean ret = FALSE;
-  g_autoptr(GFile) exports = NULL;
-  g_autofree char *current_ref = NULL;
-  g_autofree char *active_id = NULL;
-  g_autofree char *symlink_prefix = NULL;
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  GFileInfo *child_info;
+  glnx_fd_close int dfd = -1;
+  GError *temp_error = NULL;
 
-  exports = xdg_app_dir_get_exports_dir (self);
+  /* Writable until everything is checked out, the real mode is set last */
+  if (mkdirat (parent_dfd, name, 0700) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
 
-  if (!gs_file_ensure_directory (exports, TRUE, cancellable, error))
-    goto out;
+  if (!gs_file_open_dir_fd_at (parent_dfd, name, &dfd, cancellable, error))
+    return FALSE;
 
-  if (changed_app &&
-      (current_ref = xdg_app_dir_current_ref (self, changed_app, cancellable)) &&
-      (active_id = xdg_app_dir_read_active (self, current_ref, cancellable)))
+  dir_enum = g_file_enumerate_children (source, OSTREE_GIO_FAST_QUERYINFO,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (dir_enum == NULL)
+    return FALSE;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)))
     {
-      g_autoptr(GFile) deploy_base = NULL;
-      g_autoptr(GFile) active = NULL;
-      g_autoptr(GFile) export = NULL;
+      g_autoptr(GFileInfo) info = child_info;
+      g_autoptr(GFile) child = NULL;
+      const char *child_name = g_file_info_get_name (info);
 
-      deploy_base = xdg_app_dir_get_deploy_dir (self, current_ref);
-      active = g_file_get_child (deploy_base, active_id);
-      export = g_file_get_child (active, "export");
+      child = g_file_get_child (source, child_name);
 
-      if (g_file_query_exists (export, cancellable))
+      switch (g_file_info_get_file_type (info))
         {
-          symlink_prefix = g_build_filename ("..", "app", changed_app, "current", "active", "export", NULL);
-          if (!xdg_app_export_dir (export, exports,
-                                   symlink_prefix,
-                                   cancellable,
-                                   error))
-            goto out;
+        case G_FILE_TYPE_DIRECTORY:
+          if (!checkout_tree_reflink (data, dfd, child_name, child,
+                                      g_file_info_get_attribute_uint32 (info, "unix::mode"),
+                                      cancellable, error))
+            return FALSE;
+          break;
+
+        case G_FILE_TYPE_SYMBOLIC_LINK:
+          if (symlinkat (g_file_info_get_symlink_target (info), dfd, child_name) != 0)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+          break;
+
+        default:
+          if (!checkout_file_reflink (data, dfd, child_name,
+                                      ostree_repo_file_get_checksum (OSTREE_REPO_FILE (child)),
+                                      info, error))
+            return FALSE;
+          break;
         }
     }
 
-  if (!xdg_app_remove_dangling_symlinks (exports, cancellable, error))
-    goto out;
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, temp_error);
+      return FALSE;
+    }
 
-  if (!xdg_app_dir_run_triggers (self, cancellable, error))
-    goto out;
+  if (fchmod (dfd, dir_mode & 07777 & ~(S_ISUID | S_ISGID)) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
 
-  ret = TRUE;
+  return TRUE;
+}
 
- out:
-  return ret;
+/* ostree silently falls back to copying files it can't link, for
+   instance if they already have the maximum number of links, so count
+   what was actually linked. This is another walk over the tree, so it
+   is only done when the debug output is shown. */
+static gboolean
+count_checkout_bytes (CheckoutData  *data,
+                      int            parent_dfd,
+                      const char    *name,
+                      GCancellable  *cancellable,
+                      GError       **error)
+{
+  g_auto(GLnxDirFdIterator) iter = {0};
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (parent_dfd, name, FALSE, &iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          if (!count_checkout_bytes (data, iter.fd, dent->d_name, cancellable, error))
+            return FALSE;
+        }
+      else if (S_ISREG (stbuf.st_mode))
+        {
+          if (stbuf.st_nlink > 1)
+            data->bytes_linked += stbuf.st_size;
+          else
+            data->bytes_copied += stbuf.st_size;
+        }
+    }
+
+  return TRUE;
 }
 
 gboolean
@@ -1446,6 +3225,10 @@ xdg_app_dir_deploy (XdgAppDir *self,
   g_autoptr(GFile) checkoutdir = NULL;
   g_autoptr(GFile) dotref = NULL;
   g_autoptr(GFile) export = NULL;
+  g_autofree char *formatted_linked = NULL;
+  g_autofree char *formatted_copied = NULL;
+  CheckoutData checkout = { 0, };
+  glnx_fd_close int repo_dfd = -1;
 
   if (!xdg_app_dir_ensure_repo (self, cancellable, error))
     goto out;
@@ -1538,22 +3321,57 @@ xdg_app_dir_deploy (XdgAppDir *self,
   if (file_info == NULL)
     goto out;
 
-  if (!ostree_repo_checkout_tree (self->repo,
-                                  self->user ? OSTREE_REPO_CHECKOUT_MODE_USER : OSTREE_REPO_CHECKOUT_MODE_NONE,
-                                  OSTREE_REPO_CHECKOUT_OVERWRITE_NONE,
-                                  checkoutdir,
-                                  OSTREE_REPO_FILE (root), file_info,
+  if (!gs_file_ensure_directory (deploy_base, TRUE, cancellable, error))
+    goto out;
+
+  if (!gs_file_open_dir_fd (ostree_repo_get_path (self->repo), &repo_dfd, cancellable, error))
+    goto out;
+
+  checkout.repo_dfd = repo_dfd;
+  checkout.method = xdg_app_dir_get_checkout_method (self, repo_dfd, deploy_base);
+
+  if (checkout.method == CHECKOUT_METHOD_REFLINK)
+    {
+      if (!checkout_tree_reflink (&checkout, AT_FDCWD, gs_file_get_path_cached (checkoutdir),
+                                  root, g_file_info_get_attribute_uint32 (file_info, "unix::mode"),
                                   cancellable, error))
+        {
+          g_autofree char *checkoutpath = g_file_get_path (checkoutdir);
+
+          gs_shutil_rm_rf (checkoutdir, NULL, NULL);
+          g_prefix_error (error, "While trying to checkout %s into %s: ", checksum, checkoutpath);
+          goto out;
+        }
+    }
+  else
     {
-      g_autofree char *rootpath = NULL;
-      g_autofree char *checkoutpath = NULL;
+      if (!ostree_repo_checkout_tree (self->repo,
+                                      self->user ? OSTREE_REPO_CHECKOUT_MODE_USER : OSTREE_REPO_CHECKOUT_MODE_NONE,
+                                      OSTREE_REPO_CHECKOUT_OVERWRITE_NONE,
+                                      checkoutdir,
+                                      OSTREE_REPO_FILE (root), file_info,
+                                      cancellable, error))
+        {
+          g_autofree char *rootpath = NULL;
+          g_autofree char *checkoutpath = NULL;
 
-      rootpath = g_file_get_path (root);
-      checkoutpath = g_file_get_path (checkoutdir);
-      g_prefix_error (error, "While trying to checkout %s into %s: ", rootpath, checkoutpath);
-      goto out;
+          rootpath = g_file_get_path (root);
+          checkoutpath = g_file_get_path (checkoutdir);
+          g_prefix_error (error, "While trying to checkout %s into %s: ", rootpath, checkoutpath);
+          goto out;
+        }
+
+      if (xdg_app_debug_enabled () &&
+          !count_checkout_bytes (&checkout, AT_FDCWD, gs_file_get_path_cached (checkoutdir),
+                                 cancellable, error))
+        goto out;
     }
 
+  formatted_linked = g_format_size (checkout.bytes_linked);
+  formatted_copied = g_format_size (checkout.bytes_copied);
+  g_debug ("Checked out %s using %s: %s linked, %s copied", ref,
+           checkout_method_names[checkout.method], formatted_linked, formatted_copied);
+
   dotref = g_file_resolve_relative_path (checkoutdir, "files/.ref");
   if (!g_file_replace_contents (dotref, "", 0, NULL, FALSE,
                                 G_FILE_CREATE_NONE, NULL, cancellable, error))
@@ -1594,8 +3412,38 @@ xdg_app_dir_collect_deployed_refs (XdgAppDir *self,
   g_autoptr(GFile) dir = NULL;
   g_autoptr(GFileEnumerator) dir_enum = NULL;
   g_autoptr(GFileInfo) child_info = NULL;
+  g_autoptr(GVariant) index_refs = NULL;
   GError *temp_error = NULL;
 
+  index_refs = xdg_app_dir_load_deployed_index (self);
+  if (index_refs != NULL)
+    {
+      g_autofree char *prefix = g_strconcat (type, "/", name_prefix ? name_prefix : "", NULL);
+      gsize i, n_refs = g_variant_n_children (index_refs);
+
+      for (i = deployed_index_lower_bound (index_refs, prefix); i < n_refs; i++)
+        {
+          g_autoptr(GVariant) props = NULL;
+          g_auto(GStrv) parts = NULL;
+          const char *ref;
+
+          g_variant_get_child (index_refs, i, "(&s@a{sv})", &ref, &props);
+          if (!g_str_has_prefix (ref, prefix))
+            break;
+
+          /* The deploy dir is type/name/branch/arch in the arguments here */
+          parts = g_strsplit (ref, "/", 0);
+          if (g_strv_length (parts) == 4 &&
+              parts[1][0] != '.' &&
+              strcmp (parts[2], branch) == 0 &&
+              strcmp (parts[3], arch) == 0 &&
+              g_variant_lookup (props, "active", "&s", NULL))
+            g_hash_table_add (hash, g_strdup (parts[1]));
+        }
+
+      return TRUE;
+    }
+
   dir = g_file_get_child (self->basedir, type);
   if (!g_file_query_exists (dir, cancellable))
     return TRUE;
@@ -1804,11 +3652,13 @@ xdg_app_dir_undeploy (XdgAppDir *self,
                        cancellable, error))
     goto out;
 
-  if (force_remove || !dir_is_locked (removed_subdir))
+  /* Unless forced, the actual removal is left to
+     xdg_app_dir_cleanup_removed(), which can run in the background */
+  if (force_remove)
     {
       GError *tmp_error = NULL;
 
-      if (!gs_shutil_rm_rf (removed_subdir, cancellable, &tmp_error))
+      if (!xdg_app_rm_rf_parallel (removed_subdir, cancellable, &tmp_error))
         {
           g_warning ("Unable to remove old checkout: %s\n", tmp_error->message);
           g_error_free (tmp_error);
@@ -1829,12 +3679,18 @@ xdg_app_dir_cleanup_removed (XdgAppDir      *self,
   g_autoptr(GFile) removed_dir = NULL;
   g_autoptr(GFileEnumerator) dir_enum = NULL;
   g_autoptr(GFileInfo) child_info = NULL;
+  glnx_fd_close int removed_dfd = -1;
   GError *temp_error = NULL;
 
   removed_dir = xdg_app_dir_get_removed_dir (self);
   if (!g_file_query_exists (removed_dir, cancellable))
     return TRUE;
 
+  /* If another cleanup is already running, leave it to that */
+  removed_dfd = open (gs_file_get_path_cached (removed_dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (removed_dfd == -1 || flock (removed_dfd, LOCK_EX | LOCK_NB) != 0)
+    return TRUE;
+
   dir_enum = g_file_enumerate_children (removed_dir, OSTREE_GIO_FAST_QUERYINFO,
                                         G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
                                         cancellable,
@@ -1851,7 +3707,7 @@ xdg_app_dir_cleanup_removed (XdgAppDir      *self,
 	  !dir_is_locked (child))
 	{
           GError *tmp_error = NULL;
-          if (!gs_shutil_rm_rf (child, cancellable, &tmp_error))
+          if (!xdg_app_rm_rf_parallel (child, cancellable, &tmp_error))
             {
               g_warning ("Unable to remove old checkout: %s\n", tmp_error->message);
               g_error_free (tmp_error);
@@ -1873,6 +3729,37 @@ xdg_app_dir_cleanup_removed (XdgAppDir      *self,
 }
 
 
+static void
+cleanup_child_setup (gpointer user_data)
+{
+  /* Don't get killed along with the terminal of the command that started us */
+  setsid ();
+}
+
+/* Removes the undeployed checkouts from a separate "xdg-app cleanup"
+ * process, at idle I/O priority, so that the current command doesn't
+ * have to wait for it. */
+void
+xdg_app_dir_cleanup_removed_in_background (XdgAppDir *self)
+{
+  const char *argv[] = { XDG_APP_BINDIR "/xdg-app", "cleanup", "--idle",
+                         self->user ? "--user" : "--system", NULL };
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) removed_dir = NULL;
+
+  removed_dir = xdg_app_dir_get_removed_dir (self);
+  if (!g_file_query_exists (removed_dir, NULL))
+    return;
+
+  if (!g_spawn_async (NULL, (char **)argv, NULL,
+                      G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                      cleanup_child_setup, NULL, NULL, &error))
+    {
+      g_debug ("Unable to start background cleanup: %s", error->message);
+      xdg_app_dir_cleanup_removed (self, NULL, NULL);
+    }
+}
+
 gboolean
 xdg_app_dir_prune (XdgAppDir      *self,
                    GCancellable   *cancellable,
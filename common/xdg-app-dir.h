@@ -52,6 +52,13 @@ typedef enum {
 
 GQuark       xdg_app_dir_error_quark      (void);
 
+typedef struct {
+  guint fetched_objects;
+  guint fetched_delta_parts;
+  guint total_delta_parts;
+  guint64 bytes_transferred;
+} XdgAppPullStats;
+
 GFile *  xdg_app_get_system_base_dir_location (void);
 GFile *  xdg_app_get_user_base_dir_location   (void);
 
@@ -84,6 +91,11 @@ char *      xdg_app_dir_get_origin      (XdgAppDir      *self,
                                          const char     *ref,
                                          GCancellable   *cancellable,
                                          GError        **error);
+gboolean    xdg_app_dir_load_remote_summary (XdgAppDir      *self,
+                                             const char     *remote,
+                                             GVariant      **out_summary,
+                                             GCancellable   *cancellable,
+                                             GError        **error);
 GFile *     xdg_app_dir_get_exports_dir (XdgAppDir      *self);
 GFile *     xdg_app_dir_get_removed_dir (XdgAppDir      *self);
 GFile *     xdg_app_dir_get_if_deployed (XdgAppDir      *self,
@@ -107,6 +119,12 @@ gboolean    xdg_app_dir_pull            (XdgAppDir      *self,
                                          const char     *ref,
                                          GCancellable   *cancellable,
                                          GError        **error);
+gboolean    xdg_app_dir_pull_refs       (XdgAppDir      *self,
+                                         const char     *repository,
+                                         const char    **refs,
+                                         XdgAppPullStats *out_stats,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
 gboolean    xdg_app_dir_list_refs_for_name (XdgAppDir      *self,
                                             const char     *kind,
                                             const char     *name,
@@ -118,6 +136,12 @@ gboolean    xdg_app_dir_list_refs       (XdgAppDir      *self,
                                          char          ***refs,
                                          GCancellable   *cancellable,
                                          GError        **error);
+GVariant *  xdg_app_dir_load_deployed_index (XdgAppDir  *self);
+GVariant *  xdg_app_deployed_index_lookup (GVariant     *index_refs,
+                                           const char   *ref);
+gboolean    xdg_app_dir_update_deployed_index (XdgAppDir     *self,
+                                               GCancellable  *cancellable,
+                                               GError       **error);
 char *      xdg_app_dir_read_active     (XdgAppDir      *self,
                                          const char     *ref,
                                          GCancellable   *cancellable);
@@ -157,12 +181,17 @@ gboolean    xdg_app_dir_update_exports  (XdgAppDir      *self,
                                          const char     *app,
                                          GCancellable   *cancellable,
                                          GError        **error);
+gboolean    xdg_app_dir_update_exports_for_apps (XdgAppDir      *self,
+                                                 const char    **changed_apps,
+                                                 GCancellable   *cancellable,
+                                                 GError        **error);
 gboolean    xdg_app_dir_prune           (XdgAppDir      *self,
                                          GCancellable   *cancellable,
                                          GError        **error);
 gboolean    xdg_app_dir_cleanup_removed (XdgAppDir      *self,
                                          GCancellable   *cancellable,
                                          GError        **error);
+void        xdg_app_dir_cleanup_removed_in_background (XdgAppDir *self);
 gboolean    xdg_app_dir_collect_deployed_refs (XdgAppDir *self,
 					       const char *type,
 					       const char *name_prefix,
@@ -172,6 +201,15 @@ gboolean    xdg_app_dir_collect_deployed_refs (XdgAppDir *self,
 					       GCancellable *cancellable,
 					       GError **error);
 
+char *      xdg_app_rewrite_desktop_data (const char  *app,
+                                          const char  *branch,
+                                          const char  *arch,
+                                          const char  *name,
+                                          const char  *data,
+                                          gsize        data_len,
+                                          gsize       *new_data_len,
+                                          GError     **error);
+
 
 
 
@@ -34,6 +34,7 @@
 #include <poll.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mount.h>
@@ -47,12 +48,17 @@
 #include <sys/capability.h>
 #include <sys/prctl.h>
 #include <sys/utsname.h>
+#include <time.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <grp.h>
 
 #ifdef ENABLE_SECCOMP
 #include <seccomp.h>
+#include <link.h>
+#include <elf.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
 #endif
 
 #if 0
@@ -157,6 +163,62 @@ xunsetenv (const char *name)
     die ("unsetenv failed");
 }
 
+/* Launch stage timing, enabled by XDG_APP_TIMING. If xdg-app run set it,
+   it contains its start time, so we report times relative to that */
+static long long timing_start = -1;
+static long long timing_last;
+
+static long long
+monotonic_usec (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+timing_init (void)
+{
+  const char *val = getenv ("XDG_APP_TIMING");
+  long long now = monotonic_usec ();
+  char *endp;
+
+  if (val == NULL)
+    return;
+
+  timing_start = strtoll (val, &endp, 10);
+  if (endp == val || *endp != 0 || timing_start <= 0 || timing_start > now)
+    timing_start = now;
+  timing_last = timing_start;
+
+  /* Don't leak this into the app */
+  xunsetenv ("XDG_APP_TIMING");
+}
+
+static void
+timing_mark (const char *stage)
+{
+  long long now;
+
+  if (timing_start < 0)
+    return;
+
+  now = monotonic_usec ();
+  fprintf (stderr, "xdg-app-timing: helper %-18s %9.3f ms (+%.3f ms)\n", stage,
+           (now - timing_start) / 1000.0, (now - timing_last) / 1000.0);
+  timing_last = now;
+}
+
+static void
+timing_count (const char *name, int count)
+{
+  if (timing_start < 0)
+    return;
+
+  fprintf (stderr, "xdg-app-timing: helper %-18s %9d\n", name, count);
+}
+
 static char *
 strconcat (const char *s1,
            const char *s2)
@@ -294,10 +356,10 @@ static inline int raw_clone(unsigned long flags, void *child_stack) {
 #endif
 }
 
-static void
-setup_seccomp (bool devel)
-{
 #ifdef ENABLE_SECCOMP
+static scmp_filter_ctx
+build_seccomp_filter (bool devel)
+{
   scmp_filter_ctx seccomp;
   /**** BEGIN NOTE ON CODE SHARING
    *
@@ -391,7 +453,7 @@ setup_seccomp (bool devel)
 
   seccomp = seccomp_init(SCMP_ACT_ALLOW);
   if (!seccomp)
-    return die_oom ();
+    die_oom ();
 
   /* Add in all possible secondary archs we are aware of that
    * this kernel might support. */
@@ -454,6 +516,218 @@ setup_seccomp (bool devel)
 	}
     }
 
+  return seccomp;
+}
+
+/* The filter only depends on the helper binary, the arch and devel,
+   so the compiled BPF program can be cached. The cache dir is only
+   writable by root, and filled by "xdg-app-helper -G" at install time */
+#define SECCOMP_CACHE_DIR XDG_APP_SYSTEMDIR "/seccomp"
+
+static struct sock_fprog seccomp_cached_prog;
+
+static int
+find_build_id_cb (struct dl_phdr_info *info,
+                  size_t size,
+                  void *data)
+{
+  char **build_id = data;
+  int i;
+
+  for (i = 0; i < info->dlpi_phnum; i++)
+    {
+      const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+      size_t align = phdr->p_align == 8 ? 8 : 4;
+      const char *p, *end;
+
+      if (phdr->p_type != PT_NOTE)
+        continue;
+
+      p = (const char *)(info->dlpi_addr + phdr->p_vaddr);
+      end = p + phdr->p_memsz;
+      while (p + sizeof (ElfW(Nhdr)) <= end)
+        {
+          const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *)p;
+          const char *name = p + sizeof (ElfW(Nhdr));
+          const unsigned char *desc = (const unsigned char *)name + ((nhdr->n_namesz + align - 1) & ~(align - 1));
+
+          if ((const char *)desc + nhdr->n_descsz > end)
+            break;
+
+          if (nhdr->n_type == NT_GNU_BUILD_ID &&
+              nhdr->n_namesz == 4 && memcmp (name, "GNU", 4) == 0 &&
+              nhdr->n_descsz > 0)
+            {
+              char *hex = xmalloc (nhdr->n_descsz * 2 + 1);
+              int j;
+
+              for (j = 0; j < nhdr->n_descsz; j++)
+                sprintf (hex + j * 2, "%02x", desc[j]);
+              *build_id = hex;
+              return 1;
+            }
+
+          p = (const char *)desc + ((nhdr->n_descsz + align - 1) & ~(align - 1));
+        }
+    }
+
+  /* The first object is the helper itself, ignore the libraries */
+  return 1;
+}
+
+/* The cache is keyed on the build id of the helper, so a rebuilt
+   helper never loads a filter from another build. Without a build id
+   there is no cache. */
+static char *
+seccomp_cache_path (bool devel)
+{
+  struct utsname uts;
+  char *build_id = NULL;
+  char *path;
+
+  if (uname (&uts) != 0)
+    return NULL;
+
+  dl_iterate_phdr (find_build_id_cb, &build_id);
+  if (build_id == NULL)
+    return NULL;
+
+  path = strdup_printf ("%s/%s-%s%s.bpf", SECCOMP_CACHE_DIR,
+                        build_id, uts.machine, devel ? "-devel" : "");
+  free (build_id);
+
+  return path;
+}
+
+static bool
+write_seccomp_cache (bool devel)
+{
+  scmp_filter_ctx seccomp;
+  char *path, *tmp_path;
+  int fd, r;
+
+  path = seccomp_cache_path (devel);
+  if (path == NULL)
+    return FALSE;
+
+  tmp_path = strconcat (path, ".XXXXXX");
+  fd = mkstemp (tmp_path);
+  if (fd == -1)
+    {
+      free (path);
+      free (tmp_path);
+      return FALSE;
+    }
+
+  seccomp = build_seccomp_filter (devel);
+  r = seccomp_export_bpf (seccomp, fd);
+  seccomp_release (seccomp);
+
+  if (r < 0 || fchmod (fd, 0644) != 0 || close (fd) != 0 ||
+      rename (tmp_path, path) != 0)
+    {
+      unlink (tmp_path);
+      free (path);
+      free (tmp_path);
+      return FALSE;
+    }
+
+  free (path);
+  free (tmp_path);
+  return TRUE;
+}
+
+/* This has to be called while we still see the host filesystem */
+static void
+load_seccomp_cache (bool devel)
+{
+  struct sock_filter *filter;
+  struct stat st;
+  char *path, *name;
+  ssize_t res;
+  size_t done;
+  int dir_fd, fd;
+
+  path = seccomp_cache_path (devel);
+  if (path == NULL)
+    return;
+
+  /* Only trust a cache that nobody but root could have written. The
+     helper is setuid, so a file owned by the invoking user would let
+     them pick the filter for their own sandbox. */
+  dir_fd = open (SECCOMP_CACHE_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+  if (dir_fd == -1)
+    {
+      free (path);
+      return;
+    }
+
+  if (fstat (dir_fd, &st) != 0 ||
+      st.st_uid != 0 ||
+      (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+    {
+      close (dir_fd);
+      free (path);
+      return;
+    }
+
+  name = strrchr (path, '/') + 1;
+  fd = openat (dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  close (dir_fd);
+  free (path);
+  if (fd == -1)
+    return;
+
+  if (fstat (fd, &st) != 0 ||
+      !S_ISREG (st.st_mode) ||
+      st.st_uid != 0 ||
+      (st.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+      st.st_size == 0 ||
+      st.st_size % sizeof (struct sock_filter) != 0 ||
+      st.st_size / sizeof (struct sock_filter) > BPF_MAXINSNS)
+    {
+      close (fd);
+      return;
+    }
+
+  filter = xmalloc (st.st_size);
+  done = 0;
+  while (done < st.st_size)
+    {
+      res = read (fd, (char *)filter + done, st.st_size - done);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res <= 0)
+        {
+          free (filter);
+          close (fd);
+          return;
+        }
+      done += res;
+    }
+  close (fd);
+
+  seccomp_cached_prog.len = st.st_size / sizeof (struct sock_filter);
+  seccomp_cached_prog.filter = filter;
+}
+#endif
+
+static void
+setup_seccomp (bool devel)
+{
+#ifdef ENABLE_SECCOMP
+  scmp_filter_ctx seccomp;
+  int r;
+
+  if (seccomp_cached_prog.len > 0)
+    {
+      if (prctl (PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &seccomp_cached_prog) < 0)
+        die_with_error ("Failed to install cached seccomp filter");
+      return;
+    }
+
+  seccomp = build_seccomp_filter (devel);
+
   r = seccomp_load (seccomp);
   if (r < 0)
     die_with_error ("Failed to install seccomp audit filter: ");
@@ -471,11 +745,14 @@ usage (char **argv)
            "	-a		 Specify path for application (mounted at /app)\n"
            "	-b DEST[=SOURCE] Bind extra source path read-only into DEST\n"
            "	-B DEST[=SOURCE] Bind extra source path into DEST\n"
+           "	-C DEST=FD	 Create DEST with the contents of FD\n"
            "	-M DEST[=SOURCE] Bind extra source path into DEST and remove original\n"
+           "	-N		 Don't run an init process, run COMMAND as pid 1\n"
            "	-d SOCKETPATH	 Use SOCKETPATH as dbus session bus\n"
            "	-D SOCKETPATH	 Use SOCKETPATH as dbus system bus\n"
            "	-e		 Make /app/exports writable\n"
            "	-E		 Make /etc a pure symlink to /usr/etc\n"
+           "	-G		 Generate the cached seccomp filters and exit\n"
            "	-F		 Mount the host filesystems\n"
            "	-f		 Mount the host filesystems read-only\n"
            "	-g               Allow use of direct rendering graphics\n"
@@ -651,6 +928,7 @@ typedef struct {
   char *dest;
   bool readonly;
   bool move;
+  int fd;
 } ExtraFile;
 
 ExtraFile *extra_files = NULL;
@@ -666,19 +944,27 @@ add_extra_file (char *src, char *dest, bool readonly, bool move)
   extra_files[i].dest = dest;
   extra_files[i].readonly = readonly;
   extra_files[i].move = move;
+  extra_files[i].fd = -1;
+}
+
+static void
+add_extra_fd (int fd, char *dest)
+{
+  add_extra_file (NULL, dest, FALSE, FALSE);
+  extra_files[n_extra_files - 1].fd = fd;
 }
 
 static int n_lock_dirs = 0;
 static const char **lock_dirs = NULL;
 
 static void
-lock_dir (const char *dir)
+lock_dir (const char *dir, bool keep_on_exec)
 {
   char *file = strconcat3 ("/", dir, "/.ref");
   struct flock lock = {0};
   int fd;
 
-  fd = open (file, O_RDONLY | O_CLOEXEC);
+  fd = open (file, O_RDONLY | (keep_on_exec ? 0 : O_CLOEXEC));
   free (file);
   if (fd != -1)
     {
@@ -708,12 +994,14 @@ add_lock_dir (const char *dir)
 /* We need to lock the dirs in pid1 because otherwise the
    locks are not held by the right process and will not live
    for the full duration of the sandbox. */
+/* If KEEP_ON_EXEC is set the lock fds are not closed on exec, so that
+   the locks are kept by the command when we run it without an init */
 static void
-lock_all_dirs (void)
+lock_all_dirs (bool keep_on_exec)
 {
   int i;
   for (i = 0; i < n_lock_dirs; i++)
-    lock_dir (lock_dirs[i]);
+    lock_dir (lock_dirs[i], keep_on_exec);
 }
 
 static char *
@@ -823,168 +1111,533 @@ unescape_string (const char *escaped, size_t len)
   return res;
 }
 
-static char *
-get_mountinfo (const char *mountpoint)
+/* Parsed /proc/self/mountinfo, sorted by mount point. It is read
+   once, and then kept up to date as we add and remount things, so
+   setting up the sandbox doesn't re-read it for each bind mount.
+   Mounts can also propagate in from the host at any time, so it is
+   re-read when a lookup misses. */
+typedef struct {
+  char *mountpoint;
+  unsigned long flags;
+  int index; /* Line in mountinfo, to prefer the earliest entry */
+} mount_info_t;
+
+#define MOUNT_TAB_FLAGS (MS_RDONLY|MS_NOSUID|MS_NODEV|MS_NOEXEC|MS_NOATIME|MS_NODIRATIME|MS_RELATIME)
+
+static mount_info_t *mount_tab = NULL;
+static int n_mount_tab = 0;
+static int mount_tab_size = 0;
+static int mount_tab_next_index = 0;
+static bool mount_tab_valid = FALSE;
+
+static void
+invalidate_mount_tab (void)
 {
-  char *line_mountpoint, *line_mountpoint_end;
-  char *mountinfo;
-  char *free_me = NULL;
-  char *line, *line_start;
-  char *res = NULL;
+  mount_tab_valid = FALSE;
+}
+
+static unsigned long
+parse_mountflags (char *options)
+{
+  char *token, *end_token;
   int i;
+  unsigned long flags = 0;
+  static const struct  { int flag; char *name; } flags_data[] = {
+    { 0, "rw" },
+    { MS_RDONLY, "ro" },
+    { MS_NOSUID, "nosuid" },
+    { MS_NODEV, "nodev" },
+    { MS_NOEXEC, "noexec" },
+    { MS_NOATIME, "noatime" },
+    { MS_NODIRATIME, "nodiratime" },
+    { MS_RELATIME, "relatime" },
+    { 0, NULL }
+  };
 
-  if (mountpoint[0] != '/')
-    {
-      char *cwd = getcwd(NULL, 0);
-      if (cwd == NULL)
-        die_oom ();
+  token = options;
+  do {
+    end_token = strchr (token, ',');
+    if (end_token != NULL)
+      *end_token = 0;
 
-      mountpoint = free_me = strconcat3 (cwd, "/", mountpoint);
-      free (cwd);
-    }
+    for (i = 0; flags_data[i].name != NULL; i++)
+      {
+        if (strcmp (token, flags_data[i].name) == 0)
+          flags |= flags_data[i].flag;
+      }
+
+    if (end_token)
+      token = end_token + 1;
+    else
+      token = NULL;
+  } while (token != NULL);
+
+  return flags;
+}
+
+static int
+compare_mount_info (const void *a, const void *b)
+{
+  const mount_info_t *ma = a;
+  const mount_info_t *mb = b;
+  int res;
+
+  res = strcmp (ma->mountpoint, mb->mountpoint);
+  if (res == 0)
+    res = ma->index - mb->index;
+  return res;
+}
+
+static bool
+load_mount_tab (void)
+{
+  char *mountpoint, *mountpoint_end;
+  char *options, *options_end;
+  char *mountinfo;
+  char *line;
+  int i, n_lines;
+
+  if (mount_tab_valid)
+    return TRUE;
+
+  for (i = 0; i < n_mount_tab; i++)
+    free (mount_tab[i].mountpoint);
+  free (mount_tab);
+  mount_tab = NULL;
+  n_mount_tab = 0;
 
   mountinfo = load_file ("/proc/self/mountinfo");
   if (mountinfo == NULL)
-    return NULL;
+    return FALSE;
 
-  line = mountinfo;
+  n_lines = 0;
+  for (line = mountinfo; *line != 0; line = skip_line (line))
+    n_lines++;
+
+  mount_tab_size = n_lines + 1;
+  mount_tab = xmalloc (sizeof (mount_info_t) * mount_tab_size);
 
+  line = mountinfo;
   while (*line != 0)
     {
-      char *unescaped;
-
-      line_start = line;
       for (i = 0; i < 4; i++)
         line = skip_token (line, TRUE);
-      line_mountpoint = line;
+      mountpoint = line;
+      line = skip_token (line, FALSE);
+      mountpoint_end = line;
+      line = skip_token (line, TRUE);
+      options = line;
       line = skip_token (line, FALSE);
-      line_mountpoint_end = line;
+      options_end = line;
       line = skip_line (line);
 
-      unescaped = unescape_string (line_mountpoint, line_mountpoint_end - line_mountpoint);
-      if (strcmp (mountpoint, unescaped) == 0)
-        {
-	  free (unescaped);
-          res = line_start;
-          line[-1] = 0;
-          break;
-        }
-      free (unescaped);
+      *options_end = 0;
+
+      mount_tab[n_mount_tab].mountpoint = unescape_string (mountpoint, mountpoint_end - mountpoint);
+      mount_tab[n_mount_tab].flags = parse_mountflags (options);
+      mount_tab[n_mount_tab].index = n_mount_tab;
+      n_mount_tab++;
     }
 
-  if (free_me)
-    free (free_me);
   free (mountinfo);
 
-  if (res)
-    return xstrdup (res);
+  mount_tab_next_index = n_mount_tab;
+  qsort (mount_tab, n_mount_tab, sizeof (mount_info_t), compare_mount_info);
+  mount_tab_valid = TRUE;
+
+  return TRUE;
+}
+
+/* Index of the first entry >= prefix */
+static int
+mount_tab_lower_bound (const char *prefix)
+{
+  int lo = 0, hi = n_mount_tab, mid;
+
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (strcmp (mount_tab[mid].mountpoint, prefix) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+static char *
+make_absolute (const char *path)
+{
+  char *cwd, *res;
+
+  if (path[0] == '/')
+    return xstrdup (path);
+
+  cwd = getcwd (NULL, 0);
+  if (cwd == NULL)
+    die_oom ();
+
+  if (strcmp (cwd, "/") == 0)
+    res = strconcat ("/", path);
+  else
+    res = strconcat3 (cwd, "/", path);
+  free (cwd);
+
+  return res;
+}
+
+static mount_info_t *
+mount_tab_lookup (const char *mountpoint)
+{
+  int i;
+
+  i = mount_tab_lower_bound (mountpoint);
+  if (i < n_mount_tab && strcmp (mount_tab[i].mountpoint, mountpoint) == 0)
+    return &mount_tab[i];
+
   return NULL;
 }
 
+static mount_info_t *
+find_mount (const char *mountpoint)
+{
+  mount_info_t *res = NULL;
+  char *abs_mountpoint;
+  bool was_loaded = mount_tab_valid;
+
+  abs_mountpoint = make_absolute (mountpoint);
+
+  if (load_mount_tab ())
+    res = mount_tab_lookup (abs_mountpoint);
+
+  /* Not something we added, so it may have propagated in from the host */
+  if (res == NULL && was_loaded)
+    {
+      invalidate_mount_tab ();
+      if (load_mount_tab ())
+        res = mount_tab_lookup (abs_mountpoint);
+    }
+
+  free (abs_mountpoint);
+
+  return res;
+}
+
+/* The mount that path is on, path must be absolute and canonical */
+static mount_info_t *
+find_mount_containing (const char *path)
+{
+  mount_info_t *res = NULL;
+  char *copy, *slash;
+
+  copy = xstrdup (path);
+  while (TRUE)
+    {
+      res = mount_tab_lookup (copy);
+      if (res != NULL || strcmp (copy, "/") == 0)
+        break;
+
+      slash = strrchr (copy, '/');
+      if (slash == copy)
+        slash[1] = 0;
+      else
+        *slash = 0;
+    }
+
+  free (copy);
+
+  return res;
+}
+
+/* Adds mountpoint (absolute) to the loaded table, or updates its flags
+   if it is already there */
+static void
+mount_tab_add (const char *mountpoint, unsigned long flags)
+{
+  int i;
+
+  i = mount_tab_lower_bound (mountpoint);
+  if (i < n_mount_tab && strcmp (mount_tab[i].mountpoint, mountpoint) == 0)
+    {
+      mount_tab[i].flags = flags & MOUNT_TAB_FLAGS;
+      return;
+    }
+
+  if (n_mount_tab == mount_tab_size)
+    {
+      mount_tab_size = mount_tab_size * 2 + 16;
+      mount_tab = xrealloc (mount_tab, sizeof (mount_info_t) * mount_tab_size);
+    }
+
+  memmove (&mount_tab[i + 1], &mount_tab[i], sizeof (mount_info_t) * (n_mount_tab - i));
+  mount_tab[i].mountpoint = xstrdup (mountpoint);
+  mount_tab[i].flags = flags & MOUNT_TAB_FLAGS;
+  mount_tab[i].index = mount_tab_next_index++;
+  n_mount_tab++;
+}
+
+/* Records a new mount at mountpoint with the given flags */
+static void
+record_mount (const char *mountpoint, unsigned long flags)
+{
+  char *abs_mountpoint;
+
+  /* Nothing to update, the next lookup reads the current state */
+  if (!mount_tab_valid)
+    return;
+
+  abs_mountpoint = make_absolute (mountpoint);
+  mount_tab_add (abs_mountpoint, flags);
+  free (abs_mountpoint);
+}
+
+/* Records a bind mount of src on dest, which has the flags of the
+   mount src is on plus add_flags. For recursive binds the submounts
+   of src show up below dest too. */
+static void
+record_bind_mount (const char *src, const char *dest,
+                   unsigned long add_flags, bool recursive)
+{
+  mount_info_t *src_mount;
+  unsigned long dest_flags;
+  char *src_real, *dest_abs, *prefix;
+  char **sub_names = NULL;
+  unsigned long *sub_flags = NULL;
+  size_t prefix_len;
+  int i, j, n_sub = 0;
+
+  if (!mount_tab_valid)
+    return;
+
+  src_real = realpath (src, NULL);
+  src_mount = src_real ? find_mount_containing (src_real) : NULL;
+  if (src_mount == NULL || strcmp (src_real, "/") == 0)
+    {
+      /* Can't tell what ended up where, read it again on the next lookup */
+      free (src_real);
+      invalidate_mount_tab ();
+      return;
+    }
+
+  dest_flags = src_mount->flags | add_flags;
+  dest_abs = make_absolute (dest);
+
+  if (recursive)
+    {
+      prefix = strconcat (src_real, "/");
+      prefix_len = strlen (prefix);
+
+      i = mount_tab_lower_bound (prefix);
+      for (j = i; j < n_mount_tab; j++)
+        if (strncmp (mount_tab[j].mountpoint, prefix, prefix_len) != 0)
+          break;
+
+      /* Collected first, as adding them moves the table around */
+      sub_names = xmalloc (sizeof (char *) * (j - i + 1));
+      sub_flags = xmalloc (sizeof (unsigned long) * (j - i + 1));
+      for (; i < j; i++)
+        {
+          sub_names[n_sub] = strconcat3 (dest_abs, "/", mount_tab[i].mountpoint + prefix_len);
+          sub_flags[n_sub] = mount_tab[i].flags | add_flags;
+          n_sub++;
+        }
+
+      free (prefix);
+    }
+
+  mount_tab_add (dest_abs, dest_flags);
+  for (i = 0; i < n_sub; i++)
+    {
+      mount_tab_add (sub_names[i], sub_flags[i]);
+      free (sub_names[i]);
+    }
+
+  free (sub_names);
+  free (sub_flags);
+  free (dest_abs);
+  free (src_real);
+}
+
 static unsigned long
 get_mountflags (const char *mountpoint)
 {
-  char *line, *token, *end_token;
-  int i;
-  unsigned long flags = 0;
-  static const struct  { int flag; char *name; } flags_data[] = {
-    { 0, "rw" },
-    { MS_RDONLY, "ro" },
-    { MS_NOSUID, "nosuid" },
-    { MS_NODEV, "nodev" },
-    { MS_NOEXEC, "noexec" },
-    { MS_NOATIME, "noatime" },
-    { MS_NODIRATIME, "nodiratime" },
-    { MS_RELATIME, "relatime" },
-    { 0, NULL }
-  };
+  mount_info_t *mount_info;
 
-  line = get_mountinfo (mountpoint);
-  if (line == NULL)
+  mount_info = find_mount (mountpoint);
+  if (mount_info == NULL)
     return 0;
 
-  token = line;
-  for (i = 0; i < 5; i++)
-    token = skip_token (token, TRUE);
-
-  end_token = skip_token (token, FALSE);
-  *end_token = 0;
-
-  do {
-    end_token = strchr (token, ',');
-    if (end_token != NULL)
-      *end_token = 0;
-
-    for (i = 0; flags_data[i].name != NULL; i++)
-      {
-        if (strcmp (token, flags_data[i].name) == 0)
-          flags |= flags_data[i].flag;
-      }
-
-    if (end_token)
-      token = end_token + 1;
-    else
-      token = NULL;
-  } while (token != NULL);
+  return mount_info->flags;
+}
 
-  free (line);
+static void
+set_mountflags (const char *mountpoint, unsigned long flags)
+{
+  mount_info_t *mount_info;
 
-  return flags;
+  mount_info = find_mount (mountpoint);
+  if (mount_info != NULL)
+    mount_info->flags = flags & MOUNT_TAB_FLAGS;
 }
 
-
 static char **
 get_submounts (const char *parent_mount)
 {
-  char *mountpoint, *mountpoint_end;
   char **submounts;
-  int i, n_submounts, submounts_size;
-  char *mountinfo;
-  char *line;
+  char *abs_parent, *prefix;
+  size_t prefix_len;
+  int i, n_submounts;
 
-  mountinfo = load_file ("/proc/self/mountinfo");
-  if (mountinfo == NULL)
+  if (!load_mount_tab ())
     return NULL;
 
-  submounts_size = 8;
-  n_submounts = 0;
-  submounts = xmalloc (sizeof (char *) * submounts_size);
+  abs_parent = make_absolute (parent_mount);
+  prefix = strconcat (abs_parent, "/");
+  prefix_len = strlen (prefix);
+  free (abs_parent);
 
-  line = mountinfo;
+  /* All mounts below the parent are next to each other in the sorted table */
+  i = mount_tab_lower_bound (prefix);
 
-  while (*line != 0)
+  submounts = xmalloc (sizeof (char *) * (n_mount_tab - i + 1));
+  n_submounts = 0;
+
+  for (; i < n_mount_tab; i++)
     {
-      char *unescaped;
-      for (i = 0; i < 4; i++)
-        line = skip_token (line, TRUE);
-      mountpoint = line;
-      line = skip_token (line, FALSE);
-      mountpoint_end = line;
-      line = skip_line (line);
-      *mountpoint_end = 0;
+      if (strncmp (mount_tab[i].mountpoint, prefix, prefix_len) != 0)
+        break;
+
+      submounts[n_submounts++] = xstrdup (mount_tab[i].mountpoint);
+    }
+
+  submounts[n_submounts] = NULL;
+
+  free (prefix);
+
+  return submounts;
+}
+
+/* The new mount API (open_tree, move_mount and mount_setattr) lets us
+   create a bind mount with all its flags set, recursively, in three
+   syscalls. mount_setattr needs Linux 5.12, on older kernels we fall
+   back to bind mounting and remounting each submount. */
+
+/* Syscalls added since Linux 5.1 have the same number on these
+   architectures, elsewhere (alpha, ia64, mips, x32, arm oabi) we only
+   use them if the headers know about them. */
+#if (defined(__x86_64__) && !defined(__ILP32__)) || defined(__i386__) || \
+    defined(__aarch64__) || (defined(__arm__) && defined(__ARM_EABI__)) || \
+    defined(__powerpc__) || defined(__s390__) || defined(__riscv)
+#define HAVE_COMMON_SYSCALL_NUMBERS 1
+#endif
+
+#ifdef HAVE_COMMON_SYSCALL_NUMBERS
+#ifndef __NR_open_tree
+#define __NR_open_tree 428
+#endif
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+#ifndef __NR_mount_setattr
+#define __NR_mount_setattr 442
+#endif
+#endif
+
+#if defined(__NR_open_tree) && defined(__NR_move_mount) && defined(__NR_mount_setattr)
+#define HAVE_NEW_MOUNT_API 1
+
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#endif
+#ifndef MOUNT_ATTR_NOSUID
+#define MOUNT_ATTR_NOSUID 0x00000002
+#endif
+#ifndef MOUNT_ATTR_NODEV
+#define MOUNT_ATTR_NODEV 0x00000004
+#endif
+
+/* Same layout as struct mount_attr, which older headers don't have */
+typedef struct {
+  uint64_t attr_set;
+  uint64_t attr_clr;
+  uint64_t propagation;
+  uint64_t userns_fd;
+} mount_attr_t;
+
+static bool have_new_mount_api = TRUE;
+#endif
+
+/* Number of mount related syscalls done by bind_mount(), for --timing */
+static int n_mount_syscalls = 0;
 
-      unescaped = unescape_string (mountpoint, -1);
+#ifdef HAVE_NEW_MOUNT_API
+/* Returns -1 if the new mount API is not available, otherwise the
+   bind_mount() result */
+static int
+bind_mount_new_api (const char *src, const char *dest,
+                    bool readonly, bool private, bool devices, bool recursive)
+{
+  mount_attr_t attr = { 0 };
+  int fd, errsv;
 
-      if (*unescaped == '/' &&
-          str_has_prefix (unescaped + 1, parent_mount) &&
-          *(unescaped + 1 + strlen (parent_mount)) == '/')
+  n_mount_syscalls++;
+  fd = syscall (__NR_open_tree, AT_FDCWD, src,
+                OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | (recursive ? AT_RECURSIVE : 0));
+  if (fd == -1)
+    {
+      /* Container seccomp profiles often return EPERM for unknown syscalls */
+      if (errno == ENOSYS || errno == EPERM)
         {
-          if (n_submounts + 1 >= submounts_size)
-            {
-              submounts_size *= 2;
-              submounts = xrealloc (submounts, sizeof (char *) * submounts_size);
-            }
-          submounts[n_submounts++] = xstrdup (unescaped + 1);
+          have_new_mount_api = FALSE;
+          return -1;
         }
-      free (unescaped);
+      return 1;
     }
 
-  submounts[n_submounts] = NULL;
+  attr.attr_set = MOUNT_ATTR_NOSUID | (devices ? 0 : MOUNT_ATTR_NODEV) | (readonly ? MOUNT_ATTR_RDONLY : 0);
+  attr.propagation = private ? MS_PRIVATE : 0;
 
-  free (mountinfo);
+  n_mount_syscalls++;
+  if (syscall (__NR_mount_setattr, fd, "", AT_EMPTY_PATH | (recursive ? AT_RECURSIVE : 0),
+               &attr, sizeof (attr)) != 0)
+    {
+      errsv = errno;
+      close (fd);
+      if (errsv == ENOSYS || errsv == EPERM || errsv == EINVAL)
+        {
+          have_new_mount_api = FALSE;
+          return -1;
+        }
+      errno = errsv;
+      return 3;
+    }
 
-  return submounts;
+  n_mount_syscalls++;
+  if (syscall (__NR_move_mount, fd, "", AT_FDCWD, dest, MOVE_MOUNT_F_EMPTY_PATH) != 0)
+    {
+      errsv = errno;
+      close (fd);
+      errno = errsv;
+      return 1;
+    }
+
+  close (fd);
+  return 0;
 }
+#endif
 
 static int
 bind_mount (const char *src, const char *dest, bind_option_t options)
@@ -993,26 +1646,45 @@ bind_mount (const char *src, const char *dest, bind_option_t options)
   bool private = (options & BIND_PRIVATE) != 0;
   bool devices = (options & BIND_DEVICES) != 0;
   bool recursive = (options & BIND_RECURSIVE) != 0;
-  unsigned long current_flags;
+  unsigned long current_flags, new_flags;
   char **submounts;
   int i;
 
+#ifdef HAVE_NEW_MOUNT_API
+  if (have_new_mount_api)
+    {
+      int res = bind_mount_new_api (src, dest, readonly, private, devices, recursive);
+      if (res == 0)
+        record_bind_mount (src, dest, (devices?0:MS_NODEV)|MS_NOSUID|(readonly?MS_RDONLY:0), recursive);
+      if (res != -1)
+        return res;
+    }
+#endif
+
+  n_mount_syscalls++;
   if (mount (src, dest, NULL, MS_MGC_VAL|MS_BIND|(recursive?MS_REC:0), NULL) != 0)
     return 1;
 
+  record_bind_mount (src, dest, 0, recursive);
+
   if (private)
     {
+      n_mount_syscalls++;
       if (mount ("none", dest,
                  NULL, MS_REC|MS_PRIVATE, NULL) != 0)
         return 2;
     }
 
   current_flags = get_mountflags (dest);
+  new_flags = current_flags|(devices?0:MS_NODEV)|MS_NOSUID|(readonly?MS_RDONLY:0);
 
+  n_mount_syscalls++;
   if (mount ("none", dest,
-             NULL, MS_MGC_VAL|MS_BIND|MS_REMOUNT|current_flags|(devices?0:MS_NODEV)|MS_NOSUID|(readonly?MS_RDONLY:0), NULL) != 0)
+             NULL, MS_MGC_VAL|MS_BIND|MS_REMOUNT|new_flags, NULL) != 0)
     return 3;
 
+  set_mountflags (dest, new_flags);
+
   /* We need to work around the fact that a bind mount does not apply the flags, so we need to manually
    * apply the flags to all submounts in the recursive case.
    * Note: This does not apply the flags to mounts which are later propagated into this namespace.
@@ -1026,9 +1698,12 @@ bind_mount (const char *src, const char *dest, bind_option_t options)
       for (i = 0; submounts[i] != NULL; i++)
         {
           current_flags = get_mountflags (submounts[i]);
+          new_flags = current_flags|(devices?0:MS_NODEV)|MS_NOSUID|(readonly?MS_RDONLY:0);
+          n_mount_syscalls++;
           if (mount ("none", submounts[i],
-                     NULL, MS_MGC_VAL|MS_BIND|MS_REMOUNT|current_flags|(devices?0:MS_NODEV)|MS_NOSUID|(readonly?MS_RDONLY:0), NULL) != 0)
+                     NULL, MS_MGC_VAL|MS_BIND|MS_REMOUNT|new_flags, NULL) != 0)
             return 5;
+          set_mountflags (submounts[i], new_flags);
           free (submounts[i]);
         }
 
@@ -1403,6 +2078,7 @@ create_files (const create_table_t *create, int n_create, int ignore_shm, const
                             mount_table[k].flags,
                             mount_table[k].options) < 0)
                     die_with_error ("Mounting %s", name);
+                  record_mount (name, mount_table[k].flags);
                   found = TRUE;
                 }
             }
@@ -1417,6 +2093,7 @@ create_files (const create_table_t *create, int n_create, int ignore_shm, const
           if (mount ("none", name,
                      NULL, MS_MGC_VAL|MS_REMOUNT|current_mount_flags|mode, NULL) != 0)
             die_with_error ("Unable to remount %s\n", name);
+          set_mountflags (name, current_mount_flags|mode);
 
           break;
 
@@ -1444,60 +2121,98 @@ create_files (const create_table_t *create, int n_create, int ignore_shm, const
     }
 }
 
+static char *
+readlinkat_malloc (int dir_fd, const char *name)
+{
+  size_t size = 256;
+
+  while (TRUE)
+    {
+      char *target = xmalloc (size);
+      ssize_t r;
+
+      r = readlinkat (dir_fd, name, target, size);
+      if (r == -1)
+        die_with_error ("readlink %s", name);
+      if ((size_t) r < size)
+        {
+          target[r] = 0;
+          return target;
+        }
+
+      free (target);
+      size *= 2;
+    }
+}
+
+/* Symlinks every entry of the runtime's /usr/etc into /etc, except the
+ * ones we already created there. Only the top level is linked, whole
+ * subdirectories come along with their symlink.
+ *
+ * /etc is not bound as a whole from /usr/etc here. passwd and group are
+ * generated, and machine-id and resolv.conf are bound from the host,
+ * so they need a writable /etc. The read-only runtime may also have no
+ * mount points for them. Runtimes that don't need these overrides use
+ * -E, which makes /etc a single symlink to /usr/etc.
+ *
+ * To keep this cheap on runtimes with a large /etc we use the dirent
+ * type instead of stating each entry, and let symlinkat() tell us about
+ * existing entries via EEXIST rather than checking for them first. This
+ * is one syscall per entry, two for symlinks. */
 static void
 link_extra_etc_dirs ()
 {
   DIR *dir;
   struct dirent *dirent;
+  int usr_etc_fd, etc_fd;
+  int n_links = 0;
+
+  dir = opendir ("usr/etc");
+  if (dir == NULL)
+    return;
+
+  usr_etc_fd = dirfd (dir);
+  etc_fd = open ("etc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (etc_fd == -1)
+    die_with_error ("open etc");
 
-  dir = opendir("usr/etc");
-  if (dir != NULL)
+  while ((dirent = readdir (dir)))
     {
-      while ((dirent = readdir(dir)))
+      unsigned char type = dirent->d_type;
+      char *target;
+
+      if (strcmp (dirent->d_name, ".") == 0 ||
+          strcmp (dirent->d_name, "..") == 0)
+        continue;
+
+      if (type == DT_UNKNOWN)
         {
-          char *dst_path;
-          char *src_path;
-          char *target;
           struct stat st;
 
-          src_path = strconcat ("etc/", dirent->d_name);
-          if (lstat (src_path, &st) == 0)
-            {
-              free (src_path);
-              continue;
-            }
+          if (fstatat (usr_etc_fd, dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+          type = S_ISLNK (st.st_mode) ? DT_LNK : DT_REG;
+        }
 
-          dst_path = strconcat ("usr/etc/", dirent->d_name);
-          if (lstat (dst_path, &st) != 0)
-            {
-              free (src_path);
-              free (dst_path);
-              continue;
-            }
+      /* For symlinks we copy the actual symlink value, to correctly handle
+         things like /etc/localtime symlinks */
+      if (type == DT_LNK)
+        target = readlinkat_malloc (usr_etc_fd, dirent->d_name);
+      else
+        target = strconcat ("/usr/etc/", dirent->d_name);
 
-          /* For symlinks we copy the actual symlink value, to correctly handle
-             things like /etc/localtime symlinks */
-          if (S_ISLNK (st.st_mode))
-            {
-              ssize_t r;
+      if (symlinkat (target, etc_fd, dirent->d_name) == 0)
+        n_links++;
+      else if (errno != EEXIST)
+        die_with_error ("symlink etc/%s", dirent->d_name);
 
-              target = xmalloc (st.st_size + 1);
-              r = readlink (dst_path, target, st.st_size);
-              if (r == -1)
-                die_with_error ("readlink %s", dst_path);
-              target[r] = 0;
-            }
-          else
-            target = strconcat ("/usr/etc/", dirent->d_name);
+      free (target);
+    }
 
-          if (symlink (target, src_path) != 0)
-            die_with_error ("symlink %s", src_path);
+  close (etc_fd);
+  closedir (dir);
 
-          free (dst_path);
-          free (src_path);
-          free (target);
-        }
-    }
+  timing_count ("etc-links", n_links);
 }
 
 static void
@@ -1505,64 +2220,72 @@ mount_extra_root_dirs (int readonly)
 {
   DIR *dir;
   struct dirent *dirent;
+  int root_fd;
   int i;
 
-  /* Bind mount most dirs in / into the new root */
-  dir = opendir("/");
-  if (dir != NULL)
-    {
-      while ((dirent = readdir(dir)))
-        {
-          bool dont_mount = FALSE;
-          char *path;
-          struct stat st;
-
-          for (i = 0; i < N_ELEMENTS(dont_mount_in_root); i++)
-            {
-              if (strcmp (dirent->d_name, dont_mount_in_root[i]) == 0)
-                {
-                  dont_mount = TRUE;
-                  break;
-                }
-            }
+  /* Bind mount most dirs in / into the new root. Each directory is
+   * bound as a whole (recursively), so nested mounts cost nothing
+   * extra here, and like for /etc we go by the dirent type to avoid
+   * stating every entry in / */
+  dir = opendir ("/");
+  if (dir == NULL)
+    return;
 
-          if (dont_mount)
-            continue;
+  root_fd = dirfd (dir);
 
-          path = strconcat ("/", dirent->d_name);
+  while ((dirent = readdir (dir)))
+    {
+      bool dont_mount = FALSE;
+      unsigned char type = dirent->d_type;
+      char *path;
 
-          if (lstat (path, &st) != 0)
+      for (i = 0; i < N_ELEMENTS(dont_mount_in_root); i++)
+        {
+          if (strcmp (dirent->d_name, dont_mount_in_root[i]) == 0)
             {
-              free (path);
-              continue;
+              dont_mount = TRUE;
+              break;
             }
+        }
 
-          if (S_ISDIR(st.st_mode))
-            {
-              if (mkdir (dirent->d_name, 0755) != 0)
-                die_with_error (dirent->d_name);
+      if (dont_mount)
+        continue;
 
-              if (bind_mount (path, dirent->d_name, BIND_RECURSIVE | (readonly ? BIND_READONLY : 0)))
-                die_with_error ("mount root subdir %s", dirent->d_name);
-            }
-          else if (S_ISLNK(st.st_mode))
-            {
-              ssize_t r;
-              char *target;
+      if (type == DT_UNKNOWN)
+        {
+          struct stat st;
 
-              target = xmalloc (st.st_size + 1);
-              r = readlink (path, target, st.st_size);
-              if (r == -1)
-                die_with_error ("readlink %s", path);
-              target[r] = 0;
+          if (fstatat (root_fd, dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
 
-              if (symlink (target, dirent->d_name) != 0)
-                die_with_error ("symlink %s %s", target, dirent->d_name);
-            }
+          if (S_ISDIR (st.st_mode))
+            type = DT_DIR;
+          else if (S_ISLNK (st.st_mode))
+            type = DT_LNK;
+        }
+
+      if (type == DT_DIR)
+        {
+          if (mkdir (dirent->d_name, 0755) != 0)
+            die_with_error (dirent->d_name);
 
+          path = strconcat ("/", dirent->d_name);
+          if (bind_mount (path, dirent->d_name, BIND_RECURSIVE | (readonly ? BIND_READONLY : 0)))
+            die_with_error ("mount root subdir %s", dirent->d_name);
           free (path);
         }
+      else if (type == DT_LNK)
+        {
+          char *target;
+
+          target = readlinkat_malloc (root_fd, dirent->d_name);
+          if (symlink (target, dirent->d_name) != 0)
+            die_with_error ("symlink %s %s", target, dirent->d_name);
+          free (target);
+        }
     }
+
+  closedir (dir);
 }
 
 static void
@@ -1819,19 +2542,48 @@ close_extra_fds (void *data, int fd)
   return 0;
 }
 
+#if defined(HAVE_COMMON_SYSCALL_NUMBERS) && !defined(__NR_pidfd_open)
+#define __NR_pidfd_open 434
+#endif
+
+static int
+pidfd_open (pid_t pid)
+{
+#ifdef __NR_pidfd_open
+  return syscall (__NR_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* Exit status of a shell-like launcher for a child with wait STATUS */
+static int
+propagate_exit_status (int status)
+{
+  if (WIFEXITED (status))
+    return WEXITSTATUS (status);
+  if (WIFSIGNALED (status))
+    return 128 + WTERMSIG (status);
+  return 1;
+}
+
 /* This stays around for as long as the initial process in the app does
  * and when that exits it exits, propagating the exit status. We do this
  * by having pid1 in the sandbox detect this exit and tell the monitor
  * the exit status via a eventfd. We also track the exit of the sandbox
- * pid1 via a signalfd for SIGCHLD, and exit with an error in this case.
- * This is to catch e.g. problems during setup. */
+ * pid1 itself, via a pidfd or, on kernels before 5.3, a signalfd for
+ * SIGCHLD, and exit with its status in this case. That catches problems
+ * during setup, and is how the status of the app is returned when it
+ * runs as pid1 without an init. */
 static void
-monitor_child (int event_fd)
+monitor_child (int event_fd, pid_t child_pid)
 {
   int res;
   uint64_t val;
   ssize_t s;
-  int signal_fd;
+  int child_fd;
+  bool have_pidfd = TRUE;
   sigset_t mask;
   struct pollfd fds[2];
   struct signalfd_siginfo fdsi;
@@ -1841,20 +2593,28 @@ monitor_child (int event_fd)
      Any passed in fds have been passed on to the child anyway. */
   fdwalk (close_extra_fds, dont_close);
 
-  sigemptyset (&mask);
-  sigaddset (&mask, SIGCHLD);
+  child_fd = pidfd_open (child_pid);
+  if (child_fd == -1)
+    {
+      have_pidfd = FALSE;
+
+      sigemptyset (&mask);
+      sigaddset (&mask, SIGCHLD);
 
-  signal_fd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
-  if (signal_fd == -1)
-    die_with_error ("signalfd");
+      child_fd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+      if (child_fd == -1)
+        die_with_error ("signalfd");
+    }
 
   fds[0].fd = event_fd;
   fds[0].events = POLLIN;
-  fds[1].fd = signal_fd;
+  fds[1].fd = child_fd;
   fds[1].events = POLLIN;
 
   while (1)
     {
+      int status;
+
       fds[0].revents = fds[1].revents = 0;
       res = poll (fds, 2, -1);
       if (res == -1 && errno != EINTR)
@@ -1866,15 +2626,20 @@ monitor_child (int event_fd)
       else if (s == 8)
 	exit ((int)val - 1);
 
-      s = read (signal_fd, &fdsi, sizeof (struct signalfd_siginfo));
-      if (s == -1 && errno != EINTR && errno != EAGAIN)
-	die_with_error ("read signalfd");
-      else if (s == sizeof(struct signalfd_siginfo))
-	{
-	  if (fdsi.ssi_signo != SIGCHLD)
-	      die ("Read unexpected signal\n");
-	  exit (1);
-	}
+      if (fds[1].revents == 0)
+        continue;
+
+      /* The signalfd also triggers when the child is stopped, so
+         consume the signal and check whether it actually exited */
+      if (!have_pidfd)
+        {
+          s = read (child_fd, &fdsi, sizeof (struct signalfd_siginfo));
+          if (s == -1 && errno != EINTR && errno != EAGAIN)
+            die_with_error ("read signalfd");
+        }
+
+      if (waitpid (child_pid, &status, WNOHANG) == child_pid)
+        exit (propagate_exit_status (status));
     }
 }
 
@@ -1884,7 +2649,12 @@ monitor_child (int event_fd)
  * the monitor so that it can return it to the original spawner.
  *
  * When there are no other processes in the sandbox the wait will return
- *  ECHILD, and we then exit pid1 to clean up the sandbox. */
+ *  ECHILD, and we then exit pid1 to clean up the sandbox.
+ *
+ * The monitor watches this process through a pidfd, so if we die
+ * before reporting the status of the initial process, the monitor
+ * exits with our status rather than waiting forever. In no-init mode
+ * there is no such process, and the pidfd watches the app itself. */
 static int
 do_init (int event_fd, pid_t initial_pid)
 {
@@ -1893,7 +2663,7 @@ do_init (int event_fd, pid_t initial_pid)
   /* Grab a read on all .ref files to make it possible to detect that
      it is in use. This lock will automatically go away when this
      process dies */
-  lock_all_dirs ();
+  lock_all_dirs (FALSE);
 
   while (1)
     {
@@ -1905,8 +2675,7 @@ do_init (int event_fd, pid_t initial_pid)
 	{
 	  uint64_t val;
 
-	  if (WIFEXITED (status))
-	    initial_exit_status = WEXITSTATUS(status);
+	  initial_exit_status = propagate_exit_status (status);
 
 	  val = initial_exit_status + 1;
 	  write (event_fd, &val, 8);
@@ -2030,6 +2799,8 @@ main (int argc,
   bool writable = FALSE;
   bool writable_app = FALSE;
   bool writable_exports = FALSE;
+  bool generate_seccomp = FALSE;
+  bool no_init = FALSE;
   char *old_cwd = NULL;
   int c, i;
   pid_t pid;
@@ -2048,7 +2819,10 @@ main (int argc,
 
   clean_argv (argc, argv);
 
-  while ((c =  getopt (argc, argv, "+inWwceEsfFHhra:m:M:b:B:p:x:ly:d:D:v:I:gS:")) >= 0)
+  timing_init ();
+  timing_mark ("start");
+
+  while ((c =  getopt (argc, argv, "+inNWwceEGsfFHhra:m:M:b:B:C:p:x:ly:d:D:v:I:gS:")) >= 0)
     {
       switch (c)
         {
@@ -2097,6 +2871,31 @@ main (int argc,
           add_extra_file (tmp, optarg, c == 'b', c == 'M');
           break;
 
+        case 'C':
+          /* Format: DEST=FD */
+          tmp = strchr (optarg, '=');
+          if (tmp == NULL || tmp[1] == 0)
+            usage (argv);
+          *tmp = 0;
+          tmp = tmp + 1;
+
+          if (optarg[0] != '/')
+            die ("Extra files must be absolute paths");
+
+          while (*optarg == '/')
+            optarg++;
+
+          if (*optarg == 0)
+            die ("Extra files must not be root");
+
+          {
+            int fd = strtol (tmp, &endp, 10);
+            if (endp == tmp || *endp != 0 || fd < 0)
+              die ("Invalid fd argument");
+            add_extra_fd (fd, optarg);
+          }
+          break;
+
         case 'd':
           session_dbus_socket = optarg;
           break;
@@ -2127,6 +2926,10 @@ main (int argc,
           allow_dri = TRUE;
           break;
 
+        case 'G':
+          generate_seccomp = TRUE;
+          break;
+
         case 'H':
           mount_home = TRUE;
           break;
@@ -2156,6 +2959,10 @@ main (int argc,
           network = TRUE;
           break;
 
+        case 'N':
+          no_init = TRUE;
+          break;
+
         case 'p':
           pulseaudio_socket = optarg;
           break;
@@ -2199,6 +3006,19 @@ main (int argc,
       }
     }
 
+  if (generate_seccomp)
+    {
+#ifdef ENABLE_SECCOMP
+      if (getuid () != 0)
+        die ("Only root can generate the seccomp cache");
+      if (mkdir_with_parents (SECCOMP_CACHE_DIR, 0755, TRUE))
+        die_with_error ("Creating %s failed", SECCOMP_CACHE_DIR);
+      if (!write_seccomp_cache (FALSE) || !write_seccomp_cache (TRUE))
+        die_with_error ("Writing seccomp cache failed");
+#endif
+      exit (0);
+    }
+
   args = &argv[optind];
   n_args = argc - optind;
 
@@ -2215,6 +3035,12 @@ main (int argc,
   args++;
   n_args--;
 
+#ifdef ENABLE_SECCOMP
+  load_seccomp_cache (devel);
+#endif
+
+  timing_mark ("parse-args");
+
   /* The initial code is run with high permissions
      (at least CAP_SYS_ADMIN), so take lots of care. */
 
@@ -2252,7 +3078,7 @@ main (int argc,
     {
       if (app_id)
         set_procname (strdup_printf ("xdg-app-helper %s launcher", app_id));
-      monitor_child (event_fd);
+      monitor_child (event_fd, pid);
       exit (0); /* Should not be reached, but better safe... */
     }
 
@@ -2278,6 +3104,8 @@ main (int argc,
   }
 #endif
 
+  timing_mark ("namespace");
+
   old_umask = umask (0);
 
   /* Mark everything as slave, so that we still
@@ -2339,6 +3167,8 @@ main (int argc,
   if (create_etc_dir)
     link_extra_etc_dirs ();
 
+  timing_mark ("root-mounts");
+
   if (monitor_path)
     {
       char *monitor_mount_path = strdup_printf ("run/user/%d/xdg-app-monitor", uid);
@@ -2442,6 +3272,8 @@ main (int argc,
       free (session_dbus_address);
    }
 
+  timing_mark ("sockets");
+
   if (mount_host_fs)
     {
       mount_extra_root_dirs (mount_host_fs_ro);
@@ -2474,10 +3306,31 @@ main (int argc,
       free (dconf_run_path);
     }
 
+  timing_mark ("home");
+
   for (i = 0; i < n_extra_files; i++)
     {
       bool is_dir;
 
+      if (extra_files[i].fd != -1)
+        {
+          int dfd;
+
+          if (mkdir_with_parents (extra_files[i].dest, 0755, FALSE))
+            die_with_error ("create extra dir %s", extra_files[i].dest);
+
+          dfd = creat (extra_files[i].dest, 0700);
+          if (dfd == -1 ||
+              lseek (extra_files[i].fd, 0, SEEK_SET) == -1 ||
+              !copy_file_data (extra_files[i].fd, dfd))
+            die_with_error ("copy extra file %s", extra_files[i].dest);
+
+          close (dfd);
+          /* Don't leak it into the sandbox */
+          close (extra_files[i].fd);
+          continue;
+        }
+
       is_dir = stat_is_dir (extra_files[i].src);
 
       if (mkdir_with_parents (extra_files[i].dest, 0755,
@@ -2504,8 +3357,13 @@ main (int argc,
         }
     }
 
+  timing_mark ("extra-files");
+
   if (!network)
-    loopback_setup ();
+    {
+      loopback_setup ();
+      timing_mark ("loopback");
+    }
 
   if (pivot_root (newroot, ".oldroot"))
     die_with_error ("pivot_root");
@@ -2521,6 +3379,8 @@ main (int argc,
 
   umask (old_umask);
 
+  timing_mark ("pivot-root");
+
 #ifdef DISABLE_USERNS
   /* Now we have everything we need CAP_SYS_ADMIN for, so drop it */
   drop_caps ();
@@ -2562,16 +3422,29 @@ main (int argc,
       free (tz_val);
     }
 
-  __debug__(("forking for child\n"));
+  /* Without an init we exec the command directly as pid 1. This saves
+     a fork, but nothing reaps orphaned processes and, as for any pid 1,
+     signals the command has no handler for are ignored, so it is only
+     useful for short-lived tools. The monitor outside picks up the exit
+     status of the command when pid 1 exits. */
+  if (no_init)
+    pid = 0;
+  else
+    {
+      __debug__(("forking for child\n"));
 
-  pid = fork ();
-  if (pid == -1)
-    die_with_error("Can't fork for child");
+      pid = fork ();
+      if (pid == -1)
+        die_with_error("Can't fork for child");
+    }
 
   if (pid == 0)
     {
       __debug__(("launch executable %s\n", args[0]));
 
+      if (no_init)
+        lock_all_dirs (TRUE);
+
 #ifndef DISABLE_USERNS
       {
         char *uid_map, *gid_map;
@@ -2595,12 +3468,16 @@ main (int argc,
 
       __debug__(("setting up seccomp in child\n"));
       setup_seccomp (devel);
+      timing_mark ("seccomp");
 
       if (sync_fd != -1)
 	close (sync_fd);
 
       unblock_sigchild ();
 
+      timing_mark ("exec");
+      timing_count ("mount-syscalls", n_mount_syscalls);
+
       if (execvp (args[0], args) == -1)
         die_with_error ("execvp %s", args[0]);
       return 0;
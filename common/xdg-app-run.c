@@ -1722,6 +1722,16 @@ struct JobData {
   GMainLoop *main_loop;
 };
 
+static gboolean
+job_timeout_cb (gpointer user_data)
+{
+  struct JobData *data = user_data;
+
+  g_warning ("Timed out waiting for transient unit\n");
+  g_main_loop_quit (data->main_loop);
+  return G_SOURCE_REMOVE;
+}
+
 static void
 job_removed_cb (SystemdManager *manager,
                 guint32 id,
@@ -1750,6 +1760,7 @@ xdg_app_run_in_transient_unit (const char *appid)
   guint32 pid;
   GMainContext *main_context = NULL;
   GMainLoop *main_loop = NULL;
+  GSource *timeout = NULL;
   struct JobData data;
 
   path = g_strdup_printf ("/run/user/%d/systemd/private", getuid());
@@ -1818,9 +1829,19 @@ xdg_app_run_in_transient_unit (const char *appid)
   data.main_loop = main_loop;
   g_signal_connect (manager,"job-removed", G_CALLBACK (job_removed_cb), &data);
 
+  /* Don't hang the launch if systemd never reports the job as done */
+  timeout = g_timeout_source_new_seconds (5);
+  g_source_set_callback (timeout, job_timeout_cb, &data, NULL);
+  g_source_attach (timeout, main_context);
+
   g_main_loop_run (main_loop);
 
  out:
+  if (timeout)
+    {
+      g_source_destroy (timeout);
+      g_source_unref (timeout);
+    }
   if (main_context)
     {
       g_main_context_pop_thread_default (main_context);
@@ -32,6 +32,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
+#include <unistd.h>
 
 #include <glib.h>
 #include "libgsystem.h"
@@ -55,6 +56,22 @@ xdg_app_fail (GError **error, const char *format, ...)
   return FALSE;
 }
 
+static gboolean debug_enabled = FALSE;
+
+/* Called when --verbose shows debug messages, so that work that only
+   feeds a g_debug() can be skipped otherwise */
+void
+xdg_app_set_debug_enabled (gboolean enabled)
+{
+  debug_enabled = enabled;
+}
+
+gboolean
+xdg_app_debug_enabled (void)
+{
+  return debug_enabled || g_getenv ("G_MESSAGES_DEBUG") != NULL;
+}
+
 const char *
 xdg_app_get_arch (void)
 {
@@ -629,50 +646,382 @@ xdg_app_remove_dangling_symlinks (GFile    *dir,
   return ret;
 }
 
+typedef struct {
+  GMutex lock;
+  GCond cond;
+  int pending;
+  GThreadPool *pool;
+  GCancellable *cancellable;
+  GError *error;
+} RmRfData;
+
+static void
+rm_rf_push_dir (RmRfData *data, char *path)
+{
+  g_mutex_lock (&data->lock);
+  data->pending++;
+  g_mutex_unlock (&data->lock);
+
+  g_thread_pool_push (data->pool, path, NULL);
+}
+
+/* Unlinks all non-directories in PATH and queues its subdirectories,
+   the now empty directory tree is removed afterwards */
+static void
+rm_rf_dir_thread (gpointer task_data,
+                  gpointer user_data)
+{
+  g_autofree char *path = task_data;
+  RmRfData *data = user_data;
+  g_auto(GLnxDirFdIterator) iter = {0};
+  struct dirent *dent;
+  GError *local_error = NULL;
+
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, path, FALSE, &iter, &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_clear_error (&local_error);
+      goto out;
+    }
+
+  while (TRUE)
+    {
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, data->cancellable, &local_error))
+        goto out;
+
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type == DT_UNKNOWN)
+        {
+          struct stat stbuf;
+
+          if (fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+              if (errno == ENOENT)
+                continue;
+              glnx_set_error_from_errno (&local_error);
+              goto out;
+            }
+
+          if (S_ISDIR (stbuf.st_mode))
+            dent->d_type = DT_DIR;
+        }
+
+      if (dent->d_type == DT_DIR)
+        rm_rf_push_dir (data, g_build_filename (path, dent->d_name, NULL));
+      else if (unlinkat (iter.fd, dent->d_name, 0) != 0 && errno != ENOENT)
+        {
+          glnx_set_error_from_errno (&local_error);
+          goto out;
+        }
+    }
+
+ out:
+  g_mutex_lock (&data->lock);
+  if (local_error != NULL)
+    {
+      if (data->error == NULL)
+        data->error = local_error;
+      else
+        g_error_free (local_error);
+    }
+  if (--data->pending == 0)
+    g_cond_signal (&data->cond);
+  g_mutex_unlock (&data->lock);
+}
+
+/* Like gs_shutil_rm_rf(), but unlinks the files from several threads,
+ * which is a lot faster for large trees like runtimes. */
+gboolean
+xdg_app_rm_rf_parallel (GFile         *dir,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  RmRfData data = { { 0 }, };
+  gboolean ret = FALSE;
+
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+  data.cancellable = cancellable;
+
+  data.pool = g_thread_pool_new (rm_rf_dir_thread, &data, g_get_num_processors (), FALSE, error);
+  if (data.pool == NULL)
+    goto out;
+
+  rm_rf_push_dir (&data, g_file_get_path (dir));
+
+  g_mutex_lock (&data.lock);
+  while (data.pending > 0)
+    g_cond_wait (&data.cond, &data.lock);
+  g_mutex_unlock (&data.lock);
+
+  g_thread_pool_free (data.pool, FALSE, TRUE);
+
+  if (data.error != NULL)
+    {
+      g_propagate_error (error, data.error);
+      goto out;
+    }
+
+  /* Only directories are left now */
+  if (!gs_shutil_rm_rf (dir, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+ out:
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
+  return ret;
+}
+
+static SoupSession *
+get_soup_session (void)
+{
+  static gsize initialized = 0;
+  static SoupSession *session = NULL;
+
+  if (g_once_init_enter (&initialized))
+    {
+      session = soup_session_new ();
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return session;
+}
+
+static GVariant *
+map_summary (const char *path, GError **error)
+{
+  GMappedFile *mfile;
+  g_autoptr(GBytes) bytes = NULL;
+
+  mfile = g_mapped_file_new (path, FALSE, error);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  g_mapped_file_unref (mfile);
+
+  return g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT, bytes, FALSE));
+}
+
 static gboolean
-load_contents (const char *uri, GBytes **contents, GCancellable *cancellable, GError **error)
+save_summary_cache (const char   *cache_path,
+                    const char   *meta_path,
+                    SoupMessage  *msg,
+                    GError      **error)
+{
+  g_autoptr(GKeyFile) meta = NULL;
+  g_autofree char *cache_dir = NULL;
+  g_autofree char *meta_data = NULL;
+  gsize meta_len;
+  const char *etag;
+  const char *last_modified;
+
+  etag = soup_message_headers_get_one (msg->response_headers, "ETag");
+  last_modified = soup_message_headers_get_one (msg->response_headers, "Last-Modified");
+
+  cache_dir = g_path_get_dirname (cache_path);
+  if (g_mkdir_with_parents (cache_dir, 0755) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  /* Drop the validators first, so that a crash can never pair them
+     with a summary they don't belong to */
+  if (unlink (meta_path) != 0 && errno != ENOENT)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  if (!g_file_set_contents (cache_path, msg->response_body->data, msg->response_body->length, error))
+    return FALSE;
+
+  if (etag == NULL && last_modified == NULL)
+    return TRUE;
+
+  meta = g_key_file_new ();
+  if (etag)
+    g_key_file_set_string (meta, "Summary", "ETag", etag);
+  if (last_modified)
+    g_key_file_set_string (meta, "Summary", "Last-Modified", last_modified);
+
+  meta_data = g_key_file_to_data (meta, &meta_len, NULL);
+  return g_file_set_contents (meta_path, meta_data, meta_len, error);
+}
+
+/* Loads the summary of the repository at @repository_url. Local (file:)
+ * summaries are mapped directly. For remote ones, if @cache_file is not
+ * NULL, the last downloaded copy is kept there with its ETag and
+ * Last-Modified headers next to it in CACHE_FILE.meta, and the server is
+ * only asked for a newer copy. The cached copy is only used when the
+ * server says it is current, so with a @cache_file failing to reach the
+ * server is an error. Without one, as when adding a remote, it is
+ * treated like a missing summary. *out_summary is set to NULL if the
+ * repository has no summary. */
+gboolean
+xdg_app_load_summary (const char   *repository_url,
+                      GFile        *cache_file,
+                      GVariant    **out_summary,
+                      GCancellable *cancellable,
+                      GError      **error)
 {
   gboolean ret = FALSE;
+  g_autofree char *summary_url = NULL;
   g_autofree char *scheme = NULL;
+  g_autoptr(GVariant) summary = NULL;
 
-  scheme = g_uri_parse_scheme (uri);
-  if (strcmp (scheme, "file") == 0)
+  summary_url = g_build_filename (repository_url, "summary", NULL);
+  scheme = g_uri_parse_scheme (summary_url);
+
+  if (scheme != NULL && strcmp (scheme, "file") == 0)
     {
-      char *buffer;
-      gsize length;
       g_autoptr(GFile) file = NULL;
+      g_autofree char *path = NULL;
+      g_autoptr(GError) my_error = NULL;
 
-      g_debug ("Loading summary %s using GIO", uri);
-      file = g_file_new_for_uri (uri);
-      if (!g_file_load_contents (file, cancellable, &buffer, &length, NULL, NULL))
-        goto out;
+      file = g_file_new_for_uri (summary_url);
+      path = g_file_get_path (file);
 
-      *contents = g_bytes_new_take (buffer, length);
+      g_debug ("Mapping summary %s", path);
+      summary = map_summary (path, &my_error);
+      if (summary == NULL &&
+          !g_error_matches (my_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_propagate_error (error, g_steal_pointer (&my_error));
+          goto out;
+        }
     }
   else
     {
-      g_autoptr(SoupSession) session = NULL;
       g_autoptr(SoupMessage) msg = NULL;
+      g_autofree char *cache_path = NULL;
+      g_autofree char *meta_path = NULL;
+      gboolean have_cache = FALSE;
 
-      g_debug ("Loading summary %s using libsoup", uri);
-      session = soup_session_new ();
-      msg = soup_message_new ("GET", uri);
-      soup_session_send_message (session, msg);
+      msg = soup_message_new ("GET", summary_url);
+      if (msg == NULL)
+        {
+          xdg_app_fail (error, "Invalid remote url %s", repository_url);
+          goto out;
+        }
 
-      if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
-        goto out;
+      if (cache_file != NULL)
+        {
+          g_autoptr(GKeyFile) meta = g_key_file_new ();
 
-      *contents = g_bytes_new (msg->response_body->data, msg->response_body->length);
-    }
+          cache_path = g_file_get_path (cache_file);
+          meta_path = g_strconcat (cache_path, ".meta", NULL);
+          have_cache = g_file_test (cache_path, G_FILE_TEST_IS_REGULAR);
 
-  ret = TRUE;
+          if (have_cache && g_key_file_load_from_file (meta, meta_path, G_KEY_FILE_NONE, NULL))
+            {
+              g_autofree char *etag = g_key_file_get_string (meta, "Summary", "ETag", NULL);
+              g_autofree char *last_modified = g_key_file_get_string (meta, "Summary", "Last-Modified", NULL);
 
-  g_debug ("Received %" G_GSIZE_FORMAT " bytes", g_bytes_get_size (*contents));
+              if (etag)
+                soup_message_headers_append (msg->request_headers, "If-None-Match", etag);
+              if (last_modified)
+                soup_message_headers_append (msg->request_headers, "If-Modified-Since", last_modified);
+            }
+        }
+
+      g_debug ("Loading summary %s using libsoup", summary_url);
+      soup_session_send_message (get_soup_session (), msg);
 
+      if (msg->status_code == SOUP_STATUS_NOT_MODIFIED && have_cache)
+        {
+          g_debug ("Summary not modified, using %s", cache_path);
+          summary = map_summary (cache_path, error);
+          if (summary == NULL)
+            goto out;
+        }
+      else if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+        {
+          g_autoptr(GBytes) bytes = NULL;
+
+          g_debug ("Received %" G_GOFFSET_FORMAT " bytes", msg->response_body->length);
+
+          if (cache_path != NULL)
+            {
+              g_autoptr(GError) my_error = NULL;
+
+              /* Not being able to write the cache, say for a system
+                 installation as a user, is not fatal */
+              if (!save_summary_cache (cache_path, meta_path, msg, &my_error))
+                g_debug ("Failed to cache summary: %s", my_error->message);
+            }
+
+          bytes = g_bytes_new (msg->response_body->data, msg->response_body->length);
+          summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT, bytes, FALSE));
+        }
+      else if (SOUP_STATUS_IS_TRANSPORT_ERROR (msg->status_code) && cache_file != NULL)
+        {
+          /* Don't fall back to the cache here, a stale summary would
+             make updates look unnecessary */
+          xdg_app_fail (error, "Can't load summary from %s: %s", summary_url, msg->reason_phrase);
+          goto out;
+        }
+      else
+        g_debug ("No summary at %s: %s", summary_url, msg->reason_phrase);
+    }
+
+  *out_summary = g_steal_pointer (&summary);
+
+  ret = TRUE;
 out:
   return ret;
 }
 
+/* The ref list of a summary is sorted, so look refs up by bisection
+ * rather than walking (and converting) all of them. */
+gboolean
+xdg_app_summary_lookup_ref (GVariant   *summary,
+                            const char *ref,
+                            char      **out_checksum)
+{
+  g_autoptr(GVariant) ref_list = NULL;
+  gsize lo, hi;
+
+  ref_list = g_variant_get_child_value (summary, 0);
+
+  lo = 0;
+  hi = g_variant_n_children (ref_list);
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+      g_autoptr(GVariant) child = NULL;
+      const char *name;
+      int cmp;
+
+      child = g_variant_get_child_value (ref_list, mid);
+      g_variant_get_child (child, 0, "&s", &name);
+
+      cmp = strcmp (ref, name);
+      if (cmp == 0)
+        {
+          if (out_checksum)
+            {
+              g_autoptr(GVariant) csum_v = NULL;
+
+              g_variant_get_child (child, 1, "(t@aya{sv})", NULL, &csum_v, NULL);
+              *out_checksum = ostree_checksum_from_bytes_v (csum_v);
+            }
+          return TRUE;
+        }
+
+      if (cmp < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  return FALSE;
+}
+
 gboolean
 ostree_repo_load_summary (const char *repository_url,
                           GHashTable **refs,
@@ -681,23 +1030,22 @@ ostree_repo_load_summary (const char *repository_url,
                           GError **error)
 {
   gboolean ret = FALSE;
-  g_autofree char *summary_url = NULL;
-  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) summary = NULL;
   g_autoptr(GHashTable) local_refs = NULL;
   g_autofree char *local_title = NULL;
 
   local_refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
 
-  summary_url = g_build_filename (repository_url, "summary", NULL);
-  if (load_contents (summary_url, &bytes, cancellable, NULL))
+  if (!xdg_app_load_summary (repository_url, NULL, &summary, cancellable, error))
+    goto out;
+
+  if (summary)
     {
-      g_autoptr(GVariant) summary;
       g_autoptr(GVariant) ref_list;
       g_autoptr(GVariant) extensions;
       GVariantDict dict;
       int i, n;
 
-      summary = g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT, bytes, FALSE);
       ref_list = g_variant_get_child_value (summary, 0);
       extensions = g_variant_get_child_value (summary, 1);
 
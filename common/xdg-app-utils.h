@@ -32,6 +32,9 @@
 
 gboolean xdg_app_fail (GError **error, const char *format, ...);
 
+void xdg_app_set_debug_enabled (gboolean enabled);
+gboolean xdg_app_debug_enabled (void);
+
 const char * xdg_app_get_arch (void);
 
 gboolean xdg_app_has_name_prefix (const char *string,
@@ -72,6 +75,18 @@ gboolean xdg_app_overlay_symlink_tree (GFile    *source,
 gboolean xdg_app_remove_dangling_symlinks (GFile    *dir,
                                            GCancellable  *cancellable,
                                            GError       **error);
+gboolean xdg_app_rm_rf_parallel (GFile         *dir,
+                                 GCancellable  *cancellable,
+                                 GError       **error);
+
+gboolean xdg_app_load_summary (const char   *repository_url,
+                               GFile        *cache_file,
+                               GVariant    **out_summary,
+                               GCancellable *cancellable,
+                               GError      **error);
+gboolean xdg_app_summary_lookup_ref (GVariant   *summary,
+                                     const char *ref,
+                                     char      **out_checksum);
 
 gboolean ostree_repo_load_summary (const char *repository_url,
                                    GHashTable **refs,
@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Measure the launch latency of "xdg-app run", per stage.
+#
+# Usage: run-benchmark.sh [-n COUNT] [-c COMMAND] APP
+#
+# Launches APP COUNT times cold (page cache dropped before each launch,
+# needs sudo) and COUNT times warm, with --timing, and prints the mean,
+# min and max time at which each stage finished, plus the total wall time.
+
+set -e
+
+count=10
+command=true
+xdg_app=${XDG_APP:-xdg-app}
+
+while getopts "n:c:" opt; do
+    case $opt in
+        n) count=$OPTARG ;;
+        c) command=$OPTARG ;;
+        *) echo "Usage: $0 [-n COUNT] [-c COMMAND] APP" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 [-n COUNT] [-c COMMAND] APP" >&2
+    exit 1
+fi
+app=$1
+
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+drop_caches () {
+    sync
+    if ! echo 3 | sudo -n tee /proc/sys/vm/drop_caches > /dev/null 2>&1; then
+        if [ -z "$warned" ]; then
+            echo "Can't drop caches (needs passwordless sudo), cold numbers will be warm" >&2
+            warned=1
+        fi
+    fi
+}
+
+run_once () {
+    start=$(date +%s%N)
+    "$xdg_app" run --timing --command="$command" "$app" 2>> "$log" > /dev/null
+    end=$(date +%s%N)
+    printf "xdg-app-timing: total wall %d.%03d ms\n" \
+           $(( (end - start) / 1000000 )) $(( (end - start) / 1000 % 1000 )) >> "$log"
+}
+
+report () {
+    # Lines look like: xdg-app-timing: PROCESS STAGE MS ms (+DELTA ms)
+    awk -v label="$1" '
+        $1 == "xdg-app-timing:" {
+            key = $2 " " $3
+            if (!(key in n)) { order[++nkeys] = key; min[key] = $4; max[key] = $4 }
+            n[key]++; sum[key] += $4
+            if ($4 < min[key]) min[key] = $4
+            if ($4 > max[key]) max[key] = $4
+        }
+        END {
+            printf "%s:\n", label
+            printf "  %-28s %10s %10s %10s\n", "stage", "mean ms", "min ms", "max ms"
+            for (i = 1; i <= nkeys; i++) {
+                k = order[i]
+                printf "  %-28s %10.3f %10.3f %10.3f\n", k, sum[k] / n[k], min[k], max[k]
+            }
+        }' "$log"
+}
+
+: > "$log"
+for i in $(seq "$count"); do
+    drop_caches
+    run_once
+done
+report "cold ($count runs)"
+
+: > "$log"
+run_once # Prime the caches
+: > "$log"
+for i in $(seq "$count"); do
+    run_once
+done
+report "warm ($count runs)"
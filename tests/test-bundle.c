@@ -0,0 +1,281 @@
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <ostree.h>
+#include "libglnx/libglnx.h"
+#include <xdg-app-bundle.h>
+
+char outdir[] = "/tmp/xdg-app-bundle-test-XXXXXX";
+
+static OstreeRepo *
+create_repo (const char *name)
+{
+  g_autofree char *path = g_build_filename (outdir, name, NULL);
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  OstreeRepo *repo;
+  GError *error = NULL;
+
+  repo = ostree_repo_new (file);
+  ostree_repo_create (repo, OSTREE_REPO_MODE_ARCHIVE_Z2, NULL, &error);
+  g_assert_no_error (error);
+
+  return repo;
+}
+
+static char *
+create_commit (OstreeRepo *repo)
+{
+  g_autofree char *tree_path = g_build_filename (outdir, "tree", NULL);
+  g_autofree char *subdir_path = g_build_filename (tree_path, "files", "bin", NULL);
+  g_autofree char *big_path = g_build_filename (tree_path, "files", "big", NULL);
+  g_autofree char *small_path = g_build_filename (subdir_path, "small", NULL);
+  g_autofree char *big = NULL;
+  g_autoptr(GFile) tree = g_file_new_for_path (tree_path);
+  g_autoptr(OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+  g_autoptr(GFile) root = NULL;
+  char *commit = NULL;
+  GError *error = NULL;
+  gsize big_size = 5 * 1024 * 1024;
+  gsize i;
+
+  g_assert (g_mkdir_with_parents (subdir_path, 0755) == 0);
+
+  /* Larger than a part, and not very compressible */
+  big = g_malloc (big_size);
+  for (i = 0; i < big_size; i++)
+    big[i] = g_random_int_range (0, 256);
+  g_file_set_contents (big_path, big, big_size, &error);
+  g_assert_no_error (error);
+  g_file_set_contents (small_path, "#!/bin/sh\necho hello\n", -1, &error);
+  g_assert_no_error (error);
+
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_directory_to_mtree (repo, tree, mtree, NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_mtree (repo, mtree, &root, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_commit (repo, NULL, "test", NULL, NULL, OSTREE_REPO_FILE (root),
+                            &commit, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_commit_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  return commit;
+}
+
+static GVariant *
+create_metadata (void)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "ref", g_variant_new_string ("app/org.test.App/x86_64/master"));
+
+  return g_variant_builder_end (&builder);
+}
+
+static gboolean
+apply_bundle (GFile       *file,
+              OstreeRepo  *repo,
+              char       **out_commit,
+              GError     **error)
+{
+  g_autoptr(GInputStream) stream = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(GVariant) detached = NULL;
+  XdgAppBundleCompression compression;
+  guint64 remaining;
+
+  stream = xdg_app_bundle_open (file, &metadata, out_commit, &detached, &compression,
+                                &remaining, NULL, error);
+  if (stream == NULL)
+    return FALSE;
+
+  if (!ostree_repo_prepare_transaction (repo, NULL, NULL, error))
+    return FALSE;
+
+  if (!xdg_app_bundle_apply (repo, stream, compression, remaining, NULL, error))
+    {
+      ostree_repo_abort_transaction (repo, NULL, NULL);
+      return FALSE;
+    }
+
+  return ostree_repo_commit_transaction (repo, NULL, NULL, error);
+}
+
+static void
+assert_same_file (OstreeRepo *repo_a,
+                  OstreeRepo *repo_b,
+                  const char *commit,
+                  const char *path)
+{
+  g_autoptr(GFile) root_a = NULL;
+  g_autoptr(GFile) root_b = NULL;
+  g_autoptr(GFile) file_a = NULL;
+  g_autoptr(GFile) file_b = NULL;
+  g_autofree char *data_a = NULL;
+  g_autofree char *data_b = NULL;
+  gsize len_a, len_b;
+  GError *error = NULL;
+
+  ostree_repo_read_commit (repo_a, commit, &root_a, NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_read_commit (repo_b, commit, &root_b, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  file_a = g_file_resolve_relative_path (root_a, path);
+  file_b = g_file_resolve_relative_path (root_b, path);
+  g_file_load_contents (file_a, NULL, &data_a, &len_a, NULL, &error);
+  g_assert_no_error (error);
+  g_file_load_contents (file_b, NULL, &data_b, &len_b, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpuint (len_a, ==, len_b);
+  g_assert (memcmp (data_a, data_b, len_a) == 0);
+}
+
+static void
+test_round_trip (XdgAppBundleCompression compression,
+                 const char             *name)
+{
+  g_autofree char *src_name = g_strconcat (name, "-src", NULL);
+  g_autofree char *dest_name = g_strconcat (name, "-dest", NULL);
+  g_autofree char *bundle_path = g_strconcat (outdir, "/", name, ".bundle", NULL);
+  g_autoptr(OstreeRepo) src = create_repo (src_name);
+  g_autoptr(OstreeRepo) dest = create_repo (dest_name);
+  g_autoptr(GFile) bundle = g_file_new_for_path (bundle_path);
+  g_autofree char *commit = create_commit (src);
+  g_autofree char *applied_commit = NULL;
+  GError *error = NULL;
+
+  xdg_app_bundle_write (src, NULL, commit, create_metadata (), compression, bundle, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (xdg_app_bundle_is_indexed (bundle, NULL));
+
+  apply_bundle (bundle, dest, &applied_commit, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (applied_commit, ==, commit);
+
+  assert_same_file (src, dest, commit, "files/big");
+  assert_same_file (src, dest, commit, "files/bin/small");
+}
+
+static void
+test_round_trip_zlib (void)
+{
+  test_round_trip (XDG_APP_BUNDLE_COMPRESSION_ZLIB, "zlib");
+}
+
+static void
+test_round_trip_none (void)
+{
+  test_round_trip (XDG_APP_BUNDLE_COMPRESSION_NONE, "none");
+}
+
+static void
+test_truncated (void)
+{
+  g_autofree char *bundle_path = g_build_filename (outdir, "truncated.bundle", NULL);
+  g_autofree char *truncated_path = g_build_filename (outdir, "truncated-copy.bundle", NULL);
+  g_autoptr(OstreeRepo) src = create_repo ("truncated-src");
+  g_autoptr(GFile) bundle = g_file_new_for_path (bundle_path);
+  g_autoptr(GFile) truncated = g_file_new_for_path (truncated_path);
+  g_autofree char *commit = create_commit (src);
+  g_autofree char *data = NULL;
+  gsize len;
+  gsize cut_lengths[4];
+  GError *error = NULL;
+  int i;
+
+  xdg_app_bundle_write (src, NULL, commit, create_metadata (), XDG_APP_BUNDLE_COMPRESSION_ZLIB,
+                        bundle, NULL, &error);
+  g_assert_no_error (error);
+
+  g_file_get_contents (bundle_path, &data, &len, &error);
+  g_assert_no_error (error);
+
+  /* In the header, in the first part, in the index, in the trailer */
+  cut_lengths[0] = 20;
+  cut_lengths[1] = len / 2;
+  cut_lengths[2] = len - 30;
+  cut_lengths[3] = len - 1;
+
+  for (i = 0; i < G_N_ELEMENTS (cut_lengths); i++)
+    {
+      g_autofree char *dest_name = g_strdup_printf ("truncated-dest-%d", i);
+      g_autoptr(OstreeRepo) dest = create_repo (dest_name);
+      g_autofree char *applied_commit = NULL;
+      gboolean have_commit;
+
+      g_file_set_contents (truncated_path, data, cut_lengths[i], &error);
+      g_assert_no_error (error);
+
+      g_assert (!apply_bundle (truncated, dest, &applied_commit, &error));
+      g_assert (error != NULL);
+      g_clear_error (&error);
+
+      /* The commit must not show up without the rest of its objects */
+      ostree_repo_has_object (dest, OSTREE_OBJECT_TYPE_COMMIT, commit, &have_commit, NULL, &error);
+      g_assert_no_error (error);
+      g_assert (!have_commit);
+    }
+}
+
+static void
+test_corrupt_size (void)
+{
+  g_autofree char *bundle_path = g_build_filename (outdir, "corrupt.bundle", NULL);
+  g_autoptr(OstreeRepo) src = create_repo ("corrupt-src");
+  g_autoptr(OstreeRepo) dest = create_repo ("corrupt-dest");
+  g_autoptr(GFile) bundle = g_file_new_for_path (bundle_path);
+  g_autofree char *commit = create_commit (src);
+  g_autofree char *applied_commit = NULL;
+  g_autofree char *data = NULL;
+  guint64 header_size, huge = GUINT64_TO_BE (G_MAXUINT64 / 2);
+  gsize len;
+  GError *error = NULL;
+
+  xdg_app_bundle_write (src, NULL, commit, create_metadata (), XDG_APP_BUNDLE_COMPRESSION_NONE,
+                        bundle, NULL, &error);
+  g_assert_no_error (error);
+
+  g_file_get_contents (bundle_path, &data, &len, &error);
+  g_assert_no_error (error);
+
+  /* Make the size of the first part huge, this must fail, not abort */
+  memcpy (&header_size, data + 8, sizeof (header_size));
+  header_size = GUINT64_FROM_BE (header_size);
+  g_assert_cmpuint (8 + 8 + header_size + 8, <, len);
+  memcpy (data + 8 + 8 + header_size, &huge, sizeof (huge));
+
+  g_file_set_contents (bundle_path, data, len, &error);
+  g_assert_no_error (error);
+
+  g_assert (!apply_bundle (bundle, dest, &applied_commit, &error));
+  g_assert (error != NULL);
+  g_clear_error (&error);
+}
+
+int
+main (int argc, char **argv)
+{
+  int res;
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_mkdtemp (outdir);
+
+  g_test_add_func ("/bundle/round-trip-zlib", test_round_trip_zlib);
+  g_test_add_func ("/bundle/round-trip-none", test_round_trip_none);
+  g_test_add_func ("/bundle/truncated", test_truncated);
+  g_test_add_func ("/bundle/corrupt-size", test_corrupt_size);
+
+  res = g_test_run ();
+
+  glnx_shutil_rm_rf_at (-1, outdir, NULL, NULL);
+
+  return res;
+}
@@ -0,0 +1,340 @@
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include "libglnx/libglnx.h"
+#include <xdg-app-dir.h>
+
+#define EXEC_PREFIX XDG_APP_BINDIR "/xdg-app run --branch=master --arch=x86_64"
+
+static char *
+rewrite (const char  *name,
+         const char  *data,
+         GError     **error)
+{
+  g_autofree char *new_data = NULL;
+  gsize new_data_len;
+
+  new_data = xdg_app_rewrite_desktop_data ("org.test.App", "master", "x86_64", name,
+                                           data, strlen (data), &new_data_len, error);
+  if (new_data != NULL)
+    g_assert_cmpuint (strlen (new_data), ==, new_data_len);
+
+  return g_steal_pointer (&new_data);
+}
+
+/* Rewrites @data, which must succeed, checks that the result is
+   @expected and that GKeyFile can load it */
+static GKeyFile *
+assert_rewrite (const char *name,
+                const char *data,
+                const char *expected)
+{
+  g_autofree char *new_data = NULL;
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  GError *error = NULL;
+
+  new_data = rewrite (name, data, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (new_data, ==, expected);
+
+  g_key_file_load_from_data (keyfile, new_data, -1, G_KEY_FILE_KEEP_TRANSLATIONS, &error);
+  g_assert_no_error (error);
+
+  return g_steal_pointer (&keyfile);
+}
+
+/* Rewriting @data must fail, and so must loading it with GKeyFile */
+static void
+assert_rewrite_fails (const char *name,
+                      const char *data)
+{
+  g_autofree char *new_data = NULL;
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  GError *error = NULL;
+
+  new_data = rewrite (name, data, &error);
+  g_assert (new_data == NULL);
+  g_assert (error != NULL);
+  g_clear_error (&error);
+
+  g_assert (!g_key_file_load_from_data (keyfile, data, -1, G_KEY_FILE_NONE, &error));
+  g_clear_error (&error);
+}
+
+static void
+test_translations (void)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_autofree char *name = NULL;
+  g_autofree char *comment = NULL;
+
+  keyfile = assert_rewrite ("org.test.App.desktop",
+                            "[Desktop Entry]\n"
+                            "Name=Test\n"
+                            "Name[de]=Prüfung\n"
+                            "Comment=A test\n"
+                            "Comment[fr_FR]=Un test\n"
+                            "Exec=test-app %U\n"
+                            "Icon=org.test.App\n",
+                            "[Desktop Entry]\n"
+                            "Name=Test\n"
+                            "Name[de]=Prüfung\n"
+                            "Comment=A test\n"
+                            "Comment[fr_FR]=Un test\n"
+                            "Exec=" EXEC_PREFIX " --command=test-app org.test.App %U\n"
+                            "Icon=org.test.App\n");
+
+  name = g_key_file_get_locale_string (keyfile, "Desktop Entry", "Name", "de", NULL);
+  g_assert_cmpstr (name, ==, "Prüfung");
+  comment = g_key_file_get_locale_string (keyfile, "Desktop Entry", "Comment", "fr_FR", NULL);
+  g_assert_cmpstr (comment, ==, "Un test");
+}
+
+static void
+test_groups (void)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_autofree char *exec = NULL;
+
+  keyfile = assert_rewrite ("org.test.App.desktop",
+                            "# A comment\n"
+                            "[Desktop Entry]\n"
+                            "Name=Test\n"
+                            "Exec=test-app %U\n"
+                            "Actions=new;\n"
+                            "\n"
+                            "[Desktop Action new]\n"
+                            "Name=New Window\n"
+                            "Exec=test-app --new-window\n",
+                            "# A comment\n"
+                            "[Desktop Entry]\n"
+                            "Name=Test\n"
+                            "Exec=" EXEC_PREFIX " --command=test-app org.test.App %U\n"
+                            "Actions=new;\n"
+                            "\n"
+                            "[Desktop Action new]\n"
+                            "Name=New Window\n"
+                            "Exec=" EXEC_PREFIX " --command=test-app org.test.App --new-window\n");
+
+  exec = g_key_file_get_string (keyfile, "Desktop Action new", "Exec", NULL);
+  g_assert_cmpstr (exec, ==, EXEC_PREFIX " --command=test-app org.test.App --new-window");
+}
+
+static void
+test_duplicate_exec (void)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+
+  /* GKeyFile uses the last one, so that is the one we rewrite */
+  keyfile = assert_rewrite ("org.test.App.desktop",
+                            "[Desktop Entry]\n"
+                            "Exec=first\n"
+                            "Name=Test\n"
+                            "Exec=second %F\n"
+                            "Type=Application\n",
+                            "[Desktop Entry]\n"
+                            "Name=Test\n"
+                            "Exec=" EXEC_PREFIX " --command=second org.test.App %F\n"
+                            "Type=Application\n");
+}
+
+static void
+test_no_exec (void)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+
+  /* The Exec line goes after the last key of each group */
+  keyfile = assert_rewrite ("org.test.App.desktop",
+                            "[Desktop Entry]\n"
+                            "Name=Test\n"
+                            "Type=Application\n"
+                            "\n"
+                            "[Desktop Action new]\n"
+                            "Name=New Window\n",
+                            "[Desktop Entry]\n"
+                            "Name=Test\n"
+                            "Type=Application\n"
+                            "Exec=" EXEC_PREFIX " org.test.App\n"
+                            "\n"
+                            "[Desktop Action new]\n"
+                            "Name=New Window\n"
+                            "Exec=" EXEC_PREFIX " org.test.App\n");
+}
+
+static void
+test_removed_keys (void)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+
+  keyfile = assert_rewrite ("org.test.App.desktop",
+                            "[Desktop Entry]\n"
+                            "Name=Test\n"
+                            "TryExec=test-app\n"
+                            "Exec=test-app\n"
+                            "X-GNOME-Bugzilla-ExtraInfoScript=/app/bin/bug-info\n"
+                            "X-Other=kept\n",
+                            "[Desktop Entry]\n"
+                            "Name=Test\n"
+                            "Exec=" EXEC_PREFIX " --command=test-app org.test.App\n"
+                            "X-Other=kept\n");
+
+  g_assert (!g_key_file_has_key (keyfile, "Desktop Entry", "TryExec", NULL));
+  g_assert (!g_key_file_has_key (keyfile, "Desktop Entry", "X-GNOME-Bugzilla-ExtraInfoScript", NULL));
+}
+
+static void
+test_escapes (void)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_autoptr(GKeyFile) invalid_keyfile = NULL;
+  g_autofree char *comment = NULL;
+  g_autofree char *exec = NULL;
+
+  /* Other values are copied still escaped, and the arguments of Exec
+     are unescaped, quoted for the shell and escaped again */
+  keyfile = assert_rewrite ("org.test.App.desktop",
+                            "[Desktop Entry]\n"
+                            "Comment=Line one\\nline two\n"
+                            "Exec=test-app \"a\\\\b\" 'c d' %U\n",
+                            "[Desktop Entry]\n"
+                            "Comment=Line one\\nline two\n"
+                            "Exec=" EXEC_PREFIX " --command=test-app org.test.App 'a\\\\b' 'c d' %U\n");
+
+  comment = g_key_file_get_string (keyfile, "Desktop Entry", "Comment", NULL);
+  g_assert_cmpstr (comment, ==, "Line one\nline two");
+  exec = g_key_file_get_string (keyfile, "Desktop Entry", "Exec", NULL);
+  g_assert_cmpstr (exec, ==, EXEC_PREFIX " --command=test-app org.test.App 'a\\b' 'c d' %U");
+
+  /* An invalid escape makes the Exec line unreadable, so it is
+     replaced with one that just runs the app */
+  invalid_keyfile = assert_rewrite ("org.test.App.desktop",
+                                    "[Desktop Entry]\n"
+                                    "Exec=test-app \\q\n",
+                                    "[Desktop Entry]\n"
+                                    "Exec=" EXEC_PREFIX " org.test.App\n");
+}
+
+static void
+test_crlf (void)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_autofree char *name = NULL;
+
+  keyfile = assert_rewrite ("org.test.App.desktop",
+                            "[Desktop Entry]\r\n"
+                            "Name=Test\r\n"
+                            "Exec=test-app %U\r\n"
+                            "Icon=org.test.App\r\n",
+                            "[Desktop Entry]\r\n"
+                            "Name=Test\r\n"
+                            "Exec=" EXEC_PREFIX " --command=test-app org.test.App %U\r\n"
+                            "Icon=org.test.App\r\n");
+
+  name = g_key_file_get_string (keyfile, "Desktop Entry", "Name", NULL);
+  g_assert_cmpstr (name, ==, "Test");
+}
+
+static void
+test_service_name (void)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+  g_autoptr(GKeyFile) crlf_keyfile = NULL;
+  g_autofree char *new_data = NULL;
+  GError *error = NULL;
+
+  keyfile = assert_rewrite ("org.test.App.service",
+                            "[D-BUS Service]\n"
+                            "Name=org.test.App\n"
+                            "Exec=/app/bin/test-app\n",
+                            "[D-BUS Service]\n"
+                            "Name=org.test.App\n"
+                            "Exec=" EXEC_PREFIX " --command=/app/bin/test-app org.test.App\n");
+
+  crlf_keyfile = assert_rewrite ("org.test.App.service",
+                                 "[D-BUS Service]\r\n"
+                                 "Name=org.test.App\r\n",
+                                 "[D-BUS Service]\r\n"
+                                 "Name=org.test.App\r\n"
+                                 "Exec=" EXEC_PREFIX " org.test.App\r\n");
+
+  new_data = rewrite ("org.test.App.service",
+                      "[D-BUS Service]\n"
+                      "Name=org.test.Other\n"
+                      "Exec=/app/bin/test-app\n",
+                      &error);
+  g_assert (new_data == NULL);
+  g_assert (error != NULL);
+  g_clear_error (&error);
+
+  new_data = rewrite ("org.test.App.service",
+                      "[D-BUS Service]\n"
+                      "Exec=/app/bin/test-app\n",
+                      &error);
+  g_assert (new_data == NULL);
+  g_assert (error != NULL);
+  g_clear_error (&error);
+
+  /* The Name must be in the D-BUS Service group */
+  new_data = rewrite ("org.test.App.service",
+                      "[D-BUS Service]\n"
+                      "Exec=/app/bin/test-app\n"
+                      "[Other]\n"
+                      "Name=org.test.App\n",
+                      &error);
+  g_assert (new_data == NULL);
+  g_assert (error != NULL);
+  g_clear_error (&error);
+}
+
+static void
+test_invalid (void)
+{
+  g_autoptr(GKeyFile) keyfile = NULL;
+
+  assert_rewrite_fails ("org.test.App.desktop",
+                        "[Desktop Entry]junk\n"
+                        "Name=Test\n");
+  assert_rewrite_fails ("org.test.App.desktop",
+                        "[Desktop Entry] ]\n"
+                        "Name=Test\n");
+  assert_rewrite_fails ("org.test.App.desktop",
+                        "[Desktop Entry\n"
+                        "Name=Test\n");
+  assert_rewrite_fails ("org.test.App.desktop",
+                        "Name=Test\n"
+                        "[Desktop Entry]\n");
+  assert_rewrite_fails ("org.test.App.desktop",
+                        "[Desktop Entry]\n"
+                        "Name\n");
+  assert_rewrite_fails ("org.test.App.desktop",
+                        "[Desktop Entry]\n"
+                        "Name=\xff\n");
+
+  /* Whitespace after the ] is fine */
+  keyfile = assert_rewrite ("org.test.App.desktop",
+                            "[Desktop Entry] \t\n"
+                            "Name=Test\n",
+                            "[Desktop Entry] \t\n"
+                            "Name=Test\n"
+                            "Exec=" EXEC_PREFIX " org.test.App\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/exports/translations", test_translations);
+  g_test_add_func ("/exports/groups", test_groups);
+  g_test_add_func ("/exports/duplicate-exec", test_duplicate_exec);
+  g_test_add_func ("/exports/no-exec", test_no_exec);
+  g_test_add_func ("/exports/removed-keys", test_removed_keys);
+  g_test_add_func ("/exports/escapes", test_escapes);
+  g_test_add_func ("/exports/crlf", test_crlf);
+  g_test_add_func ("/exports/service-name", test_service_name);
+  g_test_add_func ("/exports/invalid", test_invalid);
+
+  return g_test_run ();
+}